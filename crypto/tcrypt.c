@@ -33,6 +33,7 @@
 #include <linux/jiffies.h>
 #include <linux/timex.h>
 #include <linux/interrupt.h>
+#include <asm/div64.h>
 #include "tcrypt.h"
 #include "internal.h"
 
@@ -64,7 +65,7 @@ static char *check[] = {
 	"cast6", "arc4", "michael_mic", "deflate", "crc32c", "tea", "xtea",
 	"khazad", "wp512", "wp384", "wp256", "tnepres", "xeta",  "fcrypt",
 	"camellia", "seed", "salsa20", "rmd128", "rmd160", "rmd256", "rmd320",
-	"lzo", "cts", "zlib", NULL
+	"lzo", "cts", "zlib", "lz4", NULL
 };
 
 static int test_cipher_jiffies(struct blkcipher_desc *desc, int enc,
@@ -719,6 +720,100 @@ out:
 	crypto_free_ahash(tfm);
 }
 
+/*
+ * Fill a page with data resembling anonymous memory: a mix of zero
+ * runs, repeated fragments and random bytes. The generator is seeded
+ * identically on every run so that compression ratios are comparable
+ * between algorithms.
+ */
+static void test_comp_fill(u8 *buf)
+{
+	u32 seed = 0x12345678;
+	unsigned int i, j;
+
+	for (i = 0; i < PAGE_SIZE; i += 64) {
+		seed = seed * 1103515245 + 12345;
+		switch ((seed >> 16) & 3) {
+		case 0:
+			memset(buf + i, 0, 64);
+			break;
+		case 1:
+		case 2:
+			if (i >= 256) {
+				memcpy(buf + i, buf + i - 256, 64);
+				buf[i + ((seed >> 8) & 63)] ^= 1;
+				break;
+			}
+			/* fall through */
+		default:
+			for (j = 0; j < 64; j++) {
+				seed = seed * 1103515245 + 12345;
+				buf[i + j] = seed >> 16;
+			}
+		}
+	}
+}
+
+static void test_comp_speed(const char *algo, unsigned int sec)
+{
+	struct crypto_comp *tfm;
+	unsigned long start, end;
+	unsigned int dlen, clen = 0;
+	u64 pages, kbps;
+	u8 *src = tvmem[0], *dst = tvmem[1], *back = tvmem[2];
+	int ret;
+
+	printk(KERN_INFO "\ntesting speed of %s compression\n", algo);
+
+	tfm = crypto_alloc_comp(algo, 0, 0);
+	if (IS_ERR(tfm)) {
+		printk(KERN_ERR "failed to load transform for %s: %ld\n",
+		       algo, PTR_ERR(tfm));
+		return;
+	}
+
+	if (!sec)
+		sec = 1;
+
+	test_comp_fill(src);
+
+	for (start = jiffies, end = start + sec * HZ, pages = 0;
+	     time_before(jiffies, end); pages++) {
+		dlen = PAGE_SIZE;
+		ret = crypto_comp_compress(tfm, src, PAGE_SIZE, dst, &dlen);
+		if (ret) {
+			printk(KERN_ERR "compression failed: %d\n", ret);
+			goto out;
+		}
+		clen = dlen;
+	}
+	kbps = pages * (PAGE_SIZE / 1024);
+	do_div(kbps, sec);
+	printk(KERN_INFO "compress: %llu pages in %u seconds = %llu KB/s, "
+	       "ratio %u%%\n", pages, sec, kbps,
+	       clen * 100 / (unsigned int)PAGE_SIZE);
+
+	for (start = jiffies, end = start + sec * HZ, pages = 0;
+	     time_before(jiffies, end); pages++) {
+		dlen = PAGE_SIZE;
+		ret = crypto_comp_decompress(tfm, dst, clen, back, &dlen);
+		if (ret || dlen != PAGE_SIZE) {
+			printk(KERN_ERR "decompression failed: %d\n", ret);
+			goto out;
+		}
+	}
+	kbps = pages * (PAGE_SIZE / 1024);
+	do_div(kbps, sec);
+	printk(KERN_INFO "decompress: %llu pages in %u seconds = %llu KB/s\n",
+	       pages, sec, kbps);
+
+	if (memcmp(src, back, PAGE_SIZE))
+		printk(KERN_ERR "%s: decompressed data mismatch\n", algo);
+
+out:
+	crypto_free_comp(tfm);
+}
+
 static void test_available(void)
 {
 	char **name = check;
@@ -944,6 +1039,10 @@ static int do_test(int m)
 		ret += tcrypt_test("rfc4309(ccm(aes))");
 		break;
 
+	case 46:
+		ret += tcrypt_test("lz4");
+		break;
+
 	case 100:
 		ret += tcrypt_test("hmac(md5)");
 		break;
@@ -1231,6 +1330,24 @@ static int do_test(int m)
 	case 499:
 		break;
 
+	case 500:
+		/* fall through */
+
+	case 501:
+		test_comp_speed("lzo", sec);
+		if (mode > 500 && mode < 600) break;
+
+	case 502:
+		test_comp_speed("lz4", sec);
+		if (mode > 500 && mode < 600) break;
+
+	case 503:
+		test_comp_speed("deflate", sec);
+		if (mode > 500 && mode < 600) break;
+
+	case 599:
+		break;
+
 	case 1000:
 		test_available();
 		break;
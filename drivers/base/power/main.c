@@ -187,6 +187,30 @@ static void initcall_debug_report(struct device *dev, ktime_t calltime,
 	}
 }
 
+/*
+ * Only system suspend and resume are tracked, as the phases of the
+ * hibernation transitions have no entry in enum pm_latency_phase.
+ */
+static void pm_latency_report(struct device *dev, pm_message_t state,
+			      bool noirq, ktime_t start)
+{
+	enum pm_latency_phase phase;
+
+	switch (state.event) {
+	case PM_EVENT_SUSPEND:
+		phase = noirq ? PM_LATENCY_DEVICE_SUSPEND_NOIRQ :
+				PM_LATENCY_DEVICE_SUSPEND;
+		break;
+	case PM_EVENT_RESUME:
+		phase = noirq ? PM_LATENCY_DEVICE_RESUME_NOIRQ :
+				PM_LATENCY_DEVICE_RESUME;
+		break;
+	default:
+		return;
+	}
+	pm_latency_handler(phase, dev_name(dev), NULL, start);
+}
+
 /**
  * dpm_wait - Wait for a PM operation to complete.
  * @dev: Device to wait for.
@@ -223,9 +247,10 @@ static int pm_op(struct device *dev,
 		 pm_message_t state)
 {
 	int error = 0;
-	ktime_t calltime;
+	ktime_t calltime, start;
 
 	calltime = initcall_debug_start(dev);
+	start = pm_latency_start();
 
 	switch (state.event) {
 #ifdef CONFIG_SUSPEND
@@ -274,6 +299,7 @@ static int pm_op(struct device *dev,
 		error = -EINVAL;
 	}
 
+	pm_latency_report(dev, state, false, start);
 	initcall_debug_report(dev, calltime, error);
 
 	return error;
@@ -293,7 +319,7 @@ static int pm_noirq_op(struct device *dev,
 			pm_message_t state)
 {
 	int error = 0;
-	ktime_t calltime = ktime_set(0, 0), delta, rettime;
+	ktime_t calltime = ktime_set(0, 0), delta, rettime, start;
 
 	if (initcall_debug) {
 		pr_info("calling  %s+ @ %i, parent: %s\n",
@@ -301,6 +327,7 @@ static int pm_noirq_op(struct device *dev,
 				dev->parent ? dev_name(dev->parent) : "none");
 		calltime = ktime_get();
 	}
+	start = pm_latency_start();
 
 	switch (state.event) {
 #ifdef CONFIG_SUSPEND
@@ -349,6 +376,7 @@ static int pm_noirq_op(struct device *dev,
 		error = -EINVAL;
 	}
 
+	pm_latency_report(dev, state, true, start);
 	if (initcall_debug) {
 		rettime = ktime_get();
 		delta = ktime_sub(rettime, calltime);
@@ -491,13 +519,15 @@ EXPORT_SYMBOL_GPL(dpm_resume_noirq);
 static int legacy_resume(struct device *dev, int (*cb)(struct device *dev))
 {
 	int error;
-	ktime_t calltime;
+	ktime_t calltime, start;
 
 	calltime = initcall_debug_start(dev);
+	start = pm_latency_start();
 
 	error = cb(dev);
 	suspend_report_result(cb, error);
 
+	pm_latency_report(dev, PMSG_RESUME, false, start);
 	initcall_debug_report(dev, calltime, error);
 
 	return error;
@@ -851,13 +881,15 @@ static int legacy_suspend(struct device *dev, pm_message_t state,
 			  int (*cb)(struct device *dev, pm_message_t state))
 {
 	int error;
-	ktime_t calltime;
+	ktime_t calltime, start;
 
 	calltime = initcall_debug_start(dev);
+	start = pm_latency_start();
 
 	error = cb(dev, state);
 	suspend_report_result(cb, error);
 
+	pm_latency_report(dev, state, false, start);
 	initcall_debug_report(dev, calltime, error);
 
 	return error;
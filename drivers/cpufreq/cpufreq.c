@@ -130,6 +130,17 @@ static int __init init_cpufreq_transition_notifier_list(void)
 }
 pure_initcall(init_cpufreq_transition_notifier_list);
 
+/*
+ * Boost requests may come from any context, e.g. input events, and
+ * governors decide on a target from their timers, so the "boost" and
+ * "target" lists are atomic.
+ */
+static ATOMIC_NOTIFIER_HEAD(cpufreq_boost_notifier_list);
+static ATOMIC_NOTIFIER_HEAD(cpufreq_target_notifier_list);
+
+unsigned long cpufreq_boost_sources;
+EXPORT_SYMBOL_GPL(cpufreq_boost_sources);
+
 static LIST_HEAD(cpufreq_governor_list);
 static DEFINE_MUTEX(cpufreq_governor_mutex);
 
@@ -1365,12 +1376,16 @@ static struct syscore_ops cpufreq_syscore_ops = {
 /**
  *	cpufreq_register_notifier - register a driver with cpufreq
  *	@nb: notifier function to register
- *      @list: CPUFREQ_TRANSITION_NOTIFIER or CPUFREQ_POLICY_NOTIFIER
+ *      @list: CPUFREQ_TRANSITION_NOTIFIER, CPUFREQ_POLICY_NOTIFIER,
+ *	       CPUFREQ_BOOST_NOTIFIER or CPUFREQ_TARGET_NOTIFIER
  *
- *	Add a driver to one of two lists: either a list of drivers that
+ *	Add a driver to one of four lists: a list of drivers that
  *      are notified about clock rate changes (once before and once after
- *      the transition), or a list of drivers that are notified about
- *      changes in cpufreq policy.
+ *      the transition), a list of drivers that are notified about
+ *      changes in cpufreq policy, a list of governors that are
+ *      notified about boost requests (see cpufreq_notify_boost()), or
+ *      a list of drivers that are notified when a governor decides on
+ *      a new speed (see cpufreq_notify_target()).
  *
  *	This function may sleep, and has the same return conditions as
  *	blocking_notifier_chain_register.
@@ -1390,6 +1405,14 @@ int cpufreq_register_notifier(struct notifier_block *nb, unsigned int list)
 		ret = blocking_notifier_chain_register(
 				&cpufreq_policy_notifier_list, nb);
 		break;
+	case CPUFREQ_BOOST_NOTIFIER:
+		ret = atomic_notifier_chain_register(
+				&cpufreq_boost_notifier_list, nb);
+		break;
+	case CPUFREQ_TARGET_NOTIFIER:
+		ret = atomic_notifier_chain_register(
+				&cpufreq_target_notifier_list, nb);
+		break;
 	default:
 		ret = -EINVAL;
 	}
@@ -1402,7 +1425,8 @@ EXPORT_SYMBOL(cpufreq_register_notifier);
 /**
  *	cpufreq_unregister_notifier - unregister a driver with cpufreq
  *	@nb: notifier block to be unregistered
- *      @list: CPUFREQ_TRANSITION_NOTIFIER or CPUFREQ_POLICY_NOTIFIER
+ *      @list: CPUFREQ_TRANSITION_NOTIFIER, CPUFREQ_POLICY_NOTIFIER,
+ *	       CPUFREQ_BOOST_NOTIFIER or CPUFREQ_TARGET_NOTIFIER
  *
  *	Remove a driver from the CPU frequency notifier list.
  *
@@ -1422,6 +1446,14 @@ int cpufreq_unregister_notifier(struct notifier_block *nb, unsigned int list)
 		ret = blocking_notifier_chain_unregister(
 				&cpufreq_policy_notifier_list, nb);
 		break;
+	case CPUFREQ_BOOST_NOTIFIER:
+		ret = atomic_notifier_chain_unregister(
+				&cpufreq_boost_notifier_list, nb);
+		break;
+	case CPUFREQ_TARGET_NOTIFIER:
+		ret = atomic_notifier_chain_unregister(
+				&cpufreq_target_notifier_list, nb);
+		break;
 	default:
 		ret = -EINVAL;
 	}
@@ -1431,6 +1463,55 @@ int cpufreq_unregister_notifier(struct notifier_block *nb, unsigned int list)
 EXPORT_SYMBOL(cpufreq_unregister_notifier);
 
 
+/**
+ *	cpufreq_want_boost - say whether boosts from a source are wanted
+ *	@source: the kind of event
+ *	@want: whether a registered governor acts on it
+ *
+ *	cpufreq_notify_boost() for a @source nobody wants returns without
+ *	calling the CPUFREQ_BOOST_NOTIFIER list, so that callers on hot
+ *	paths cost next to nothing while boosting from them is off.
+ */
+void cpufreq_want_boost(enum cpufreq_boost_source source, bool want)
+{
+	if (want)
+		set_bit(source, &cpufreq_boost_sources);
+	else
+		clear_bit(source, &cpufreq_boost_sources);
+}
+EXPORT_SYMBOL_GPL(cpufreq_want_boost);
+
+/**
+ *	__cpufreq_notify_boost - ask the governors for a burst of speed
+ *	@source: the kind of event that calls for it
+ *
+ *	Calls the CPUFREQ_BOOST_NOTIFIER list with @source as the event,
+ *	so that callers need not depend on any particular governor. Use
+ *	cpufreq_notify_boost(), which skips this for sources no governor
+ *	wants. Safe to call from any context.
+ */
+void __cpufreq_notify_boost(enum cpufreq_boost_source source)
+{
+	atomic_notifier_call_chain(&cpufreq_boost_notifier_list, source,
+				   NULL);
+}
+EXPORT_SYMBOL_GPL(__cpufreq_notify_boost);
+
+/**
+ *	cpufreq_notify_target - report a governor's decision to change speed
+ *	@cpu: the CPU whose speed should change
+ *
+ *	Calls the CPUFREQ_TARGET_NOTIFIER list with @cpu as the event, so
+ *	that e.g. cpufreq_stats can measure how long the change takes to
+ *	happen. Safe to call from any context.
+ */
+void cpufreq_notify_target(unsigned int cpu)
+{
+	atomic_notifier_call_chain(&cpufreq_target_notifier_list, cpu, NULL);
+}
+EXPORT_SYMBOL_GPL(cpufreq_notify_target);
+
+
 /*********************************************************************
  *                              GOVERNORS                            *
  *********************************************************************/
@@ -19,8 +19,10 @@
 #include <linux/cpu.h>
 #include <linux/cpumask.h>
 #include <linux/cpufreq.h>
+#include <linux/input.h>
 #include <linux/mutex.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
 #include <linux/tick.h>
 #include <linux/time.h>
 #include <linux/timer.h>
@@ -30,6 +32,9 @@
 
 #include <asm/cputime.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/cpufreq_interactive.h>
+
 static atomic_t active_count = ATOMIC_INIT(0);
 
 struct cpufreq_interactive_cpuinfo {
@@ -45,6 +50,10 @@ struct cpufreq_interactive_cpuinfo {
 	struct cpufreq_frequency_table *freq_table;
 	unsigned int target_freq;
 	int governor_enabled;
+	/* load prediction state, in kHz of demand */
+	int predict_valid;
+	long predict_level;
+	long predict_trend;
 };
 
 static DEFINE_PER_CPU(struct cpufreq_interactive_cpuinfo, cpuinfo);
@@ -78,6 +87,52 @@ static unsigned long min_sample_time;
 #define DEFAULT_TIMER_RATE 20 * USEC_PER_MSEC
 static unsigned long timer_rate;
 
+/*
+ * Instead of scaling the current speed by the last window's load, predict
+ * the demand of the next window from the recent ones and pick the lowest
+ * speed that meets it. Bursts at or above go_hispeed_load are still
+ * handled as before, since the demand of a saturated CPU is unknown.
+ */
+static unsigned long predict_load;
+
+/* Weight, in percent, of the newest window in the smoothed demand */
+#define DEFAULT_PREDICT_LEVEL_WEIGHT 50
+static unsigned long predict_level_weight;
+
+/* Weight, in percent, of the newest change in the smoothed trend */
+#define DEFAULT_PREDICT_TREND_WEIGHT 30
+static unsigned long predict_trend_weight;
+
+/* Load the predicted demand should put on the chosen speed */
+#define DEFAULT_PREDICT_TARGET_LOAD 80
+static unsigned long predict_target_load;
+
+/*
+ * How long, in usecs, a boost keeps the CPUs at or above hispeed_freq,
+ * and whether input events and binder transactions someone in the
+ * foreground waits on (see binder_transaction()) trigger one.
+ */
+#define DEFAULT_BOOST_DURATION (80 * USEC_PER_MSEC)
+static unsigned long boost_duration;
+static unsigned long input_boost = 1;
+static unsigned long binder_boost;
+
+/*
+ * The last boost started at boost_start and lasts boost_len jiffies. Its
+ * end is not kept as a time to compare against with time_before(): that
+ * would read as in the future before the first boost (jiffies start out
+ * negative) and again whenever the last boost is more than LONG_MAX
+ * jiffies old.
+ */
+static unsigned long boost_start;
+static unsigned long boost_len;
+
+static inline int cpufreq_interactive_boosted(void)
+{
+	smp_rmb();
+	return jiffies - boost_start < boost_len;
+}
+
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event);
 
@@ -91,12 +146,45 @@ struct cpufreq_governor cpufreq_gov_interactive = {
 	.owner = THIS_MODULE,
 };
 
+/*
+ * Double exponential smoothing of the demand (load times speed) seen in
+ * each window: the level follows the demand, the trend follows its rate
+ * of change, and their sum is the demand expected in the next window.
+ */
+static unsigned int cpufreq_interactive_predict(
+	struct cpufreq_interactive_cpuinfo *pcpu, unsigned int demand)
+{
+	long level, trend, prediction;
+
+	if (!pcpu->predict_valid) {
+		level = demand;
+		trend = 0;
+		pcpu->predict_valid = 1;
+	} else {
+		level = ((long)predict_level_weight * demand +
+			 (100 - (long)predict_level_weight) *
+			 (pcpu->predict_level + pcpu->predict_trend)) / 100;
+		trend = ((long)predict_trend_weight *
+			 (level - pcpu->predict_level) +
+			 (100 - (long)predict_trend_weight) *
+			 pcpu->predict_trend) / 100;
+	}
+
+	pcpu->predict_level = level;
+	pcpu->predict_trend = trend;
+	prediction = level + trend;
+	return prediction > 0 ? prediction : 0;
+}
+
 static void cpufreq_interactive_timer(unsigned long data)
 {
 	unsigned int delta_idle;
 	unsigned int delta_time;
 	int cpu_load;
+	int window_load;
 	int load_since_change;
+	unsigned int predicted = 0;
+	unsigned int relation = CPUFREQ_RELATION_H;
 	u64 time_in_idle;
 	u64 idle_exit_time;
 	struct cpufreq_interactive_cpuinfo *pcpu =
@@ -143,6 +231,7 @@ static void cpufreq_interactive_timer(unsigned long data)
 		cpu_load = 0;
 	else
 		cpu_load = 100 * (delta_time - delta_idle) / delta_time;
+	window_load = cpu_load;
 
 	delta_idle = (unsigned int) cputime64_sub(now_idle,
 						pcpu->freq_change_time_in_idle);
@@ -163,17 +252,27 @@ static void cpufreq_interactive_timer(unsigned long data)
 	if (load_since_change > cpu_load)
 		cpu_load = load_since_change;
 
+	if (predict_load)
+		predicted = cpufreq_interactive_predict(pcpu,
+				pcpu->policy->cur * window_load / 100);
+
 	if (cpu_load >= go_hispeed_load) {
 		if (pcpu->policy->cur == pcpu->policy->min)
 			new_freq = hispeed_freq;
 		else
 			new_freq = pcpu->policy->max * cpu_load / 100;
+	} else if (predict_load) {
+		new_freq = predicted * 100 / predict_target_load;
+		relation = CPUFREQ_RELATION_L;
 	} else {
 		new_freq = pcpu->policy->cur * cpu_load / 100;
 	}
 
+	if (new_freq < hispeed_freq && cpufreq_interactive_boosted())
+		new_freq = hispeed_freq;
+
 	if (cpufreq_frequency_table_target(pcpu->policy, pcpu->freq_table,
-					   new_freq, CPUFREQ_RELATION_H,
+					   new_freq, relation,
 					   &index)) {
 		pr_warn_once("timer %d: cpufreq_frequency_table_target error\n",
 			     (int) data);
@@ -181,6 +280,8 @@ static void cpufreq_interactive_timer(unsigned long data)
 	}
 
 	new_freq = pcpu->freq_table[index].frequency;
+	trace_cpufreq_interactive_target(data, window_load, pcpu->policy->cur,
+					 predicted, new_freq);
 
 	if (pcpu->target_freq == new_freq)
 		goto rearm_if_notmax;
@@ -195,6 +296,8 @@ static void cpufreq_interactive_timer(unsigned long data)
 			goto rearm;
 	}
 
+	cpufreq_notify_target(data);
+
 	if (new_freq < pcpu->target_freq) {
 		pcpu->target_freq = new_freq;
 		spin_lock_irqsave(&down_cpumask_lock, flags);
@@ -295,6 +398,83 @@ static void cpufreq_interactive_idle_start(void)
 
 }
 
+/*
+ * Raise a CPU to hispeed_freq right away, without waiting for its timer.
+ * Returns whether the CPU was below that speed.
+ */
+static int cpufreq_interactive_boost_cpu(unsigned int cpu)
+{
+	struct cpufreq_interactive_cpuinfo *pcpu = &per_cpu(cpuinfo, cpu);
+	unsigned long flags;
+
+	if (!pcpu->governor_enabled || pcpu->target_freq >= hispeed_freq)
+		return 0;
+
+	pcpu->target_freq = hispeed_freq;
+	spin_lock_irqsave(&up_cpumask_lock, flags);
+	cpumask_set_cpu(cpu, &up_cpumask);
+	spin_unlock_irqrestore(&up_cpumask_lock, flags);
+	return 1;
+}
+
+static const char *boost_source_names[] = {
+	[CPUFREQ_BOOST_INPUT]	= "input",
+	[CPUFREQ_BOOST_BINDER]	= "binder",
+};
+
+/**
+ * cpufreq_interactive_boost - run at hispeed_freq for boost_duration
+ * @source:	what asked for the boost, checked against its tunable
+ *
+ * Only CPUs that are running are raised; an idle CPU is raised when it
+ * next exits idle within the boost, so a boost never keeps a shared
+ * clock up on behalf of CPUs that have nothing to do. Callable from any
+ * context, preemptible or not.
+ */
+static void cpufreq_interactive_boost(enum cpufreq_boost_source source)
+{
+	unsigned int cpu, this_cpu;
+	int raised = 0;
+
+	if (!atomic_read(&active_count))
+		return;
+	if (source == CPUFREQ_BOOST_INPUT && !input_boost)
+		return;
+	if (source == CPUFREQ_BOOST_BINDER && !binder_boost)
+		return;
+
+	boost_start = jiffies;
+	boost_len = usecs_to_jiffies(boost_duration);
+	smp_wmb();
+
+	/* we are not idle, whatever idling says, so stay on this cpu */
+	this_cpu = get_cpu();
+	for_each_online_cpu(cpu) {
+		smp_rmb();
+		if (per_cpu(cpuinfo, cpu).idling && cpu != this_cpu)
+			continue;
+		raised += cpufreq_interactive_boost_cpu(cpu);
+	}
+	put_cpu();
+
+	if (raised)
+		wake_up_process(up_task);
+	trace_cpufreq_interactive_boost(boost_source_names[source], raised);
+}
+
+/* Boost requests from outside cpufreq, see cpufreq_notify_boost() */
+static int cpufreq_interactive_boost_notifier(struct notifier_block *nb,
+					      unsigned long val, void *data)
+{
+	if (val < ARRAY_SIZE(boost_source_names))
+		cpufreq_interactive_boost(val);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block cpufreq_interactive_boost_nb = {
+	.notifier_call = cpufreq_interactive_boost_notifier,
+};
+
 static void cpufreq_interactive_idle_end(void)
 {
 	struct cpufreq_interactive_cpuinfo *pcpu =
@@ -303,6 +483,10 @@ static void cpufreq_interactive_idle_end(void)
 	pcpu->idling = 0;
 	smp_wmb();
 
+	if (cpufreq_interactive_boosted() &&
+	    cpufreq_interactive_boost_cpu(smp_processor_id()))
+		wake_up_process(up_task);
+
 	/*
 	 * Arm the timer for 1-2 ticks later if not already, and if the timer
 	 * function has already processed the previous load sampling
@@ -521,11 +705,125 @@ static ssize_t store_timer_rate(struct kobject *kobj,
 static struct global_attr timer_rate_attr = __ATTR(timer_rate, 0644,
 		show_timer_rate, store_timer_rate);
 
+static ssize_t show_predict_load(struct kobject *kobj,
+			struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", predict_load);
+}
+
+static ssize_t store_predict_load(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+	unsigned int cpu;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	/* start the history afresh, the old one may be long out of date */
+	for_each_possible_cpu(cpu)
+		per_cpu(cpuinfo, cpu).predict_valid = 0;
+	predict_load = !!val;
+	return count;
+}
+
+static struct global_attr predict_load_attr = __ATTR(predict_load, 0644,
+		show_predict_load, store_predict_load);
+
+/* The other prediction tunables are all percentages */
+#define predict_percent_attr(name)					\
+static ssize_t show_##name(struct kobject *kobj,			\
+			struct attribute *attr, char *buf)		\
+{									\
+	return sprintf(buf, "%lu\n", name);				\
+}									\
+									\
+static ssize_t store_##name(struct kobject *kobj,			\
+			struct attribute *attr, const char *buf,	\
+			size_t count)					\
+{									\
+	int ret;							\
+	unsigned long val;						\
+									\
+	ret = strict_strtoul(buf, 0, &val);				\
+	if (ret < 0)							\
+		return ret;						\
+	if (val < 1 || val > 100)					\
+		return -EINVAL;						\
+	name = val;							\
+	return count;							\
+}									\
+									\
+static struct global_attr name##_attr = __ATTR(name, 0644,		\
+		show_##name, store_##name)
+
+predict_percent_attr(predict_level_weight);
+predict_percent_attr(predict_trend_weight);
+predict_percent_attr(predict_target_load);
+
+static ssize_t show_boost_duration(struct kobject *kobj,
+			struct attribute *attr, char *buf)
+{
+	return sprintf(buf, "%lu\n", boost_duration);
+}
+
+static ssize_t store_boost_duration(struct kobject *kobj,
+			struct attribute *attr, const char *buf, size_t count)
+{
+	int ret;
+	unsigned long val;
+
+	ret = strict_strtoul(buf, 0, &val);
+	if (ret < 0)
+		return ret;
+	boost_duration = val;
+	return count;
+}
+
+static struct global_attr boost_duration_attr = __ATTR(boost_duration, 0644,
+		show_boost_duration, store_boost_duration);
+
+#define boost_source_attr(name, source)					\
+static ssize_t show_##name(struct kobject *kobj,			\
+			struct attribute *attr, char *buf)		\
+{									\
+	return sprintf(buf, "%lu\n", name);				\
+}									\
+									\
+static ssize_t store_##name(struct kobject *kobj,			\
+			struct attribute *attr, const char *buf,	\
+			size_t count)					\
+{									\
+	int ret;							\
+	unsigned long val;						\
+									\
+	ret = strict_strtoul(buf, 0, &val);				\
+	if (ret < 0)							\
+		return ret;						\
+	name = !!val;							\
+	cpufreq_want_boost(source, name);				\
+	return count;							\
+}									\
+									\
+static struct global_attr name##_attr = __ATTR(name, 0644,		\
+		show_##name, store_##name)
+
+boost_source_attr(input_boost, CPUFREQ_BOOST_INPUT);
+boost_source_attr(binder_boost, CPUFREQ_BOOST_BINDER);
+
 static struct attribute *interactive_attributes[] = {
 	&hispeed_freq_attr.attr,
 	&go_hispeed_load_attr.attr,
 	&min_sample_time_attr.attr,
 	&timer_rate_attr.attr,
+	&predict_load_attr.attr,
+	&predict_level_weight_attr.attr,
+	&predict_trend_weight_attr.attr,
+	&predict_target_load_attr.attr,
+	&boost_duration_attr.attr,
+	&input_boost_attr.attr,
+	&binder_boost_attr.attr,
 	NULL,
 };
 
@@ -534,6 +832,84 @@ static struct attribute_group interactive_attr_group = {
 	.name = "interactive",
 };
 
+static void cpufreq_interactive_input_event(struct input_handle *handle,
+		unsigned int type, unsigned int code, int value)
+{
+	cpufreq_interactive_boost(CPUFREQ_BOOST_INPUT);
+}
+
+static int cpufreq_interactive_input_connect(struct input_handler *handler,
+		struct input_dev *dev, const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int error;
+
+	handle = kzalloc(sizeof(struct input_handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "cpufreq_interactive";
+
+	error = input_register_handle(handle);
+	if (error)
+		goto err2;
+
+	error = input_open_device(handle);
+	if (error)
+		goto err1;
+
+	return 0;
+err1:
+	input_unregister_handle(handle);
+err2:
+	kfree(handle);
+	return error;
+}
+
+static void cpufreq_interactive_input_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+/*
+ * Touchscreens and keys only: sensors that report through input would
+ * otherwise keep the CPUs boosted all the time.
+ */
+static const struct input_device_id cpufreq_interactive_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] =
+			    BIT_MASK(ABS_MT_POSITION_X) |
+			    BIT_MASK(ABS_MT_POSITION_Y) },
+	},
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_KEYBIT |
+			 INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.keybit = { [BIT_WORD(BTN_TOUCH)] = BIT_MASK(BTN_TOUCH) },
+		.absbit = { [BIT_WORD(ABS_X)] =
+			    BIT_MASK(ABS_X) | BIT_MASK(ABS_Y) },
+	},
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
+
+static struct input_handler cpufreq_interactive_input_handler = {
+	.event		= cpufreq_interactive_input_event,
+	.connect	= cpufreq_interactive_input_connect,
+	.disconnect	= cpufreq_interactive_input_disconnect,
+	.name		= "cpufreq_interactive",
+	.id_table	= cpufreq_interactive_ids,
+};
+
 static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		unsigned int event)
 {
@@ -555,6 +931,7 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 			pcpu->policy = policy;
 			pcpu->target_freq = policy->cur;
 			pcpu->freq_table = freq_table;
+			pcpu->predict_valid = 0;
 			pcpu->freq_change_time_in_idle =
 				get_cpu_idle_time_us(j,
 					     &pcpu->freq_change_time);
@@ -577,6 +954,13 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		if (rc)
 			return rc;
 
+		rc = input_register_handler(&cpufreq_interactive_input_handler);
+		if (rc) {
+			sysfs_remove_group(cpufreq_global_kobject,
+					&interactive_attr_group);
+			return rc;
+		}
+
 		break;
 
 	case CPUFREQ_GOV_STOP:
@@ -599,6 +983,7 @@ static int cpufreq_governor_interactive(struct cpufreq_policy *policy,
 		if (atomic_dec_return(&active_count) > 0)
 			return 0;
 
+		input_unregister_handler(&cpufreq_interactive_input_handler);
 		sysfs_remove_group(cpufreq_global_kobject,
 				&interactive_attr_group);
 
@@ -645,6 +1030,10 @@ static int __init cpufreq_interactive_init(void)
 	go_hispeed_load = DEFAULT_GO_HISPEED_LOAD;
 	min_sample_time = DEFAULT_MIN_SAMPLE_TIME;
 	timer_rate = DEFAULT_TIMER_RATE;
+	predict_level_weight = DEFAULT_PREDICT_LEVEL_WEIGHT;
+	predict_trend_weight = DEFAULT_PREDICT_TREND_WEIGHT;
+	predict_target_load = DEFAULT_PREDICT_TARGET_LOAD;
+	boost_duration = DEFAULT_BOOST_DURATION;
 
 	/* Initalize per-cpu timers */
 	for_each_possible_cpu(i) {
@@ -677,6 +1066,10 @@ static int __init cpufreq_interactive_init(void)
 	mutex_init(&set_speed_lock);
 
 	idle_notifier_register(&cpufreq_interactive_idle_nb);
+	cpufreq_register_notifier(&cpufreq_interactive_boost_nb,
+				  CPUFREQ_BOOST_NOTIFIER);
+	cpufreq_want_boost(CPUFREQ_BOOST_INPUT, input_boost);
+	cpufreq_want_boost(CPUFREQ_BOOST_BINDER, binder_boost);
 
 	return cpufreq_register_governor(&cpufreq_gov_interactive);
 
@@ -694,6 +1087,10 @@ module_init(cpufreq_interactive_init);
 static void __exit cpufreq_interactive_exit(void)
 {
 	cpufreq_unregister_governor(&cpufreq_gov_interactive);
+	cpufreq_want_boost(CPUFREQ_BOOST_INPUT, false);
+	cpufreq_want_boost(CPUFREQ_BOOST_BINDER, false);
+	cpufreq_unregister_notifier(&cpufreq_interactive_boost_nb,
+				    CPUFREQ_BOOST_NOTIFIER);
 	kthread_stop(up_task);
 	put_task_struct(up_task);
 	destroy_workqueue(down_wq);
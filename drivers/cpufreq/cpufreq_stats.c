@@ -15,6 +15,7 @@
 #include <linux/cpu.h>
 #include <linux/sysfs.h>
 #include <linux/cpufreq.h>
+#include <linux/hrtimer.h>
 #include <linux/jiffies.h>
 #include <linux/percpu.h>
 #include <linux/kobject.h>
@@ -24,6 +25,21 @@
 
 static spinlock_t cpufreq_stats_lock;
 
+/*
+ * Latency histograms have power of two buckets in usecs: bucket 0 holds
+ * everything under 16us and the last one everything from 16ms up.
+ */
+#define CPUFREQ_STATS_HIST_SHIFT	4
+#define CPUFREQ_STATS_HIST_BUCKETS	12
+
+/*
+ * A decision can be dropped without a transition, e.g. when another CPU
+ * of the policy still needs the current speed. Its stamp then stays
+ * until the next decision; one older than this is taken to be such a
+ * leftover rather than a slow response.
+ */
+#define CPUFREQ_STATS_MAX_RESPONSE_US	USEC_PER_SEC
+
 #define CPUFREQ_STATDEVICE_ATTR(_name, _mode, _show) \
 static struct freq_attr _attr_##_name = {\
 	.attr = {.name = __stringify(_name), .mode = _mode, }, \
@@ -42,10 +58,22 @@ struct cpufreq_stats {
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 	unsigned int *trans_table;
 #endif
+	ktime_t trans_start;
+	/* PRECHANGE to POSTCHANGE, i.e. the driver's set rate */
+	unsigned int trans_latency[CPUFREQ_STATS_HIST_BUCKETS];
+	/* governor decision to POSTCHANGE */
+	unsigned int response_latency[CPUFREQ_STATS_HIST_BUCKETS];
 };
 
 static DEFINE_PER_CPU(struct cpufreq_stats *, cpufreq_stats_table);
 
+/*
+ * Time of the last governor decision not yet followed by a transition,
+ * in usecs truncated to a long so that it can be written from the
+ * governor's timer without a lock; 0 if there is none.
+ */
+static DEFINE_PER_CPU(unsigned long, cpufreq_stats_request_us);
+
 struct cpufreq_stats_attribute {
 	struct attribute attr;
 	ssize_t(*show) (struct cpufreq_stats *, char *);
@@ -93,6 +121,48 @@ static ssize_t show_time_in_state(struct cpufreq_policy *policy, char *buf)
 	return len;
 }
 
+static void cpufreq_stats_hist_add(unsigned int *hist, unsigned long us)
+{
+	int bucket = fls(us >> CPUFREQ_STATS_HIST_SHIFT);
+
+	if (bucket >= CPUFREQ_STATS_HIST_BUCKETS)
+		bucket = CPUFREQ_STATS_HIST_BUCKETS - 1;
+	hist[bucket]++;
+}
+
+static ssize_t cpufreq_stats_hist_show(unsigned int *hist, char *buf)
+{
+	ssize_t len = 0;
+	int i;
+
+	/* lower bound of each bucket in usecs, then its count */
+	spin_lock(&cpufreq_stats_lock);
+	for (i = 0; i < CPUFREQ_STATS_HIST_BUCKETS; i++)
+		len += sprintf(buf + len, "%u %u\n",
+			       i ? 1 << (CPUFREQ_STATS_HIST_SHIFT + i - 1) : 0,
+			       hist[i]);
+	spin_unlock(&cpufreq_stats_lock);
+	return len;
+}
+
+static ssize_t show_transition_latency(struct cpufreq_policy *policy,
+				       char *buf)
+{
+	struct cpufreq_stats *stat = per_cpu(cpufreq_stats_table, policy->cpu);
+	if (!stat)
+		return 0;
+	return cpufreq_stats_hist_show(stat->trans_latency, buf);
+}
+
+static ssize_t show_response_latency(struct cpufreq_policy *policy,
+				     char *buf)
+{
+	struct cpufreq_stats *stat = per_cpu(cpufreq_stats_table, policy->cpu);
+	if (!stat)
+		return 0;
+	return cpufreq_stats_hist_show(stat->response_latency, buf);
+}
+
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 static ssize_t show_trans_table(struct cpufreq_policy *policy, char *buf)
 {
@@ -142,10 +212,14 @@ CPUFREQ_STATDEVICE_ATTR(trans_table, 0444, show_trans_table);
 
 CPUFREQ_STATDEVICE_ATTR(total_trans, 0444, show_total_trans);
 CPUFREQ_STATDEVICE_ATTR(time_in_state, 0444, show_time_in_state);
+CPUFREQ_STATDEVICE_ATTR(transition_latency, 0444, show_transition_latency);
+CPUFREQ_STATDEVICE_ATTR(response_latency, 0444, show_response_latency);
 
 static struct attribute *default_attrs[] = {
 	&_attr_total_trans.attr,
 	&_attr_time_in_state.attr,
+	&_attr_transition_latency.attr,
+	&_attr_response_latency.attr,
 #ifdef CONFIG_CPU_FREQ_STAT_DETAILS
 	&_attr_trans_table.attr,
 #endif
@@ -281,6 +355,41 @@ static int cpufreq_stat_notifier_policy(struct notifier_block *nb,
 	return 0;
 }
 
+/*
+ * A governor decided that CPU @val should change speed. The time from
+ * here to the next transition on it is accounted in its response_latency
+ * histogram. A later decision replaces an earlier one that has not been
+ * acted on yet.
+ */
+static int cpufreq_stat_notifier_target(struct notifier_block *nb,
+		unsigned long val, void *data)
+{
+	per_cpu(cpufreq_stats_request_us, val) =
+		(unsigned long)ktime_to_us(ktime_get()) ?: 1;
+	return 0;
+}
+
+static void cpufreq_stats_account_latency(struct cpufreq_stats *stat,
+					  unsigned int cpu)
+{
+	ktime_t now = ktime_get();
+	unsigned long request_us = per_cpu(cpufreq_stats_request_us, cpu);
+	unsigned long response_us = (unsigned long)ktime_to_us(now) -
+				    request_us;
+
+	per_cpu(cpufreq_stats_request_us, cpu) = 0;
+
+	spin_lock(&cpufreq_stats_lock);
+	if (stat->trans_start.tv64) {
+		cpufreq_stats_hist_add(stat->trans_latency,
+			ktime_to_us(ktime_sub(now, stat->trans_start)));
+		stat->trans_start.tv64 = 0;
+	}
+	if (request_us && response_us <= CPUFREQ_STATS_MAX_RESPONSE_US)
+		cpufreq_stats_hist_add(stat->response_latency, response_us);
+	spin_unlock(&cpufreq_stats_lock);
+}
+
 static int cpufreq_stat_notifier_trans(struct notifier_block *nb,
 		unsigned long val, void *data)
 {
@@ -288,6 +397,13 @@ static int cpufreq_stat_notifier_trans(struct notifier_block *nb,
 	struct cpufreq_stats *stat;
 	int old_index, new_index;
 
+	if (val == CPUFREQ_PRECHANGE) {
+		stat = per_cpu(cpufreq_stats_table, freq->cpu);
+		if (stat)
+			stat->trans_start = ktime_get();
+		return 0;
+	}
+
 	if (val != CPUFREQ_POSTCHANGE)
 		return 0;
 
@@ -295,6 +411,8 @@ static int cpufreq_stat_notifier_trans(struct notifier_block *nb,
 	if (!stat)
 		return 0;
 
+	cpufreq_stats_account_latency(stat, freq->cpu);
+
 	old_index = stat->last_index;
 	new_index = freq_table_get_index(stat, freq->new);
 
@@ -379,6 +497,10 @@ static struct notifier_block notifier_trans_block = {
 	.notifier_call = cpufreq_stat_notifier_trans
 };
 
+static struct notifier_block notifier_target_block = {
+	.notifier_call = cpufreq_stat_notifier_target
+};
+
 static int __init cpufreq_stats_init(void)
 {
 	int ret;
@@ -398,6 +520,9 @@ static int __init cpufreq_stats_init(void)
 		return ret;
 	}
 
+	cpufreq_register_notifier(&notifier_target_block,
+				CPUFREQ_TARGET_NOTIFIER);
+
 	register_hotcpu_notifier(&cpufreq_stat_cpu_notifier);
 	for_each_online_cpu(cpu) {
 		cpufreq_update_policy(cpu);
@@ -412,6 +537,8 @@ static void __exit cpufreq_stats_exit(void)
 			CPUFREQ_POLICY_NOTIFIER);
 	cpufreq_unregister_notifier(&notifier_trans_block,
 			CPUFREQ_TRANSITION_NOTIFIER);
+	cpufreq_unregister_notifier(&notifier_target_block,
+			CPUFREQ_TARGET_NOTIFIER);
 	unregister_hotcpu_notifier(&cpufreq_stat_cpu_notifier);
 	for_each_online_cpu(cpu) {
 		cpufreq_stats_free_table(cpu);
@@ -16,9 +16,11 @@
 
 #include <linux/device.h>
 #include <linux/file.h>
+#include <linux/freezer.h>
 #include <linux/fs.h>
 #include <linux/anon_inodes.h>
 #include <linux/ion.h>
+#include <linux/kthread.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -41,6 +43,16 @@
  * @lock:		lock protecting the buffers & heaps trees
  * @heaps:		list of all the heaps in the system
  * @user_clients:	list of all the clients created from userspace
+ * @free_list:		buffers of ION_HEAP_FLAG_DEFER_FREE heaps waiting to
+ *			be freed
+ * @free_lock:		protects free_list and the free_list_* counters
+ * @free_wait:		the free thread waits here for buffers
+ * @free_task:		the deferred free thread
+ * @free_shrinker:	drains free_list under memory pressure
+ * @free_list_size:	bytes on free_list
+ * @free_list_count:	buffers on free_list
+ * @free_list_max:	largest free_list_size seen
+ * @free_shrunk:	bytes the shrinker has freed from free_list
  */
 struct ion_device {
 	struct miscdevice dev;
@@ -52,6 +64,15 @@ struct ion_device {
 	struct rb_root user_clients;
 	struct rb_root kernel_clients;
 	struct dentry *debug_root;
+	struct list_head free_list;
+	spinlock_t free_lock;
+	wait_queue_head_t free_wait;
+	struct task_struct *free_task;
+	struct shrinker free_shrinker;
+	size_t free_list_size;
+	int free_list_count;
+	size_t free_list_max;
+	size_t free_shrunk;
 };
 
 /**
@@ -234,16 +255,112 @@ static struct ion_buffer *ion_buffer_create(struct ion_heap *heap,
 	return buffer;
 }
 
+static void _ion_buffer_destroy(struct ion_buffer *buffer)
+{
+	buffer->heap->ops->free(buffer);
+	kfree(buffer);
+}
+
+/*
+ * Buffers of heaps that defer their frees leave the buffer tree right
+ * away, but their memory is only released (and, for the system heap,
+ * zeroed and returned to its page pools) by the free thread.
+ */
 static void ion_buffer_destroy(struct kref *kref)
 {
 	struct ion_buffer *buffer = container_of(kref, struct ion_buffer, ref);
 	struct ion_device *dev = buffer->dev;
 
-	buffer->heap->ops->free(buffer);
 	mutex_lock(&dev->lock);
 	rb_erase(&buffer->node, &dev->buffers);
 	mutex_unlock(&dev->lock);
-	kfree(buffer);
+
+	if (!(buffer->heap->flags & ION_HEAP_FLAG_DEFER_FREE)) {
+		_ion_buffer_destroy(buffer);
+		return;
+	}
+
+	spin_lock(&dev->free_lock);
+	list_add_tail(&buffer->list, &dev->free_list);
+	dev->free_list_size += buffer->size;
+	dev->free_list_count++;
+	if (dev->free_list_size > dev->free_list_max)
+		dev->free_list_max = dev->free_list_size;
+	spin_unlock(&dev->free_lock);
+	wake_up(&dev->free_wait);
+}
+
+/*
+ * Free buffers from the deferred free list until at least @size bytes
+ * have been released, or the whole list if @size is 0. Returns the number
+ * of bytes released.
+ */
+static size_t ion_device_drain_free_list(struct ion_device *dev, size_t size)
+{
+	struct ion_buffer *buffer;
+	size_t freed = 0;
+
+	spin_lock(&dev->free_lock);
+	while (!list_empty(&dev->free_list) && (!size || freed < size)) {
+		buffer = list_first_entry(&dev->free_list, struct ion_buffer,
+					  list);
+		list_del(&buffer->list);
+		dev->free_list_size -= buffer->size;
+		dev->free_list_count--;
+		spin_unlock(&dev->free_lock);
+
+		freed += buffer->size;
+		_ion_buffer_destroy(buffer);
+
+		spin_lock(&dev->free_lock);
+	}
+	spin_unlock(&dev->free_lock);
+
+	return freed;
+}
+
+/*
+ * Runs at the lowest priority, so that zeroing released pages does not
+ * compete with the application that released them. Should it fall behind,
+ * the shrinker below drains the list when the memory is actually needed.
+ */
+static int ion_deferred_free_thread(void *data)
+{
+	struct ion_device *dev = data;
+
+	set_user_nice(current, 19);
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable(dev->free_wait,
+				     dev->free_list_count ||
+				     kthread_should_stop());
+		ion_device_drain_free_list(dev, 0);
+	}
+
+	return 0;
+}
+
+/*
+ * The buffers freed here go back to the heaps, which may keep the pages
+ * in their own pools; the heaps' shrinkers then give them to the system.
+ */
+static int ion_device_free_shrink(struct shrinker *shrinker,
+				  struct shrink_control *sc)
+{
+	struct ion_device *dev = container_of(shrinker, struct ion_device,
+					      free_shrinker);
+	size_t freed;
+
+	if (sc->nr_to_scan) {
+		freed = ion_device_drain_free_list(dev,
+						   sc->nr_to_scan << PAGE_SHIFT);
+		spin_lock(&dev->free_lock);
+		dev->free_shrunk += freed;
+		spin_unlock(&dev->free_lock);
+	}
+
+	return dev->free_list_size >> PAGE_SHIFT;
 }
 
 static void ion_buffer_get(struct ion_buffer *buffer)
@@ -1562,6 +1679,8 @@ static int ion_debug_heap_show(struct seq_file *s, void *unused)
 		seq_printf(s, "total heap size: %lx\n",
 			heap->ops->get_total(heap));
 	}
+	if (heap->ops->print_debug)
+		heap->ops->print_debug(heap, s);
 	return 0;
 }
 
@@ -1608,6 +1727,31 @@ end:
 	mutex_unlock(&dev->lock);
 }
 
+static int ion_debug_free_list_show(struct seq_file *s, void *unused)
+{
+	struct ion_device *dev = s->private;
+
+	spin_lock(&dev->free_lock);
+	seq_printf(s, "buffers: %d\n", dev->free_list_count);
+	seq_printf(s, "bytes: %zu\n", dev->free_list_size);
+	seq_printf(s, "max bytes: %zu\n", dev->free_list_max);
+	seq_printf(s, "bytes freed by shrinker: %zu\n", dev->free_shrunk);
+	spin_unlock(&dev->free_lock);
+	return 0;
+}
+
+static int ion_debug_free_list_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ion_debug_free_list_show, inode->i_private);
+}
+
+static const struct file_operations debug_free_list_fops = {
+	.open = ion_debug_free_list_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static int ion_debug_leak_show(struct seq_file *s, void *unused)
 {
 	struct ion_device *dev = s->private;
@@ -1719,11 +1863,33 @@ struct ion_device *ion_device_create(long (*custom_ioctl)
 	idev->kernel_clients = RB_ROOT;
 	debugfs_create_file("check_leaked_fds", 0664, idev->debug_root, idev,
 			    &debug_leak_fops);
+
+	INIT_LIST_HEAD(&idev->free_list);
+	spin_lock_init(&idev->free_lock);
+	init_waitqueue_head(&idev->free_wait);
+	idev->free_task = kthread_run(ion_deferred_free_thread, idev,
+				      "ion_free");
+	if (IS_ERR(idev->free_task)) {
+		pr_err("ion: failed to start deferred free thread.\n");
+		ret = PTR_ERR(idev->free_task);
+		debugfs_remove_recursive(idev->debug_root);
+		misc_deregister(&idev->dev);
+		kfree(idev);
+		return ERR_PTR(ret);
+	}
+	idev->free_shrinker.shrink = ion_device_free_shrink;
+	idev->free_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&idev->free_shrinker);
+	debugfs_create_file("deferred_free", 0444, idev->debug_root, idev,
+			    &debug_free_list_fops);
 	return idev;
 }
 
 void ion_device_destroy(struct ion_device *dev)
 {
+	unregister_shrinker(&dev->free_shrinker);
+	kthread_stop(dev->free_task);
+	ion_device_drain_free_list(dev, 0);
 	misc_deregister(&dev->dev);
 	/* XXX need to free the heaps and clients ? */
 	kfree(dev);
@@ -0,0 +1,191 @@
+/*
+ * drivers/gpu/ion/ion_page_pool.c
+ *
+ * Copyright (C) 2011 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/err.h>
+#include <linux/jiffies.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include "ion_priv.h"
+
+/*
+ * The refill worker stays idle for this long after the shrinker has
+ * taken pages away, so that the two do not fight each other while the
+ * system is short of memory.
+ */
+#define ION_PAGE_POOL_REFILL_BACKOFF	HZ
+
+/*
+ * Pages are kept on pool->items, linked through the lru field of the
+ * first page of each chunk. Every page in the pool is zeroed: fresh
+ * ones are allocated with __GFP_ZERO and freed ones must be cleared
+ * by the caller before they are handed back.
+ */
+static struct page *ion_page_pool_alloc_pages(struct ion_page_pool *pool,
+					      gfp_t gfp_mask)
+{
+	return alloc_pages(gfp_mask | __GFP_ZERO, pool->order);
+}
+
+static void ion_page_pool_add(struct ion_page_pool *pool, struct page *page)
+{
+	spin_lock(&pool->lock);
+	list_add(&page->lru, &pool->items);
+	pool->count++;
+	spin_unlock(&pool->lock);
+}
+
+static struct page *ion_page_pool_remove(struct ion_page_pool *pool)
+{
+	struct page *page = NULL;
+
+	spin_lock(&pool->lock);
+	if (pool->count) {
+		page = list_first_entry(&pool->items, struct page, lru);
+		list_del(&page->lru);
+		pool->count--;
+	}
+	spin_unlock(&pool->lock);
+	return page;
+}
+
+/*
+ * Runs from the system workqueue, so unlike the allocation path it can
+ * afford to wait for reclaim to make high order pages available.
+ */
+static void ion_page_pool_refill(struct work_struct *work)
+{
+	struct ion_page_pool *pool = container_of(work, struct ion_page_pool,
+						  refill_work);
+	struct page *page;
+
+	while (pool->count < pool->fill_target) {
+		if (time_before(jiffies, pool->last_shrink +
+					 ION_PAGE_POOL_REFILL_BACKOFF))
+			break;
+		page = ion_page_pool_alloc_pages(pool,
+						 pool->gfp_mask | __GFP_WAIT);
+		if (!page)
+			break;
+		ion_page_pool_add(pool, page);
+		pool->refills++;
+	}
+}
+
+/**
+ * ion_page_pool_alloc - take a zeroed chunk of 1 << pool->order pages
+ * @pool:		the pool
+ *
+ * Falls back to the page allocator with the pool's gfp mask when the
+ * pool is empty, and kicks the refill worker once the pool drops below
+ * its fill target. Returns NULL if neither has a chunk to give.
+ */
+struct page *ion_page_pool_alloc(struct ion_page_pool *pool)
+{
+	struct page *page;
+
+	page = ion_page_pool_remove(pool);
+	if (page) {
+		pool->hits++;
+	} else {
+		pool->misses++;
+		page = ion_page_pool_alloc_pages(pool, pool->gfp_mask);
+	}
+
+	if (pool->count < pool->fill_target)
+		schedule_work(&pool->refill_work);
+	return page;
+}
+
+/**
+ * ion_page_pool_free - return a chunk to the pool
+ * @pool:		the pool the chunk was allocated from
+ * @page:		first page of the chunk, which must already be zeroed
+ */
+void ion_page_pool_free(struct ion_page_pool *pool, struct page *page)
+{
+	ion_page_pool_add(pool, page);
+}
+
+static int ion_page_pool_shrink(struct shrinker *shrinker,
+				struct shrink_control *sc)
+{
+	struct ion_page_pool *pool = container_of(shrinker,
+						  struct ion_page_pool,
+						  shrinker);
+	unsigned long freed = 0;
+	struct page *page;
+
+	if (sc->nr_to_scan) {
+		pool->last_shrink = jiffies;
+		while (freed < sc->nr_to_scan) {
+			page = ion_page_pool_remove(pool);
+			if (!page)
+				break;
+			__free_pages(page, pool->order);
+			freed += 1 << pool->order;
+		}
+	}
+
+	return pool->count << pool->order;
+}
+
+/**
+ * ion_page_pool_create - create a pool of chunks of a single order
+ * @gfp_mask:		used for allocations that miss the pool; should not
+ *			include __GFP_WAIT for high orders, which the refill
+ *			worker adds back when it runs
+ * @order:		order of each chunk
+ * @fill_target:	number of chunks the refill worker keeps ready
+ */
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order,
+					   int fill_target)
+{
+	struct ion_page_pool *pool;
+
+	pool = kzalloc(sizeof(struct ion_page_pool), GFP_KERNEL);
+	if (!pool)
+		return ERR_PTR(-ENOMEM);
+
+	INIT_LIST_HEAD(&pool->items);
+	spin_lock_init(&pool->lock);
+	INIT_WORK(&pool->refill_work, ion_page_pool_refill);
+	pool->gfp_mask = gfp_mask;
+	pool->order = order;
+	pool->fill_target = fill_target;
+	pool->last_shrink = jiffies - ION_PAGE_POOL_REFILL_BACKOFF;
+
+	pool->shrinker.shrink = ion_page_pool_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS * 16;
+	register_shrinker(&pool->shrinker);
+
+	if (fill_target)
+		schedule_work(&pool->refill_work);
+	return pool;
+}
+
+void ion_page_pool_destroy(struct ion_page_pool *pool)
+{
+	struct page *page;
+
+	unregister_shrinker(&pool->shrinker);
+	cancel_work_sync(&pool->refill_work);
+	while ((page = ion_page_pool_remove(pool)))
+		__free_pages(page, pool->order);
+	kfree(pool);
+}
@@ -18,9 +18,13 @@
 #define _ION_PRIV_H
 
 #include <linux/kref.h>
+#include <linux/mm.h>
 #include <linux/mm_types.h>
 #include <linux/mutex.h>
 #include <linux/rbtree.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 #include <linux/ion.h>
 #include <linux/iommu.h>
 
@@ -83,6 +87,8 @@ struct ion_buffer *ion_handle_buffer(struct ion_handle *handle);
  * @vaddr:		the kenrel mapping if kmap_cnt is not zero
  * @dmap_cnt:		number of times the buffer is mapped for dma
  * @sglist:		the scatterlist for the buffer is dmap_cnt is not zero
+ * @list:		element in the device's deferred free list once the
+ *			last reference is gone
 */
 struct ion_buffer {
 	struct kref ref;
@@ -104,6 +110,7 @@ struct ion_buffer {
 	unsigned int iommu_map_cnt;
 	struct rb_root iommu_maps;
 	int marked;
+	struct list_head list;
 };
 
 /**
@@ -118,6 +125,7 @@ struct ion_buffer {
  * @unmap_kernel	unmap memory to the kernel
  * @map_user		map memory to userspace
  * @unmap_user		unmap memory to userspace
+ * @print_debug		append heap specific state to the heap's debugfs file
  */
 struct ion_heap_ops {
 	int (*allocate) (struct ion_heap *heap,
@@ -148,7 +156,7 @@ struct ion_heap_ops {
 				unsigned long iova_length,
 				unsigned long flags);
 	void (*unmap_iommu)(struct ion_iommu_map *data);
-
+	void (*print_debug)(struct ion_heap *heap, struct seq_file *s);
 };
 
 /**
@@ -161,6 +169,7 @@ struct ion_heap_ops {
  *			allocating.  These are specified by platform data and
  *			MUST be unique
  * @name:		used for debugging
+ * @flags:		ION_HEAP_FLAG_* below
  *
  * Represents a pool of memory from which buffers can be made.  In some
  * systems the only heap is regular system memory allocated via vmalloc.
@@ -174,8 +183,17 @@ struct ion_heap {
 	struct ion_heap_ops *ops;
 	int id;
 	const char *name;
+	unsigned long flags;
 };
 
+/*
+ * Buffers of this heap are freed by the device's deferred free thread,
+ * off the path of the last ion_buffer_put(). The heap's free op may then
+ * also be called from the device's shrinker, so it must not take any lock
+ * that is held across a memory allocation.
+ */
+#define ION_HEAP_FLAG_DEFER_FREE	(1 << 0)
+
 
 
 #define iommu_map_domain(__m)		((__m)->domain_info[1])
@@ -226,6 +244,45 @@ void ion_carveout_heap_destroy(struct ion_heap *);
 struct ion_heap *ion_iommu_heap_create(struct ion_platform_heap *);
 void ion_iommu_heap_destroy(struct ion_heap *);
 
+/**
+ * struct ion_page_pool - pagepool struct
+ * @count:		number of chunks in the pool
+ * @items:		list of chunks, linked through page->lru
+ * @lock:		protects count and items
+ * @gfp_mask:		gfp mask used when the pool is empty
+ * @order:		order of each chunk
+ * @fill_target:	number of chunks the refill worker keeps ready
+ * @refill_work:	tops the pool back up after allocations drain it
+ * @last_shrink:	jiffies at the last shrink, the refill backs off after
+ * @shrinker:		gives the pooled chunks back under memory pressure
+ * @hits:		allocations served from the pool
+ * @misses:		allocations that had to go to the page allocator
+ * @refills:		chunks added by the refill worker
+ *
+ * Allows you to keep a pool of zeroed pages around for fast allocation.
+ * The statistics are not updated atomically and are only for debugfs.
+ */
+struct ion_page_pool {
+	int count;
+	struct list_head items;
+	spinlock_t lock;
+	gfp_t gfp_mask;
+	unsigned int order;
+	int fill_target;
+	struct work_struct refill_work;
+	unsigned long last_shrink;
+	struct shrinker shrinker;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long refills;
+};
+
+struct ion_page_pool *ion_page_pool_create(gfp_t gfp_mask, unsigned int order,
+					   int fill_target);
+void ion_page_pool_destroy(struct ion_page_pool *);
+struct page *ion_page_pool_alloc(struct ion_page_pool *);
+void ion_page_pool_free(struct ion_page_pool *, struct page *);
+
 /**
  * kernel api to allocate/free from carveout -- used when carveout is
  * used to back an architecture specific custom heap
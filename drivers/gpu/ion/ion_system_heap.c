@@ -16,10 +16,14 @@
  */
 
 #include <linux/err.h>
+#include <linux/highmem.h>
 #include <linux/ion.h>
+#include <linux/hrtimer.h>
 #include <linux/mm.h>
 #include <linux/scatterlist.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/vmalloc.h>
 #include <linux/iommu.h>
 #include <mach/iommu_domains.h>
@@ -29,51 +33,233 @@
 static atomic_t system_heap_allocated;
 static atomic_t system_contig_heap_allocated;
 
+/*
+ * Buffers are built from the largest chunks available, so that a frame
+ * buffer needs a handful of page allocations rather than one per page
+ * and maps with few sg entries. Each order has a pool of zeroed chunks,
+ * topped up in the background to fill_target and drained by a shrinker
+ * under memory pressure, which keeps page allocation and zeroing off
+ * the allocation path in the common case.
+ */
+static const unsigned int orders[] = {8, 4, 0};
+static const int fill_targets[] = {4, 16, 64};
+#define NUM_ORDERS ARRAY_SIZE(orders)
+
+/*
+ * High order allocations that miss the pool must not stall in reclaim
+ * or compaction: falling back to a smaller order is always cheaper.
+ */
+static const gfp_t high_order_gfp_flags = (GFP_HIGHUSER | __GFP_NOWARN |
+					   __GFP_NORETRY) & ~__GFP_WAIT;
+static const gfp_t low_order_gfp_flags = GFP_HIGHUSER | __GFP_NOWARN;
+
+struct ion_system_heap {
+	struct ion_heap heap;
+	struct ion_page_pool *pools[NUM_ORDERS];
+	spinlock_t stats_lock;
+	unsigned long alloc_count;
+	u64 alloc_ns;
+	u64 alloc_max_ns;
+	unsigned long free_count;
+	u64 free_ns;
+	u64 free_max_ns;
+};
+
+/*
+ * pages holds every page of the buffer, for vmap and the iommu. The
+ * first page of each chunk has the chunk's order in page_private, the
+ * chunk's other pages follow it in the array.
+ */
+struct ion_system_buffer_info {
+	struct page **pages;
+	int nrpages;
+	int nchunks;
+};
+
+static inline struct ion_system_heap *to_system_heap(struct ion_heap *heap)
+{
+	return container_of(heap, struct ion_system_heap, heap);
+}
+
+static void ion_system_heap_account(struct ion_system_heap *sys_heap,
+				    bool alloc, ktime_t start)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&sys_heap->stats_lock);
+	if (alloc) {
+		sys_heap->alloc_count++;
+		sys_heap->alloc_ns += ns;
+		if (ns > sys_heap->alloc_max_ns)
+			sys_heap->alloc_max_ns = ns;
+	} else {
+		sys_heap->free_count++;
+		sys_heap->free_ns += ns;
+		if (ns > sys_heap->free_max_ns)
+			sys_heap->free_max_ns = ns;
+	}
+	spin_unlock(&sys_heap->stats_lock);
+}
+
+static struct page **ion_system_heap_alloc_pages_array(int nrpages)
+{
+	size_t size = nrpages * sizeof(struct page *);
+
+	if (size <= PAGE_SIZE)
+		return kmalloc(size, GFP_KERNEL);
+	return vmalloc(size);
+}
+
+static void ion_system_heap_free_pages_array(struct page **pages)
+{
+	if (is_vmalloc_addr(pages))
+		vfree(pages);
+	else
+		kfree(pages);
+}
+
+static struct page *alloc_largest_available(struct ion_system_heap *sys_heap,
+					    unsigned long size,
+					    unsigned int max_order)
+{
+	struct page *page;
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		if (size < (PAGE_SIZE << orders[i]))
+			continue;
+		if (max_order < orders[i])
+			continue;
+
+		page = ion_page_pool_alloc(sys_heap->pools[i]);
+		if (!page)
+			continue;
+		set_page_private(page, orders[i]);
+		return page;
+	}
+	return NULL;
+}
+
+static struct ion_page_pool *order_to_pool(struct ion_system_heap *sys_heap,
+					   unsigned int order)
+{
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++)
+		if (orders[i] == order)
+			return sys_heap->pools[i];
+	BUG();
+	return NULL;
+}
+
+/*
+ * Hands every chunk of the buffer back to its pool. The pages must
+ * already be zeroed.
+ */
+static void ion_system_heap_release_chunks(struct ion_system_heap *sys_heap,
+					   struct ion_system_buffer_info *info,
+					   int nrpages)
+{
+	struct page *page;
+	unsigned int order;
+	int i;
+
+	for (i = 0; i < nrpages; i += 1 << order) {
+		page = info->pages[i];
+		order = page_private(page);
+		ion_page_pool_free(order_to_pool(sys_heap, order), page);
+	}
+}
+
 static int ion_system_heap_allocate(struct ion_heap *heap,
 				     struct ion_buffer *buffer,
 				     unsigned long size, unsigned long align,
 				     unsigned long flags)
 {
-	buffer->priv_virt = vmalloc_user(size);
-	if (!buffer->priv_virt)
+	struct ion_system_heap *sys_heap = to_system_heap(heap);
+	struct ion_system_buffer_info *info;
+	unsigned long size_remaining = PAGE_ALIGN(size);
+	unsigned int max_order = orders[0];
+	ktime_t start = ktime_get();
+	struct page *page;
+	unsigned int order;
+	int i = 0, j;
+
+	info = kmalloc(sizeof(struct ion_system_buffer_info), GFP_KERNEL);
+	if (!info)
 		return -ENOMEM;
 
+	info->nrpages = size_remaining >> PAGE_SHIFT;
+	info->nchunks = 0;
+	info->pages = ion_system_heap_alloc_pages_array(info->nrpages);
+	if (!info->pages)
+		goto err;
+
+	while (size_remaining > 0) {
+		page = alloc_largest_available(sys_heap, size_remaining,
+					       max_order);
+		if (!page)
+			goto err_free_chunks;
+		order = page_private(page);
+		for (j = 0; j < (1 << order); j++)
+			info->pages[i++] = page + j;
+		size_remaining -= PAGE_SIZE << order;
+		max_order = order;
+		info->nchunks++;
+	}
+
+	buffer->priv_virt = info;
 	atomic_add(size, &system_heap_allocated);
+	ion_system_heap_account(sys_heap, true, start);
 	return 0;
+
+err_free_chunks:
+	/* nothing has seen these pages yet, so they are still zeroed */
+	ion_system_heap_release_chunks(sys_heap, info, i);
+	ion_system_heap_free_pages_array(info->pages);
+err:
+	kfree(info);
+	return -ENOMEM;
 }
 
 void ion_system_heap_free(struct ion_buffer *buffer)
 {
-	vfree(buffer->priv_virt);
+	struct ion_system_heap *sys_heap = to_system_heap(buffer->heap);
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	ktime_t start = ktime_get();
+	int i;
+
+	for (i = 0; i < info->nrpages; i++)
+		clear_highpage(info->pages[i]);
+	ion_system_heap_release_chunks(sys_heap, info, info->nrpages);
+
+	ion_system_heap_free_pages_array(info->pages);
+	kfree(info);
 	atomic_sub(buffer->size, &system_heap_allocated);
+	ion_system_heap_account(sys_heap, false, start);
 }
 
 struct scatterlist *ion_system_heap_map_dma(struct ion_heap *heap,
 					    struct ion_buffer *buffer)
 {
+	struct ion_system_buffer_info *info = buffer->priv_virt;
 	struct scatterlist *sglist;
 	struct page *page;
-	int i;
-	int npages = PAGE_ALIGN(buffer->size) / PAGE_SIZE;
-	void *vaddr = buffer->priv_virt;
+	unsigned int order;
+	int i, n = 0;
 
-	sglist = vmalloc(npages * sizeof(struct scatterlist));
+	sglist = vmalloc(info->nchunks * sizeof(struct scatterlist));
 	if (!sglist)
 		return ERR_PTR(-ENOMEM);
-	memset(sglist, 0, npages * sizeof(struct scatterlist));
-	sg_init_table(sglist, npages);
-	for (i = 0; i < npages; i++) {
-		page = vmalloc_to_page(vaddr);
-		if (!page)
-			goto end;
-		sg_set_page(&sglist[i], page, PAGE_SIZE, 0);
-		vaddr += PAGE_SIZE;
+	memset(sglist, 0, info->nchunks * sizeof(struct scatterlist));
+	sg_init_table(sglist, info->nchunks);
+	for (i = 0; i < info->nrpages; i += 1 << order) {
+		page = info->pages[i];
+		order = page_private(page);
+		sg_set_page(&sglist[n++], page, PAGE_SIZE << order, 0);
 	}
 	/* XXX do cache maintenance for dma? */
 	return sglist;
-end:
-	vfree(sglist);
-	return NULL;
 }
 
 void ion_system_heap_unmap_dma(struct ion_heap *heap,
@@ -88,17 +274,24 @@ void *ion_system_heap_map_kernel(struct ion_heap *heap,
 				 struct ion_buffer *buffer,
 				 unsigned long flags)
 {
-	if (ION_IS_CACHED(flags))
-		return buffer->priv_virt;
-	else {
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	void *vaddr;
+
+	if (!ION_IS_CACHED(flags)) {
 		pr_err("%s: cannot map system heap uncached\n", __func__);
 		return ERR_PTR(-EINVAL);
 	}
+
+	vaddr = vmap(info->pages, info->nrpages, VM_MAP, PAGE_KERNEL);
+	if (!vaddr)
+		return ERR_PTR(-ENOMEM);
+	return vaddr;
 }
 
 void ion_system_heap_unmap_kernel(struct ion_heap *heap,
 				  struct ion_buffer *buffer)
 {
+	vunmap(buffer->vaddr);
 }
 
 void ion_system_heap_unmap_iommu(struct ion_iommu_map *data)
@@ -132,25 +325,55 @@ void ion_system_heap_unmap_iommu(struct ion_iommu_map *data)
 	return;
 }
 
+/*
+ * The chunks are not compound pages, so their tail pages cannot be
+ * refcounted individually by vm_insert_page(); map them by pfn instead.
+ */
 int ion_system_heap_map_user(struct ion_heap *heap, struct ion_buffer *buffer,
 			     struct vm_area_struct *vma, unsigned long flags)
 {
-	if (ION_IS_CACHED(flags))
-		return remap_vmalloc_range(vma, buffer->priv_virt,
-						vma->vm_pgoff);
-	else {
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	unsigned long addr = vma->vm_start;
+	unsigned long offset = vma->vm_pgoff;
+	unsigned long len;
+	struct page *page;
+	unsigned int order;
+	int i, ret;
+
+	if (!ION_IS_CACHED(flags)) {
 		pr_err("%s: cannot map system heap uncached\n", __func__);
 		return -EINVAL;
 	}
+
+	for (i = 0; i < info->nrpages && addr < vma->vm_end; i += 1 << order) {
+		page = info->pages[i];
+		order = page_private(page);
+		if (offset >= (1 << order)) {
+			offset -= 1 << order;
+			continue;
+		}
+
+		len = min((PAGE_SIZE << order) - (offset << PAGE_SHIFT),
+			  vma->vm_end - addr);
+		ret = remap_pfn_range(vma, addr, page_to_pfn(page) + offset,
+				      len, vma->vm_page_prot);
+		if (ret)
+			return ret;
+		addr += len;
+		offset = 0;
+	}
+
+	return 0;
 }
 
 int ion_system_heap_cache_ops(struct ion_heap *heap, struct ion_buffer *buffer,
 			void *vaddr, unsigned int offset, unsigned int length,
 			unsigned int cmd)
 {
+	struct ion_system_buffer_info *info = buffer->priv_virt;
 	unsigned long vstart, pstart;
-	void *vtemp;
 	unsigned long ln = 0;
+	unsigned long pgoff;
 	void (*op)(unsigned long, unsigned long, unsigned long);
 
 	switch (cmd) {
@@ -167,22 +390,15 @@ int ion_system_heap_cache_ops(struct ion_heap *heap, struct ion_buffer *buffer,
 		return -EINVAL;
 	}
 
-	for (vtemp = buffer->priv_virt + offset,
-	     vstart = (unsigned long) vaddr;
-			ln < length;
-			vtemp += PAGE_SIZE, ln += PAGE_SIZE,
-			vstart += PAGE_SIZE) {
-		pstart = page_to_phys(vmalloc_to_page(vtemp));
-		/*
-		 * If vmalloc -> page -> phys is returning NULL, something
-		 * has really gone wrong...
-		 */
-		if (!pstart) {
-			WARN(1, "Could not translate %p to physical address\n",
-				vtemp);
+	for (vstart = (unsigned long) vaddr; ln < length;
+			ln += PAGE_SIZE, vstart += PAGE_SIZE) {
+		pgoff = (offset + ln) >> PAGE_SHIFT;
+		if (pgoff >= info->nrpages) {
+			WARN(1, "Cache op past the end of buffer %p\n",
+				buffer);
 			return -EINVAL;
 		}
-
+		pstart = page_to_phys(info->pages[pgoff]);
 		op(vstart, PAGE_SIZE, pstart);
 	}
 
@@ -202,10 +418,10 @@ int ion_system_heap_map_iommu(struct ion_buffer *buffer,
 				unsigned long iova_length,
 				unsigned long flags)
 {
-	int ret, i;
+	struct ion_system_buffer_info *info = buffer->priv_virt;
+	int ret, i, j;
 	unsigned long temp_iova;
 	struct iommu_domain *domain;
-	void *temp_phys;
 	unsigned long extra;
 
 	if (!ION_IS_CACHED(flags))
@@ -233,17 +449,16 @@ int ion_system_heap_map_iommu(struct ion_buffer *buffer,
 	}
 
 	temp_iova = data->iova_addr;
-	temp_phys = buffer->vaddr;
-	for (i = buffer->size; i > 0; i -= SZ_4K, temp_iova += SZ_4K,
-						  temp_phys += SZ_4K) {
+	for (i = buffer->size, j = 0; i > 0; j++, i -= SZ_4K,
+						temp_iova += SZ_4K) {
 		ret = iommu_map(domain, temp_iova,
-			page_to_phys(vmalloc_to_page(temp_phys)),
+			page_to_phys(info->pages[j]),
 			get_order(SZ_4K), ION_IS_CACHED(flags) ? 1 : 0);
 
 		if (ret) {
 			pr_err("%s: could not map %lx to %x in domain %p\n",
 				__func__, temp_iova,
-				page_to_phys(vmalloc_to_page(temp_phys)),
+				page_to_phys(info->pages[j]),
 				domain);
 			goto out2;
 		}
@@ -265,6 +480,47 @@ out:
 	return ret;
 }
 
+/*
+ * Average and worst case alloc/free latency, along with how well each
+ * pool is doing, so that changes to the orders and fill targets can be
+ * measured with a camera or video use case running.
+ */
+static void ion_system_heap_print_debug(struct ion_heap *heap,
+					struct seq_file *s)
+{
+	struct ion_system_heap *sys_heap = to_system_heap(heap);
+	struct ion_page_pool *pool;
+	unsigned long alloc_count, free_count;
+	u64 alloc_ns, alloc_max_ns, free_ns, free_max_ns;
+	int i;
+
+	spin_lock(&sys_heap->stats_lock);
+	alloc_count = sys_heap->alloc_count;
+	alloc_ns = sys_heap->alloc_ns;
+	alloc_max_ns = sys_heap->alloc_max_ns;
+	free_count = sys_heap->free_count;
+	free_ns = sys_heap->free_ns;
+	free_max_ns = sys_heap->free_max_ns;
+	spin_unlock(&sys_heap->stats_lock);
+
+	if (alloc_count)
+		do_div(alloc_ns, alloc_count);
+	if (free_count)
+		do_div(free_ns, free_count);
+	seq_printf(s, "allocs: %lu avg %llu ns max %llu ns\n",
+		   alloc_count, alloc_ns, alloc_max_ns);
+	seq_printf(s, "frees: %lu avg %llu ns max %llu ns\n",
+		   free_count, free_ns, free_max_ns);
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		pool = sys_heap->pools[i];
+		seq_printf(s, "order %u pool: %d/%d chunks, %lu hits, "
+			   "%lu misses, %lu refills\n", pool->order,
+			   pool->count, pool->fill_target, pool->hits,
+			   pool->misses, pool->refills);
+	}
+}
+
 static struct ion_heap_ops vmalloc_ops = {
 	.allocate = ion_system_heap_allocate,
 	.free = ion_system_heap_free,
@@ -277,23 +533,52 @@ static struct ion_heap_ops vmalloc_ops = {
 	.get_allocated = ion_system_heap_get_allocated,
 	.map_iommu = ion_system_heap_map_iommu,
 	.unmap_iommu = ion_system_heap_unmap_iommu,
+	.print_debug = ion_system_heap_print_debug,
 };
 
 struct ion_heap *ion_system_heap_create(struct ion_platform_heap *unused)
 {
-	struct ion_heap *heap;
+	struct ion_system_heap *sys_heap;
+	struct ion_page_pool *pool;
+	gfp_t gfp_flags;
+	int i;
 
-	heap = kzalloc(sizeof(struct ion_heap), GFP_KERNEL);
-	if (!heap)
+	sys_heap = kzalloc(sizeof(struct ion_system_heap), GFP_KERNEL);
+	if (!sys_heap)
 		return ERR_PTR(-ENOMEM);
-	heap->ops = &vmalloc_ops;
-	heap->type = ION_HEAP_TYPE_SYSTEM;
-	return heap;
+	sys_heap->heap.ops = &vmalloc_ops;
+	sys_heap->heap.type = ION_HEAP_TYPE_SYSTEM;
+	sys_heap->heap.flags = ION_HEAP_FLAG_DEFER_FREE;
+	spin_lock_init(&sys_heap->stats_lock);
+
+	for (i = 0; i < NUM_ORDERS; i++) {
+		if (orders[i] > 0)
+			gfp_flags = high_order_gfp_flags;
+		else
+			gfp_flags = low_order_gfp_flags;
+		pool = ion_page_pool_create(gfp_flags, orders[i],
+					    fill_targets[i]);
+		if (IS_ERR(pool))
+			goto err_create_pool;
+		sys_heap->pools[i] = pool;
+	}
+	return &sys_heap->heap;
+
+err_create_pool:
+	while (--i >= 0)
+		ion_page_pool_destroy(sys_heap->pools[i]);
+	kfree(sys_heap);
+	return ERR_PTR(-ENOMEM);
 }
 
 void ion_system_heap_destroy(struct ion_heap *heap)
 {
-	kfree(heap);
+	struct ion_system_heap *sys_heap = to_system_heap(heap);
+	int i;
+
+	for (i = 0; i < NUM_ORDERS; i++)
+		ion_page_pool_destroy(sys_heap->pools[i]);
+	kfree(sys_heap);
 }
 
 static int ion_system_contig_heap_allocate(struct ion_heap *heap,
@@ -337,6 +622,23 @@ struct scatterlist *ion_system_contig_heap_map_dma(struct ion_heap *heap,
 	return sglist;
 }
 
+void *ion_system_contig_heap_map_kernel(struct ion_heap *heap,
+					struct ion_buffer *buffer,
+					unsigned long flags)
+{
+	if (ION_IS_CACHED(flags))
+		return buffer->priv_virt;
+	else {
+		pr_err("%s: cannot map system heap uncached\n", __func__);
+		return ERR_PTR(-EINVAL);
+	}
+}
+
+void ion_system_contig_heap_unmap_kernel(struct ion_heap *heap,
+					 struct ion_buffer *buffer)
+{
+}
+
 int ion_system_contig_heap_map_user(struct ion_heap *heap,
 				    struct ion_buffer *buffer,
 				    struct vm_area_struct *vma,
@@ -466,8 +768,8 @@ static struct ion_heap_ops kmalloc_ops = {
 	.phys = ion_system_contig_heap_phys,
 	.map_dma = ion_system_contig_heap_map_dma,
 	.unmap_dma = ion_system_heap_unmap_dma,
-	.map_kernel = ion_system_heap_map_kernel,
-	.unmap_kernel = ion_system_heap_unmap_kernel,
+	.map_kernel = ion_system_contig_heap_map_kernel,
+	.unmap_kernel = ion_system_contig_heap_unmap_kernel,
 	.map_user = ion_system_contig_heap_map_user,
 	.cache_op = ion_system_contig_heap_cache_ops,
 	.get_allocated = ion_system_contig_heap_get_allocated,
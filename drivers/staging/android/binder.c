@@ -16,9 +16,11 @@
  */
 
 #include <asm/cacheflush.h>
+#include <linux/cpufreq.h>
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -28,6 +30,7 @@
 #include <linux/poll.h>
 #include <linux/debugfs.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
@@ -36,9 +39,56 @@
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking
+ *
+ * binder_main_lock protects the object graph: the set of procs,
+ * threads, nodes and refs, which node belongs to which proc, the
+ * reference counts held through refs, death notifications and the
+ * context manager. Everything that creates or destroys refs, hands a
+ * node to another proc or tears down a thread or proc holds it for
+ * writing. This includes transactions that carry binder objects or fds
+ * (tr->offsets_size != 0), since translating those touches the ref
+ * trees of both ends and the nodes of arbitrary third procs.
+ *
+ * The common case, a transaction or reply carrying only data, holds
+ * binder_main_lock for reading and otherwise only takes the lock of
+ * each proc it touches: proc->lock protects the proc's todo list, its
+ * threads (thread->todo, transaction_stack, looper, return_error), the
+ * fields of the nodes it owns and its buffer allocator. A transaction
+ * takes the sender's and the target's proc->lock in turn, never both at
+ * once, so independent pairs of processes no longer serialize.
+ *
+ * Lock ordering:
+ *
+ *	binder_main_lock
+ *	  proc->lock		(at most one at a time while binder_main_lock
+ *				 is held for reading)
+ *	    mm->mmap_sem	(binder_update_page_range, user copies)
+ *	binder_deferred_lock	(innermost, also taken under mmap_sem)
+ *
+ * proc->lock is not held across copies to user space. The debugfs
+ * files hold binder_main_lock for reading and take each proc->lock in
+ * turn.
+ *
+ * binder_main_lock is held for reading across an ioctl, and is dropped
+ * while a thread sleeps for work. The thread and its proc stay valid
+ * meanwhile: threads are only freed by BINDER_THREAD_EXIT from the
+ * thread itself or once the file has been released.
+ */
+static DECLARE_RWSEM(binder_main_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 
+/*
+ * Pages of freed buffers stay mapped, in the kernel and in the owning
+ * process, on this list until the shrinker needs them back. The next
+ * allocation that covers them then skips the page table work entirely.
+ * Lock ordering: proc->lock, then binder_lru_lock.
+ */
+static DEFINE_SPINLOCK(binder_lru_lock);
+static LIST_HEAD(binder_lru);
+static int binder_lru_count;
+
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
@@ -47,7 +97,7 @@ static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -105,6 +155,9 @@ module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
+static int binder_inherit_rt = 1;
+module_param_named(inherit_rt, binder_inherit_rt, bool, S_IWUSR | S_IRUGO);
+
 static DECLARE_WAIT_QUEUE_HEAD(binder_user_error_wait);
 static int binder_stop_on_user_error;
 
@@ -145,23 +198,24 @@ enum binder_stat_types {
 	BINDER_STAT_COUNT
 };
 
+/* Updated without binder_main_lock held for writing, hence atomic */
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
 }
 
 struct binder_transaction_log_entry {
@@ -177,24 +231,27 @@ struct binder_transaction_log_entry {
 	int offsets_size;
 };
 struct binder_transaction_log {
-	int next;
+	atomic_t cur;	/* index of the last entry handed out */
 	int full;
 	struct binder_transaction_log_entry entry[32];
 };
-static struct binder_transaction_log binder_transaction_log;
-static struct binder_transaction_log binder_transaction_log_failed;
+static struct binder_transaction_log binder_transaction_log = {
+	.cur = ATOMIC_INIT(-1),
+};
+static struct binder_transaction_log binder_transaction_log_failed = {
+	.cur = ATOMIC_INIT(-1),
+};
 
 static struct binder_transaction_log_entry *binder_transaction_log_add(
 	struct binder_transaction_log *log)
 {
 	struct binder_transaction_log_entry *e;
-	e = &log->entry[log->next];
-	memset(e, 0, sizeof(*e));
-	log->next++;
-	if (log->next == ARRAY_SIZE(log->entry)) {
-		log->next = 0;
+	unsigned int cur = atomic_inc_return(&log->cur);
+
+	if (cur >= ARRAY_SIZE(log->entry))
 		log->full = 1;
-	}
+	e = &log->entry[cur % ARRAY_SIZE(log->entry)];
+	memset(e, 0, sizeof(*e));
 	return e;
 }
 
@@ -273,6 +330,54 @@ struct binder_buffer {
 	uint8_t data[0];
 };
 
+struct binder_lru_page {
+	struct list_head lru;	/* on binder_lru while no buffer uses it */
+	struct page *page_ptr;
+	struct binder_proc *proc;
+};
+
+/* Buffer allocator statistics, under proc->lock */
+struct binder_alloc_stats {
+	unsigned int allocs;
+	u64 alloc_ns_total;
+	u64 alloc_ns_max;
+	unsigned int pages_new;		/* allocated and mapped */
+	unsigned int pages_reused;	/* taken back from binder_lru */
+	unsigned int pages_reclaimed;	/* given back by the shrinker */
+};
+
+/*
+ * Reply latency, from BC_TRANSACTION to the matching BC_REPLY, as seen
+ * by the process serving the call. Bucket i counts calls that took
+ * less than 2^i us (and at least 2^(i-1) us); the last one counts all
+ * slower calls. Under proc->lock.
+ */
+#define BINDER_LATENCY_BUCKETS	20
+#define BINDER_LATENCY_MAX_CODES	64
+
+struct binder_latency_hist {
+	unsigned int count;
+	unsigned int max_us;
+	unsigned int buckets[BINDER_LATENCY_BUCKETS];
+};
+
+struct binder_code_latency {
+	struct rb_node rb_node;
+	unsigned int code;
+	struct binder_latency_hist hist;
+};
+
+/*
+ * Scheduling parameters of a thread. Synchronous calls from SCHED_FIFO
+ * and SCHED_RR threads run at the caller's policy and RT priority;
+ * other callers only pass on their nice value, as before.
+ */
+struct binder_priority {
+	unsigned int sched_policy;
+	int rt_prio;		/* SCHED_FIFO and SCHED_RR only */
+	long nice;
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -280,6 +385,7 @@ enum binder_deferred_state {
 };
 
 struct binder_proc {
+	struct mutex lock;	/* see "Locking" above */
 	struct hlist_node proc_node;
 	struct rb_root threads;
 	struct rb_root nodes;
@@ -299,7 +405,7 @@ struct binder_proc {
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
@@ -310,8 +416,12 @@ struct binder_proc {
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
+	struct binder_priority default_priority;
 	struct dentry *debugfs_entry;
+	struct binder_alloc_stats alloc_stats;
+	struct binder_latency_hist latency;
+	struct rb_root code_latency;
+	int code_latency_count;
 };
 
 enum {
@@ -352,14 +462,68 @@ struct binder_transaction {
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	start_time;
 };
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
+static inline void binder_proc_lock(struct binder_proc *proc)
+{
+	mutex_lock(&proc->lock);
+}
+
+static inline void binder_proc_unlock(struct binder_proc *proc)
+{
+	mutex_unlock(&proc->lock);
+}
+
+/*
+ * Switch from holding binder_main_lock for reading to holding it for
+ * writing. The lock is dropped in between, so the caller must not hold
+ * any proc->lock or rely on anything but its own proc and thread.
+ */
+static void binder_lock_exclusive(int *exclusive)
+{
+	if (*exclusive)
+		return;
+	up_read(&binder_main_lock);
+	down_write(&binder_main_lock);
+	*exclusive = 1;
+}
+
+static void binder_lock_shared(int *exclusive)
+{
+	if (!*exclusive)
+		return;
+	downgrade_write(&binder_main_lock);
+	*exclusive = 0;
+}
+
+/*
+ * Copies to user space may fault and wait for I/O, so they are done
+ * with proc->lock dropped rather than stall the proc's other threads.
+ * Whatever is copied must already be off the proc's shared lists.
+ */
+static int binder_copy_to_user_unlocked(struct binder_proc *proc,
+					void __user *ptr, const void *src,
+					size_t size)
+{
+	int ret = 0;
+
+	binder_proc_unlock(proc);
+	if (copy_to_user(ptr, src, size))
+		ret = -EFAULT;
+	binder_proc_lock(proc);
+	return ret;
+}
+
 /*
  * copied from get_unused_fd_flags
  */
@@ -515,6 +679,52 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static inline int binder_is_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static struct binder_priority binder_current_priority(void)
+{
+	struct binder_priority p;
+
+	p.sched_policy = current->policy;
+	p.rt_prio = current->rt_priority;
+	p.nice = task_nice(current);
+	return p;
+}
+
+/*
+ * Switch current to @desired. An RT priority the thread only has on
+ * behalf of a caller is not passed on to its children.
+ */
+/* Is a thread at @p likely doing foreground work, i.e. not niced down? */
+static inline int binder_priority_is_foreground(struct binder_priority p)
+{
+	return binder_is_rt_policy(p.sched_policy) || p.nice <= 0;
+}
+
+static void binder_set_priority(struct binder_priority desired)
+{
+	struct sched_param params;
+
+	if (binder_is_rt_policy(desired.sched_policy)) {
+		if (current->policy == desired.sched_policy &&
+		    current->rt_priority == desired.rt_prio)
+			return;
+		params.sched_priority = desired.rt_prio;
+		sched_setscheduler_nocheck(current, desired.sched_policy |
+					   SCHED_RESET_ON_FORK, &params);
+		return;
+	}
+	if (binder_is_rt_policy(current->policy)) {
+		params.sched_priority = 0;
+		sched_setscheduler_nocheck(current, desired.sched_policy,
+					   &params);
+	}
+	binder_set_nice(desired.nice);
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -607,6 +817,29 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+static void binder_lru_add(struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	BUG_ON(!list_empty(&page->lru));
+	list_add_tail(&page->lru, &binder_lru);
+	binder_lru_count++;
+	spin_unlock(&binder_lru_lock);
+}
+
+static void binder_lru_del(struct binder_lru_page *page)
+{
+	spin_lock(&binder_lru_lock);
+	if (!list_empty(&page->lru)) {
+		list_del_init(&page->lru);
+		binder_lru_count--;
+	}
+	spin_unlock(&binder_lru_lock);
+}
+
+/*
+ * Freeing a range only puts its pages on binder_lru; they are unmapped
+ * by binder_shrink() or when the proc is released.
+ */
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -614,8 +847,10 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
-	struct mm_struct *mm;
+	struct binder_lru_page *page;
+	struct mm_struct *mm = NULL;
+	int need_map = 0;
+	int ret = 0;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -624,9 +859,21 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
-	if (vma)
-		mm = NULL;
-	else
+	if (allocate == 0)
+		goto free_range;
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (page->page_ptr) {
+			binder_lru_del(page);
+			proc->alloc_stats.pages_reused++;
+		} else
+			need_map = 1;
+	}
+	if (!need_map)
+		return 0;
+
+	if (vma == NULL)
 		mm = get_task_mm(proc->tsk);
 
 	if (mm) {
@@ -634,30 +881,28 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		vma = proc->vma;
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
+	page_addr = start;
 	if (vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
 		goto err_no_vma;
 	}
 
-	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
-		int ret;
+	for (; page_addr < end; page_addr += PAGE_SIZE) {
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (page->page_ptr)
+			continue;
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -667,7 +912,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
@@ -675,6 +920,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 			goto err_vm_insert_page_failed;
 		}
 		/* vm_insert_page does not seem to increment the refcount */
+		proc->alloc_stats.pages_new++;
 	}
 	if (mm) {
 		up_write(&mm->mmap_sem);
@@ -682,27 +928,112 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	}
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
-	}
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
-	return -ENOMEM;
+	ret = -ENOMEM;
+	/* Whatever did get mapped is kept for the next allocation */
+free_range:
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (page->page_ptr)
+			binder_lru_add(page);
+	}
+	return ret;
+}
+
+/*
+ * Unmap and free a page taken off binder_lru. Called with proc->lock
+ * held. Returns -EBUSY, leaving the page alone, if the mm of the proc
+ * is busy.
+ */
+static int binder_free_lru_page(struct binder_proc *proc,
+				struct binder_lru_page *page)
+{
+	void *page_addr = proc->buffer + (page - proc->pages) * PAGE_SIZE;
+	struct mm_struct *mm;
+
+	mm = get_task_mm(proc->tsk);
+	if (mm) {
+		if (!down_read_trylock(&mm->mmap_sem)) {
+			mmput(mm);
+			return -EBUSY;
+		}
+		if (proc->vma)
+			zap_page_range(proc->vma, (uintptr_t)page_addr +
+				proc->user_buffer_offset, PAGE_SIZE, NULL);
+		up_read(&mm->mmap_sem);
+		mmput(mm);
+	}
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
+	return 0;
+}
+
+/*
+ * Reclaim is entered with arbitrary locks held, possibly including a
+ * proc->lock or mmap_sem, so only trylocks are used here.
+ */
+static int binder_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	unsigned long nr_to_scan = sc->nr_to_scan;
+	struct binder_lru_page *page;
+	struct binder_proc *proc;
+	int count;
+
+	if (nr_to_scan == 0)
+		return binder_lru_count;
+
+	spin_lock(&binder_lru_lock);
+	while (nr_to_scan-- && !list_empty(&binder_lru)) {
+		page = list_first_entry(&binder_lru, struct binder_lru_page,
+					lru);
+		proc = page->proc;
+		if (!mutex_trylock(&proc->lock)) {
+			list_move_tail(&page->lru, &binder_lru);
+			continue;
+		}
+		list_del_init(&page->lru);
+		binder_lru_count--;
+		spin_unlock(&binder_lru_lock);
+
+		if (binder_free_lru_page(proc, page))
+			binder_lru_add(page);
+		else
+			proc->alloc_stats.pages_reclaimed++;
+		binder_proc_unlock(proc);
+
+		spin_lock(&binder_lru_lock);
+	}
+	count = binder_lru_count;
+	spin_unlock(&binder_lru_lock);
+
+	return count;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
+static void binder_alloc_account(struct binder_proc *proc, ktime_t start)
+{
+	struct binder_alloc_stats *stats = &proc->alloc_stats;
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	stats->allocs++;
+	stats->alloc_ns_total += ns;
+	if (ns > stats->alloc_ns_max)
+		stats->alloc_ns_max = ns;
 }
 
 static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
@@ -716,6 +1047,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	void *has_page_addr;
 	void *end_page_addr;
 	size_t size;
+	ktime_t start = ktime_get();
 
 	if (proc->vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf, no vma\n",
@@ -807,6 +1139,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 			     "async free %zd\n", proc->pid, size,
 			     proc->free_async_space);
 	}
+	binder_alloc_account(proc, start);
 
 	return buffer;
 }
@@ -968,7 +1301,7 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	binder_stats_created(BINDER_STAT_NODE);
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
@@ -1103,7 +1436,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1228,15 +1561,80 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 	return 0;
 }
 
+static void binder_latency_add(struct binder_latency_hist *hist,
+			       unsigned int us)
+{
+	int bucket = min(fls(us), BINDER_LATENCY_BUCKETS - 1);
+
+	hist->count++;
+	hist->buckets[bucket]++;
+	if (us > hist->max_us)
+		hist->max_us = us;
+}
+
+static struct binder_code_latency *binder_get_code_latency(
+	struct binder_proc *proc, unsigned int code)
+{
+	struct rb_node **p = &proc->code_latency.rb_node;
+	struct rb_node *parent = NULL;
+	struct binder_code_latency *cl;
+
+	while (*p) {
+		parent = *p;
+		cl = rb_entry(parent, struct binder_code_latency, rb_node);
+
+		if (code < cl->code)
+			p = &(*p)->rb_left;
+		else if (code > cl->code)
+			p = &(*p)->rb_right;
+		else
+			return cl;
+	}
+	if (proc->code_latency_count >= BINDER_LATENCY_MAX_CODES)
+		return NULL;
+	cl = kzalloc(sizeof(*cl), GFP_KERNEL);
+	if (cl == NULL)
+		return NULL;
+	cl->code = code;
+	rb_link_node(&cl->rb_node, parent, p);
+	rb_insert_color(&cl->rb_node, &proc->code_latency);
+	proc->code_latency_count++;
+	return cl;
+}
+
+/*
+ * Called with proc->lock held when proc replies to t. Calls with codes
+ * beyond the first BINDER_LATENCY_MAX_CODES are only counted in the
+ * per-process histogram.
+ */
+static void binder_latency_account(struct binder_proc *proc,
+				   struct binder_transaction *t)
+{
+	struct binder_code_latency *cl;
+	s64 us = ktime_us_delta(ktime_get(), t->start_time);
+	unsigned int val = clamp_t(s64, us, 0, UINT_MAX);
+
+	binder_latency_add(&proc->latency, val);
+	cl = binder_get_code_latency(proc, t->code);
+	if (cl)
+		binder_latency_add(&cl->hist, val);
+}
+
+/*
+ * Unless binder_main_lock is held for writing, the caller must already
+ * have detached t->buffer under the lock of the proc owning it.
+ */
 static void binder_pop_transaction(struct binder_thread *target_thread,
 				   struct binder_transaction *t)
 {
 	if (target_thread) {
+		binder_proc_lock(target_thread->proc);
 		BUG_ON(target_thread->transaction_stack != t);
 		BUG_ON(target_thread->transaction_stack->from != target_thread);
 		target_thread->transaction_stack =
 			target_thread->transaction_stack->from_parent;
 		t->from = NULL;
+		binder_proc_unlock(target_thread->proc);
 	}
 	t->need_reply = 0;
 	if (t->buffer)
@@ -1245,6 +1643,7 @@ static void binder_pop_transaction(struct binder_thread *target_thread,
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 }
 
+/* Called with binder_main_lock held for writing */
 static void binder_send_failed_reply(struct binder_transaction *t,
 				     uint32_t error_code)
 {
@@ -1375,9 +1774,15 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+/*
+ * Called with binder_main_lock held for reading, or for writing if
+ * *exclusive is set. Transactions carrying objects upgrade it to
+ * writing, see "Locking" at the top of this file.
+ */
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       int *exclusive)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
@@ -1390,6 +1795,7 @@ static void binder_transaction(struct binder_proc *proc,
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
 	uint32_t return_error;
+	int boost;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
@@ -1399,16 +1805,21 @@ static void binder_transaction(struct binder_proc *proc,
 	e->data_size = tr->data_size;
 	e->offsets_size = tr->offsets_size;
 
+	if (tr->offsets_size)
+		binder_lock_exclusive(exclusive);
+
 	if (reply) {
+		binder_proc_lock(proc);
 		in_reply_to = thread->transaction_stack;
 		if (in_reply_to == NULL) {
+			binder_proc_unlock(proc);
 			binder_user_error("binder: %d:%d got reply transaction "
 					  "with no transaction stack\n",
 					  proc->pid, thread->pid);
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		binder_set_priority(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1418,16 +1829,25 @@ static void binder_transaction(struct binder_proc *proc,
 				in_reply_to->to_proc->pid : 0,
 				in_reply_to->to_thread ?
 				in_reply_to->to_thread->pid : 0);
+			binder_proc_unlock(proc);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
 		thread->transaction_stack = in_reply_to->to_parent;
+		/* Our buffer, so detach it here for binder_pop_transaction() */
+		if (in_reply_to->buffer) {
+			in_reply_to->buffer->transaction = NULL;
+			in_reply_to->buffer = NULL;
+		}
+		binder_latency_account(proc, in_reply_to);
+		binder_proc_unlock(proc);
 		target_thread = in_reply_to->from;
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		binder_proc_lock(target_thread->proc);
 		if (target_thread->transaction_stack != in_reply_to) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad target transaction stack %d, "
@@ -1436,12 +1856,16 @@ static void binder_transaction(struct binder_proc *proc,
 				target_thread->transaction_stack ?
 				target_thread->transaction_stack->debug_id : 0,
 				in_reply_to->debug_id);
+			binder_proc_unlock(target_thread->proc);
 			return_error = BR_FAILED_REPLY;
 			in_reply_to = NULL;
 			target_thread = NULL;
 			goto err_dead_binder;
 		}
+		binder_proc_unlock(target_thread->proc);
 		target_proc = target_thread->proc;
+		/* the caller waiting for this runs at its own priority */
+		boost = binder_priority_is_foreground(in_reply_to->priority);
 	} else {
 		if (tr->target.handle) {
 			struct binder_ref *ref;
@@ -1469,6 +1893,8 @@ static void binder_transaction(struct binder_proc *proc,
 		}
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
 			struct binder_transaction *tmp;
+
+			binder_proc_lock(proc);
 			tmp = thread->transaction_stack;
 			if (tmp->to_thread != thread) {
 				binder_user_error("binder: %d:%d got new "
@@ -1478,6 +1904,7 @@ static void binder_transaction(struct binder_proc *proc,
 					tmp->to_proc ? tmp->to_proc->pid : 0,
 					tmp->to_thread ?
 					tmp->to_thread->pid : 0);
+				binder_proc_unlock(proc);
 				return_error = BR_FAILED_REPLY;
 				goto err_bad_call_stack;
 			}
@@ -1486,6 +1913,7 @@ static void binder_transaction(struct binder_proc *proc,
 					target_thread = tmp->from;
 				tmp = tmp->from_parent;
 			}
+			binder_proc_unlock(proc);
 		}
 	}
 	if (target_thread) {
@@ -1513,7 +1941,8 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
+	t->start_time = ktime_get();
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1542,10 +1971,13 @@ static void binder_transaction(struct binder_proc *proc,
 	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	t->priority = binder_current_priority();
+
+	binder_proc_lock(target_proc);
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
+		binder_proc_unlock(target_proc);
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
 	}
@@ -1555,6 +1987,12 @@ static void binder_transaction(struct binder_proc *proc,
 	t->buffer->target_node = target_node;
 	if (target_node)
 		binder_inc_node(target_node, 1, 0, NULL);
+	binder_proc_unlock(target_proc);
+
+	/*
+	 * The buffer cannot be freed by the target until it has been
+	 * queued, so fill it in without holding target_proc->lock.
+	 */
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
@@ -1720,10 +2158,30 @@ static void binder_transaction(struct binder_proc *proc,
 		binder_pop_transaction(target_thread, in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
+		/* Must be on our stack before the target can reply to it */
+		binder_proc_lock(proc);
 		t->need_reply = 1;
 		t->from_parent = thread->transaction_stack;
 		thread->transaction_stack = t;
-	} else {
+		binder_proc_unlock(proc);
+	}
+	t->work.type = BINDER_WORK_TRANSACTION;
+	trace_binder_transaction(reply, t, target_node);
+
+	/*
+	 * Boost for work someone in the foreground waits on: replies to a
+	 * caller that is not niced down, and calls from such a caller,
+	 * whose priority the thread that picks them up inherits. One-way
+	 * calls have nobody waiting on them.
+	 */
+	if (!reply)
+		boost = !(t->flags & TF_ONE_WAY) &&
+			binder_priority_is_foreground(t->priority);
+	if (boost)
+		cpufreq_notify_boost(CPUFREQ_BOOST_BINDER);
+
+	binder_proc_lock(target_proc);
+	if (!reply && (t->flags & TF_ONE_WAY)) {
 		BUG_ON(target_node == NULL);
 		BUG_ON(t->buffer->async_transaction != 1);
 		if (target_node->has_async_transaction) {
@@ -1732,12 +2190,15 @@ static void binder_transaction(struct binder_proc *proc,
 		} else
 			target_node->has_async_transaction = 1;
 	}
-	t->work.type = BINDER_WORK_TRANSACTION;
 	list_add_tail(&t->work.entry, target_list);
-	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
-	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
 		wake_up_interruptible(target_wait);
+	binder_proc_unlock(target_proc);
+
+	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
+	binder_proc_lock(proc);
+	list_add_tail(&tcomplete->entry, &thread->todo);
+	binder_proc_unlock(proc);
 	return;
 
 err_get_unused_fd_failed:
@@ -1749,9 +2210,11 @@ err_binder_new_node_failed:
 err_bad_object_type:
 err_bad_offset:
 err_copy_data_failed:
+	binder_proc_lock(target_proc);
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
+	binder_proc_unlock(target_proc);
 err_binder_alloc_buf_failed:
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
@@ -1777,27 +2240,34 @@ err_no_context_mgr_node:
 
 	BUG_ON(thread->return_error != BR_OK);
 	if (in_reply_to) {
+		binder_lock_exclusive(exclusive);
 		thread->return_error = BR_TRANSACTION_COMPLETE;
 		binder_send_failed_reply(in_reply_to, return_error);
 	} else
 		thread->return_error = return_error;
 }
 
+/*
+ * Called with binder_main_lock held for reading. Commands that change
+ * the object graph take it for writing and drop back to reading when
+ * they are done.
+ */
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			void __user *buffer, int size, signed long *consumed)
 {
 	uint32_t cmd;
 	void __user *ptr = buffer + *consumed;
 	void __user *end = buffer + size;
+	int exclusive = 0;
 
 	while (ptr < end && thread->return_error == BR_OK) {
 		if (get_user(cmd, (uint32_t __user *)ptr))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
 		}
 		switch (cmd) {
 		case BC_INCREFS:
@@ -1811,6 +2281,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(target, (uint32_t __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
+			binder_lock_exclusive(&exclusive);
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
 				ref = binder_get_ref_for_node(proc,
@@ -1868,6 +2339,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			binder_proc_lock(proc);
 			node = binder_get_node(proc, node_ptr);
 			if (node == NULL) {
 				binder_user_error("binder: %d:%d "
@@ -1877,6 +2349,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" :
 					"BC_ACQUIRE_DONE",
 					node_ptr);
+				binder_proc_unlock(proc);
 				break;
 			}
 			if (cookie != node->cookie) {
@@ -1887,6 +2360,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 					node_ptr, node->debug_id,
 					cookie, node->cookie);
+				binder_proc_unlock(proc);
 				break;
 			}
 			if (cmd == BC_ACQUIRE_DONE) {
@@ -1896,6 +2370,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending acquire request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_proc_unlock(proc);
 					break;
 				}
 				node->pending_strong_ref = 0;
@@ -1906,6 +2381,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						"no pending increfs request\n",
 						proc->pid, thread->pid,
 						node->debug_id);
+					binder_proc_unlock(proc);
 					break;
 				}
 				node->pending_weak_ref = 0;
@@ -1916,6 +2392,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     proc->pid, thread->pid,
 				     cmd == BC_INCREFS_DONE ? "BC_INCREFS_DONE" : "BC_ACQUIRE_DONE",
 				     node->debug_id, node->local_strong_refs, node->local_weak_refs);
+			binder_proc_unlock(proc);
 			break;
 		}
 		case BC_ATTEMPT_ACQUIRE:
@@ -1933,11 +2410,20 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 			ptr += sizeof(void *);
 
+			binder_proc_lock(proc);
 			buffer = binder_buffer_lookup(proc, data_ptr);
+			if (buffer && buffer->offsets_size && !exclusive) {
+				/* Releasing the objects drops refs */
+				binder_proc_unlock(proc);
+				binder_lock_exclusive(&exclusive);
+				binder_proc_lock(proc);
+				buffer = binder_buffer_lookup(proc, data_ptr);
+			}
 			if (buffer == NULL) {
 				binder_user_error("binder: %d:%d "
 					"BC_FREE_BUFFER u%p no match\n",
 					proc->pid, thread->pid, data_ptr);
+				binder_proc_unlock(proc);
 				break;
 			}
 			if (!buffer->allow_user_free) {
@@ -1945,6 +2431,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					"BC_FREE_BUFFER u%p matched "
 					"unreturned buffer\n",
 					proc->pid, thread->pid, data_ptr);
+				binder_proc_unlock(proc);
 				break;
 			}
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
@@ -1965,6 +2452,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			}
 			binder_transaction_buffer_release(proc, buffer, NULL);
 			binder_free_buf(proc, buffer);
+			binder_proc_unlock(proc);
 			break;
 		}
 
@@ -1975,7 +2463,8 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY,
+					   &exclusive);
 			break;
 		}
 
@@ -1983,6 +2472,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_REGISTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_proc_lock(proc);
 			if (thread->looper & BINDER_LOOPER_STATE_ENTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2000,11 +2490,13 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				proc->requested_threads_started++;
 			}
 			thread->looper |= BINDER_LOOPER_STATE_REGISTERED;
+			binder_proc_unlock(proc);
 			break;
 		case BC_ENTER_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_ENTER_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_proc_lock(proc);
 			if (thread->looper & BINDER_LOOPER_STATE_REGISTERED) {
 				thread->looper |= BINDER_LOOPER_STATE_INVALID;
 				binder_user_error("binder: %d:%d ERROR:"
@@ -2013,12 +2505,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid);
 			}
 			thread->looper |= BINDER_LOOPER_STATE_ENTERED;
+			binder_proc_unlock(proc);
 			break;
 		case BC_EXIT_LOOPER:
 			binder_debug(BINDER_DEBUG_THREADS,
 				     "binder: %d:%d BC_EXIT_LOOPER\n",
 				     proc->pid, thread->pid);
+			binder_proc_lock(proc);
 			thread->looper |= BINDER_LOOPER_STATE_EXITED;
+			binder_proc_unlock(proc);
 			break;
 
 		case BC_REQUEST_DEATH_NOTIFICATION:
@@ -2034,6 +2529,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (get_user(cookie, (void __user * __user *)ptr))
 				return -EFAULT;
 			ptr += sizeof(void *);
+			binder_lock_exclusive(&exclusive);
 			ref = binder_get_ref(proc, target);
 			if (ref == NULL) {
 				binder_user_error("binder: %d:%d %s "
@@ -2129,6 +2625,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				return -EFAULT;
 
 			ptr += sizeof(void *);
+			binder_lock_exclusive(&exclusive);
 			list_for_each_entry(w, &proc->delivered_death, entry) {
 				struct binder_ref_death *tmp_death = container_of(w, struct binder_ref_death, work);
 				if (tmp_death->cookie == cookie) {
@@ -2163,6 +2660,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			       proc->pid, thread->pid, cmd);
 			return -EINVAL;
 		}
+		binder_lock_shared(&exclusive);
 		*consumed = ptr - buffer;
 	}
 	return 0;
@@ -2172,9 +2670,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2191,6 +2689,10 @@ static int binder_has_thread_work(struct binder_thread *thread)
 		(thread->looper & BINDER_LOOPER_STATE_NEED_RETURN);
 }
 
+/*
+ * Called with binder_main_lock held for reading and proc->lock held,
+ * both of which are dropped while waiting for work.
+ */
 static int binder_thread_read(struct binder_proc *proc,
 			      struct binder_thread *thread,
 			      void  __user *buffer, int size,
@@ -2203,7 +2705,9 @@ static int binder_thread_read(struct binder_proc *proc,
 	int wait_for_proc_work;
 
 	if (*consumed == 0) {
-		if (put_user(BR_NOOP, (uint32_t __user *)ptr))
+		uint32_t cmd = BR_NOOP;
+
+		if (binder_copy_to_user_unlocked(proc, ptr, &cmd, sizeof(cmd)))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 	}
@@ -2212,16 +2716,25 @@ retry:
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 				list_empty(&thread->todo);
 
+	/*
+	 * Other threads only set our return_error with binder_main_lock
+	 * held for writing, so it is stable across the unlocked copies.
+	 */
 	if (thread->return_error != BR_OK && ptr < end) {
+		uint32_t cmd;
+
 		if (thread->return_error2 != BR_OK) {
-			if (put_user(thread->return_error2, (uint32_t __user *)ptr))
+			cmd = thread->return_error2;
+			if (binder_copy_to_user_unlocked(proc, ptr, &cmd,
+							 sizeof(cmd)))
 				return -EFAULT;
 			ptr += sizeof(uint32_t);
 			if (ptr == end)
 				goto done;
 			thread->return_error2 = BR_OK;
 		}
-		if (put_user(thread->return_error, (uint32_t __user *)ptr))
+		cmd = thread->return_error;
+		if (binder_copy_to_user_unlocked(proc, ptr, &cmd, sizeof(cmd)))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
 		thread->return_error = BR_OK;
@@ -2232,7 +2745,11 @@ retry:
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
 	if (wait_for_proc_work)
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+	trace_binder_wait_for_work(wait_for_proc_work,
+				   !!thread->transaction_stack,
+				   !list_empty(&thread->todo));
+	binder_proc_unlock(proc);
+	up_read(&binder_main_lock);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2243,7 +2760,7 @@ retry:
 			wait_event_interruptible(binder_user_error_wait,
 						 binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		binder_set_priority(proc->default_priority);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
@@ -2256,7 +2773,9 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
+	trace_binder_wakeup(wait_for_proc_work, ret);
+	down_read(&binder_main_lock);
+	binder_proc_lock(proc);
 	if (wait_for_proc_work)
 		proc->ready_threads--;
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
@@ -2269,6 +2788,15 @@ retry:
 		struct binder_transaction_data tr;
 		struct binder_work *w;
 		struct binder_transaction *t = NULL;
+		/* What this work item returns, copied out once it is done */
+		struct {
+			uint32_t cmd;
+			union {
+				struct binder_transaction_data tr;
+				void *ptrs[2];
+			} u;
+		} __packed out;
+		size_t out_size = 0;
 
 		if (!list_empty(&thread->todo))
 			w = list_first_entry(&thread->todo, struct binder_work, entry);
@@ -2289,9 +2817,8 @@ retry:
 		} break;
 		case BINDER_WORK_TRANSACTION_COMPLETE: {
 			cmd = BR_TRANSACTION_COMPLETE;
-			if (put_user(cmd, (uint32_t __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(uint32_t);
+			out.cmd = cmd;
+			out_size = sizeof(uint32_t);
 
 			binder_stat_br(proc, thread, cmd);
 			binder_debug(BINDER_DEBUG_TRANSACTION_COMPLETE,
@@ -2330,15 +2857,10 @@ retry:
 				node->has_weak_ref = 0;
 			}
 			if (cmd != BR_NOOP) {
-				if (put_user(cmd, (uint32_t __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(uint32_t);
-				if (put_user(node->ptr, (void * __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(void *);
-				if (put_user(node->cookie, (void * __user *)ptr))
-					return -EFAULT;
-				ptr += sizeof(void *);
+				out.cmd = cmd;
+				out.u.ptrs[0] = node->ptr;
+				out.u.ptrs[1] = node->cookie;
+				out_size = sizeof(uint32_t) + 2 * sizeof(void *);
 
 				binder_stat_br(proc, thread, cmd);
 				binder_debug(BINDER_DEBUG_USER_REFS,
@@ -2373,12 +2895,9 @@ retry:
 				cmd = BR_CLEAR_DEATH_NOTIFICATION_DONE;
 			else
 				cmd = BR_DEAD_BINDER;
-			if (put_user(cmd, (uint32_t __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(uint32_t);
-			if (put_user(death->cookie, (void * __user *)ptr))
-				return -EFAULT;
-			ptr += sizeof(void *);
+			out.cmd = cmd;
+			out.u.ptrs[0] = death->cookie;
+			out_size = sizeof(uint32_t) + sizeof(void *);
 			binder_debug(BINDER_DEBUG_DEATH_NOTIFICATION,
 				     "binder: %d:%d %s %p\n",
 				      proc->pid, thread->pid,
@@ -2393,11 +2912,18 @@ retry:
 				binder_stats_deleted(BINDER_STAT_DEATH);
 			} else
 				list_move(&w->entry, &proc->delivered_death);
-			if (cmd == BR_DEAD_BINDER)
-				goto done; /* DEAD_BINDER notifications can cause transactions */
 		} break;
 		}
 
+		if (out_size) {
+			if (binder_copy_to_user_unlocked(proc, ptr, &out,
+							 out_size))
+				return -EFAULT;
+			ptr += out_size;
+			if (out.cmd == BR_DEAD_BINDER)
+				goto done; /* DEAD_BINDER notifications can cause transactions */
+		}
+
 		if (!t)
 			continue;
 
@@ -2406,12 +2932,19 @@ retry:
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
+			t->saved_priority = binder_current_priority();
+			if (binder_inherit_rt &&
+			    binder_is_rt_policy(t->priority.sched_policy) &&
+			    !(t->flags & TF_ONE_WAY)) {
+				/* Never lower a thread that is already RT */
+				if (!binder_is_rt_policy(current->policy) ||
+				    current->rt_priority < t->priority.rt_prio)
+					binder_set_priority(t->priority);
+			} else if (t->priority.nice < target_node->min_priority &&
 			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
+				binder_set_nice(t->priority.nice);
 			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
+				 t->saved_priority.nice > target_node->min_priority)
 				binder_set_nice(target_node->min_priority);
 			cmd = BR_TRANSACTION;
 		} else {
@@ -2439,14 +2972,8 @@ retry:
 					ALIGN(t->buffer->data_size,
 					    sizeof(void *));
 
-		if (put_user(cmd, (uint32_t __user *)ptr))
-			return -EFAULT;
-		ptr += sizeof(uint32_t);
-		if (copy_to_user(ptr, &tr, sizeof(tr)))
-			return -EFAULT;
-		ptr += sizeof(tr);
-
 		binder_stat_br(proc, thread, cmd);
+		trace_binder_transaction_received(t, cmd == BR_REPLY);
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
 			     "size %zd-%zd ptr %p-%p\n",
@@ -2469,6 +2996,18 @@ retry:
 			kfree(t);
 			binder_stats_deleted(BINDER_STAT_TRANSACTION);
 		}
+
+		/*
+		 * The transaction is ours now. If the copy faults, a
+		 * BR_TRANSACTION still gets a failed reply when the thread
+		 * exits, as it stays on our transaction stack.
+		 */
+		out.cmd = cmd;
+		out.u.tr = tr;
+		if (binder_copy_to_user_unlocked(proc, ptr, &out,
+						 sizeof(uint32_t) + sizeof(tr)))
+			return -EFAULT;
+		ptr += sizeof(uint32_t) + sizeof(tr);
 		break;
 	}
 
@@ -2480,11 +3019,14 @@ done:
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 	     BINDER_LOOPER_STATE_ENTERED)) /* the user-space code fails to */
 	     /*spawn a new thread if we leave this out */) {
+		uint32_t cmd = BR_SPAWN_LOOPER;
+
 		proc->requested_threads++;
 		binder_debug(BINDER_DEBUG_THREADS,
 			     "binder: %d:%d BR_SPAWN_LOOPER\n",
 			     proc->pid, thread->pid);
-		if (put_user(BR_SPAWN_LOOPER, (uint32_t __user *)buffer))
+		if (binder_copy_to_user_unlocked(proc, buffer, &cmd,
+						 sizeof(cmd)))
 			return -EFAULT;
 	}
 	return 0;
@@ -2515,6 +3057,7 @@ static void binder_release_work(struct list_head *list)
 
 }
 
+/* Called with proc->lock held */
 static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 {
 	struct binder_thread *thread = NULL;
@@ -2550,6 +3093,7 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 	return thread;
 }
 
+/* Called with binder_main_lock held for writing */
 static int binder_free_thread(struct binder_proc *proc,
 			      struct binder_thread *thread)
 {
@@ -2598,12 +3142,14 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_main_lock);
+	binder_proc_lock(proc);
 	thread = binder_get_thread(proc);
 
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	binder_proc_unlock(proc);
+	up_read(&binder_main_lock);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2628,6 +3174,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	struct binder_thread *thread;
 	unsigned int size = _IOC_SIZE(cmd);
 	void __user *ubuf = (void __user *)arg;
+	int exclusive = 0;
 
 	/*printk(KERN_INFO "binder_ioctl: %d:%d %x %lx\n", proc->pid, current->pid, cmd, arg);*/
 
@@ -2635,8 +3182,10 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	down_read(&binder_main_lock);
+	binder_proc_lock(proc);
 	thread = binder_get_thread(proc);
+	binder_proc_unlock(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
 		goto err;
@@ -2668,7 +3217,9 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			}
 		}
 		if (bwr.read_size > 0) {
+			binder_proc_lock(proc);
 			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
+			binder_proc_unlock(proc);
 			if (!list_empty(&proc->todo))
 				wake_up_interruptible(&proc->wait);
 			if (ret < 0) {
@@ -2687,13 +3238,20 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		}
 		break;
 	}
-	case BINDER_SET_MAX_THREADS:
-		if (copy_from_user(&proc->max_threads, ubuf, sizeof(proc->max_threads))) {
+	case BINDER_SET_MAX_THREADS: {
+		int max_threads;
+
+		if (copy_from_user(&max_threads, ubuf, sizeof(max_threads))) {
 			ret = -EINVAL;
 			goto err;
 		}
+		binder_proc_lock(proc);
+		proc->max_threads = max_threads;
+		binder_proc_unlock(proc);
 		break;
+	}
 	case BINDER_SET_CONTEXT_MGR:
+		binder_lock_exclusive(&exclusive);
 		if (binder_context_mgr_node != NULL) {
 			printk(KERN_ERR "binder: BINDER_SET_CONTEXT_MGR already set\n");
 			ret = -EBUSY;
@@ -2723,6 +3281,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	case BINDER_THREAD_EXIT:
 		binder_debug(BINDER_DEBUG_THREADS, "binder: %d:%d exit\n",
 			     proc->pid, thread->pid);
+		binder_lock_exclusive(&exclusive);
 		binder_free_thread(proc, thread);
 		thread = NULL;
 		break;
@@ -2742,9 +3301,15 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	ret = 0;
 err:
-	if (thread)
+	if (thread) {
+		binder_proc_lock(proc);
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+		binder_proc_unlock(proc);
+	}
+	if (exclusive)
+		up_write(&binder_main_lock);
+	else
+		up_read(&binder_main_lock);
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2781,7 +3346,7 @@ static struct vm_operations_struct binder_vm_ops = {
 
 static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-	int ret;
+	int ret, i;
 	struct vm_struct *area;
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
@@ -2833,6 +3398,10 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2884,14 +3453,22 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	/*
+	 * Threads waiting for process work drop back to this. Only the
+	 * opener's nice value counts: an RT opener must not make every
+	 * looper of the process RT.
+	 */
+	proc->default_priority.sched_policy = SCHED_NORMAL;
+	proc->default_priority.rt_prio = 0;
+	proc->default_priority.nice = task_nice(current);
+	mutex_init(&proc->lock);
+	down_write(&binder_main_lock);
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	up_write(&binder_main_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -3011,6 +3588,13 @@ static void binder_deferred_release(struct binder_proc *proc)
 		binder_delete_ref(ref);
 	}
 	binder_release_work(&proc->todo);
+	while ((n = rb_first(&proc->code_latency))) {
+		struct binder_code_latency *cl = rb_entry(n,
+			struct binder_code_latency, rb_node);
+
+		rb_erase(&cl->rb_node, &proc->code_latency);
+		kfree(cl);
+	}
 	buffers = 0;
 
 	while ((n = rb_first(&proc->allocated_buffers))) {
@@ -3034,20 +3618,26 @@ static void binder_deferred_release(struct binder_proc *proc)
 	page_count = 0;
 	if (proc->pages) {
 		int i;
+
+		/* Wait for binder_shrink() to finish with our pages */
+		binder_proc_lock(proc);
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
+			if (proc->pages[i].page_ptr) {
 				void *page_addr = proc->buffer + i * PAGE_SIZE;
 				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 					     "binder_release: %d: "
-					     "page %d at %p not freed\n",
-					     proc->pid, i,
-					     page_addr);
+					     "page %d at %p %s\n",
+					     proc->pid, i, page_addr,
+					     list_empty(&proc->pages[i].lru) ?
+					     "not freed" : "unused");
+				binder_lru_del(&proc->pages[i]);
 				unmap_kernel_range((unsigned long)page_addr,
 					PAGE_SIZE);
-				__free_page(proc->pages[i]);
+				__free_page(proc->pages[i].page_ptr);
 				page_count++;
 			}
 		}
+		binder_proc_unlock(proc);
 		kfree(proc->pages);
 		vfree(proc->buffer);
 	}
@@ -3071,7 +3661,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		down_write(&binder_main_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3098,7 +3688,7 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
+		up_write(&binder_main_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3122,13 +3712,16 @@ static void print_binder_transaction(struct seq_file *m, const char *prefix,
 				     struct binder_transaction *t)
 {
 	seq_printf(m,
-		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %u:%ld r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
 		   t->to_proc ? t->to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
-		   t->code, t->flags, t->priority, t->need_reply);
+		   t->code, t->flags, t->priority.sched_policy,
+		   binder_is_rt_policy(t->priority.sched_policy) ?
+		   (long)t->priority.rt_prio : t->priority.nice,
+		   t->need_reply);
 	if (t->buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
@@ -3351,17 +3944,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3369,14 +3966,52 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
 	}
 }
 
+static void print_binder_alloc_stats(struct seq_file *m,
+				     struct binder_proc *proc)
+{
+	struct binder_alloc_stats *stats = &proc->alloc_stats;
+	struct rb_node *n;
+	size_t size, free_size = 0, largest = 0;
+	int i, free_count = 0, mapped = 0, unused = 0;
+
+	for (n = rb_first(&proc->free_buffers); n != NULL; n = rb_next(n)) {
+		size = binder_buffer_size(proc, rb_entry(n,
+					  struct binder_buffer, rb_node));
+		free_count++;
+		free_size += size;
+		if (size > largest)
+			largest = size;
+	}
+	for (i = 0; proc->pages && i < proc->buffer_size / PAGE_SIZE; i++) {
+		if (!proc->pages[i].page_ptr)
+			continue;
+		mapped++;
+		if (!list_empty(&proc->pages[i].lru))
+			unused++;
+	}
+
+	seq_printf(m, "  buffer allocs: %u avg %llu ns max %llu ns\n",
+		   stats->allocs, stats->allocs ?
+		   div_u64(stats->alloc_ns_total, stats->allocs) : 0ULL,
+		   (unsigned long long)stats->alloc_ns_max);
+	seq_printf(m, "  free space: %zd in %d buffers, largest %zd\n",
+		   free_size, free_count, largest);
+	seq_printf(m, "  pages: %d mapped %d unused, "
+		   "new %u reused %u reclaimed %u\n",
+		   mapped, unused, stats->pages_new, stats->pages_reused,
+		   stats->pages_reclaimed);
+}
+
 static void print_binder_proc_stats(struct seq_file *m,
 				    struct binder_proc *proc)
 {
@@ -3427,6 +4062,7 @@ static void print_binder_proc_stats(struct seq_file *m,
 	}
 	seq_printf(m, "  pending transactions: %d\n", count);
 
+	print_binder_alloc_stats(m, proc);
 	print_binder_stats(m, "  ", &proc->stats);
 }
 
@@ -3439,7 +4075,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_read(&binder_main_lock);
 
 	seq_puts(m, "binder state:\n");
 
@@ -3448,10 +4084,15 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(node, pos, &binder_dead_nodes, dead_node)
 		print_binder_node(m, node);
 
-	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (do_lock)
+			binder_proc_lock(proc);
 		print_binder_proc(m, proc, 1);
+		if (do_lock)
+			binder_proc_unlock(proc);
+	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_read(&binder_main_lock);
 	return 0;
 }
 
@@ -3462,16 +4103,78 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_read(&binder_main_lock);
 
 	seq_puts(m, "binder stats:\n");
 
 	print_binder_stats(m, "", &binder_stats);
+	seq_printf(m, "unused pages: %d\n", binder_lru_count);
 
-	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (do_lock)
+			binder_proc_lock(proc);
 		print_binder_proc_stats(m, proc);
+		if (do_lock)
+			binder_proc_unlock(proc);
+	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_read(&binder_main_lock);
+	return 0;
+}
+
+static void print_binder_latency_hist(struct seq_file *m,
+				      const char *prefix,
+				      struct binder_latency_hist *hist)
+{
+	int i;
+
+	seq_printf(m, "%s%u replies, max %u us\n", prefix, hist->count,
+		   hist->max_us);
+	for (i = 0; i < BINDER_LATENCY_BUCKETS - 1; i++)
+		if (hist->buckets[i])
+			seq_printf(m, "    < %u us: %u\n", 1U << i,
+				   hist->buckets[i]);
+	if (hist->buckets[i])
+		seq_printf(m, "    >= %u us: %u\n", 1U << (i - 1),
+			   hist->buckets[i]);
+}
+
+static void print_binder_latency(struct seq_file *m, struct binder_proc *proc)
+{
+	struct binder_code_latency *cl;
+	struct rb_node *n;
+	char prefix[32];
+
+	if (!proc->latency.count)
+		return;
+	seq_printf(m, "proc %d\n", proc->pid);
+	print_binder_latency_hist(m, "  all: ", &proc->latency);
+	for (n = rb_first(&proc->code_latency); n != NULL; n = rb_next(n)) {
+		cl = rb_entry(n, struct binder_code_latency, rb_node);
+		snprintf(prefix, sizeof(prefix), "  code %u: ", cl->code);
+		print_binder_latency_hist(m, prefix, &cl->hist);
+	}
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int do_lock = !binder_debug_no_lock;
+
+	if (do_lock)
+		down_read(&binder_main_lock);
+
+	seq_puts(m, "binder reply latency:\n");
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (do_lock)
+			binder_proc_lock(proc);
+		print_binder_latency(m, proc);
+		if (do_lock)
+			binder_proc_unlock(proc);
+	}
+	if (do_lock)
+		up_read(&binder_main_lock);
 	return 0;
 }
 
@@ -3482,13 +4185,18 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_read(&binder_main_lock);
 
 	seq_puts(m, "binder transactions:\n");
-	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
+		if (do_lock)
+			binder_proc_lock(proc);
 		print_binder_proc(m, proc, 0);
+		if (do_lock)
+			binder_proc_unlock(proc);
+	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_read(&binder_main_lock);
 	return 0;
 }
 
@@ -3497,12 +4205,18 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	struct binder_proc *proc = m->private;
 	int do_lock = !binder_debug_no_lock;
 
-	if (do_lock)
-		mutex_lock(&binder_lock);
+	if (do_lock) {
+		down_read(&binder_main_lock);
+		binder_proc_lock(proc);
+	}
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
-	if (do_lock)
-		mutex_unlock(&binder_lock);
+	print_binder_alloc_stats(m, proc);
+	print_binder_latency(m, proc);
+	if (do_lock) {
+		binder_proc_unlock(proc);
+		up_read(&binder_main_lock);
+	}
 	return 0;
 }
 
@@ -3520,14 +4234,21 @@ static void print_binder_transaction_log_entry(struct seq_file *m,
 static int binder_transaction_log_show(struct seq_file *m, void *unused)
 {
 	struct binder_transaction_log *log = m->private;
+	unsigned int log_cur = atomic_read(&log->cur);
+	unsigned int count, cur;
 	int i;
 
-	if (log->full) {
-		for (i = log->next; i < ARRAY_SIZE(log->entry); i++)
-			print_binder_transaction_log_entry(m, &log->entry[i]);
+	/* Oldest first; entries may be overwritten as we go */
+	count = log_cur + 1;
+	cur = count < ARRAY_SIZE(log->entry) && !log->full ?
+		0 : count % ARRAY_SIZE(log->entry);
+	if (count > ARRAY_SIZE(log->entry) || log->full)
+		count = ARRAY_SIZE(log->entry);
+	for (i = 0; i < count; i++) {
+		unsigned int index = cur++ % ARRAY_SIZE(log->entry);
+
+		print_binder_transaction_log_entry(m, &log->entry[index]);
 	}
-	for (i = 0; i < log->next; i++)
-		print_binder_transaction_log_entry(m, &log->entry[i]);
 	return 0;
 }
 
@@ -3551,6 +4272,7 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(latency);
 
 static int __init binder_init(void)
 {
@@ -3565,6 +4287,8 @@ static int __init binder_init(void)
 		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
 						 binder_debugfs_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	if (!ret)
+		register_shrinker(&binder_shrinker);
 	if (binder_debugfs_dir_entry_root) {
 		debugfs_create_file("state",
 				    S_IRUGO,
@@ -3591,6 +4315,11 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    &binder_transaction_log_failed,
 				    &binder_transaction_log_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 	}
 	return ret;
 }
@@ -0,0 +1,133 @@
+/* binder_trace.h
+ *
+ * Android IPC Subsystem tracepoints
+ *
+ * Copyright (C) 2007-2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE binder_trace
+
+#include <linux/tracepoint.h>
+
+/*
+ * Only included from binder.c, after the definitions of the structures
+ * used below. Transactions are identified by debug_id in all events,
+ * matching the ids in the debugfs transaction logs.
+ */
+struct binder_transaction;
+struct binder_node;
+
+/* A transaction or reply has been queued for its target */
+TRACE_EVENT(binder_transaction,
+	TP_PROTO(bool reply, struct binder_transaction *t,
+		 struct binder_node *target_node),
+	TP_ARGS(reply, t, target_node),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, target_node)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(int, reply)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->target_node = target_node ? target_node->debug_id : 0;
+		__entry->to_proc = t->to_proc->pid;
+		__entry->to_thread = t->to_thread ? t->to_thread->pid : 0;
+		__entry->reply = reply;
+		__entry->code = t->code;
+		__entry->flags = t->flags;
+	),
+
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->target_node, __entry->to_proc,
+		  __entry->to_thread, __entry->reply, __entry->flags,
+		  __entry->code)
+);
+
+/* A thread is about to sleep in binder_thread_read() */
+TRACE_EVENT(binder_wait_for_work,
+	TP_PROTO(bool proc_work, bool transaction_stack, bool thread_todo),
+	TP_ARGS(proc_work, transaction_stack, thread_todo),
+
+	TP_STRUCT__entry(
+		__field(bool, proc_work)
+		__field(bool, transaction_stack)
+		__field(bool, thread_todo)
+	),
+
+	TP_fast_assign(
+		__entry->proc_work = proc_work;
+		__entry->transaction_stack = transaction_stack;
+		__entry->thread_todo = thread_todo;
+	),
+
+	TP_printk("proc_work=%d transaction_stack=%d thread_todo=%d",
+		  __entry->proc_work, __entry->transaction_stack,
+		  __entry->thread_todo)
+);
+
+/* ... and has woken up again, ret is 0 unless interrupted */
+TRACE_EVENT(binder_wakeup,
+	TP_PROTO(bool proc_work, int ret),
+	TP_ARGS(proc_work, ret),
+
+	TP_STRUCT__entry(
+		__field(bool, proc_work)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->proc_work = proc_work;
+		__entry->ret = ret;
+	),
+
+	TP_printk("proc_work=%d ret=%d", __entry->proc_work, __entry->ret)
+);
+
+/* The target thread has read the transaction (or reply) */
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(struct binder_transaction *t, bool reply),
+	TP_ARGS(t, reply),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, reply)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->reply = reply;
+	),
+
+	TP_printk("transaction=%d reply=%d",
+		  __entry->debug_id, __entry->reply)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -33,16 +33,24 @@
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. The offsets are protected by the
+ * spinlock 'lock'.
+ *
+ * Offsets count the bytes ever written to the log, so they only grow;
+ * logger_offset() maps them into the ring buffer. A writer reserves space
+ * and fills in the header of its entry under 'lock', but copies the payload
+ * in without holding it, so concurrent writers only serialize for a few
+ * instructions. Entries become readable in order, once they and all the
+ * entries before them are complete.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
-	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	wait_queue_head_t	room_wq; /* wait queue for writers */
+	spinlock_t		lock;	/* spinlock protecting offsets */
+	size_t			w_off;	/* readable entries end here */
+	size_t			w_next;	/* next entry is reserved here */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
 };
@@ -51,17 +59,22 @@ struct logger_log {
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
-	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/* __pad of an entry whose payload is still being copied in */
+#define LOGGER_ENTRY_BUSY	1
+
+/* __pad of an entry whose payload could not be copied in; never read */
+#define LOGGER_ENTRY_DISCARDED	2
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -85,38 +98,94 @@ static inline struct logger_log *file_get_log(struct file *file)
 		return file->private_data;
 }
 
+/*
+ * do_read_log - copies 'count' bytes starting at 'off' out of 'log' into
+ * 'buf', wrapping around the end of the ring buffer.
+ */
+static void do_read_log(struct logger_log *log, size_t off, void *buf,
+			size_t count)
+{
+	size_t len;
+
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memcpy(buf, log->buffer + off, len);
+
+	if (count != len)
+		memcpy(buf + len, log->buffer, count - len);
+}
+
 /*
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
 	__u16 val;
 
-	switch (log->size - off) {
-	case 1:
-		memcpy(&val, log->buffer + off, 1);
-		memcpy(((char *) &val) + 1, log->buffer, 1);
-		break;
-	default:
-		memcpy(&val, log->buffer + off, 2);
-	}
+	do_read_log(log, off, &val, sizeof(val));
 
 	return sizeof(struct logger_entry) + val;
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * entry_is_busy - is the payload of the entry at 'off' still being written?
+ *
+ * Caller needs to hold log->lock.
+ */
+static int entry_is_busy(struct logger_log *log, size_t off)
+{
+	__u16 val;
+
+	do_read_log(log, off + offsetof(struct logger_entry, __pad),
+		    &val, sizeof(val));
+
+	return val == LOGGER_ENTRY_BUSY;
+}
+
+/*
+ * entry_is_discarded - was the entry at 'off' given up by its writer?
+ *
+ * Caller needs to hold log->lock.
+ */
+static int entry_is_discarded(struct logger_log *log, size_t off)
+{
+	__u16 val;
+
+	do_read_log(log, off + offsetof(struct logger_entry, __pad),
+		    &val, sizeof(val));
+
+	return val == LOGGER_ENTRY_DISCARDED;
+}
+
+/*
+ * fix_up_reader - pull a reader that was lapped by the writers forward to
+ * the first entry after log->head, and past any discarded entries. Writers
+ * only move log->head; each reader catches up with it the next time it
+ * looks at the log.
+ *
+ * Caller needs to hold log->lock.
+ */
+static void fix_up_reader(struct logger_log *log, struct logger_reader *reader)
+{
+	if ((long) (reader->r_off - log->head) < 0)
+		reader->r_off = log->head;
+
+	while (reader->r_off != log->w_off &&
+	       entry_is_discarded(log, reader->r_off))
+		reader->r_off += get_entry_len(log, reader->r_off);
+}
+
+/*
+ * do_read_log_to_user - reads exactly 'count' bytes starting at 'off' from
+ * 'log' into the user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * The caller must check that no writer reserved the space in the meantime.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
-				   char __user *buf,
-				   size_t count)
+static ssize_t do_read_log_to_user(struct logger_log *log, size_t off,
+				   char __user *buf, size_t count)
 {
 	size_t len;
 
@@ -125,8 +194,9 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -137,8 +207,6 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
@@ -159,6 +227,7 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 {
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
+	size_t r_off;
 	ssize_t ret;
 	DEFINE_WAIT(wait);
 
@@ -166,9 +235,10 @@ start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
+		fix_up_reader(log, reader);
 		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -189,133 +259,162 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
+	fix_up_reader(log, reader);
 	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		goto start;
 	}
 
 	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
-	}
+	r_off = reader->r_off;
+	ret = get_entry_len(log, r_off);
+	spin_unlock(&log->lock);
+	if (count < ret)
+		return -EINVAL;
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(log, r_off, buf, ret);
+	if (ret < 0)
+		return ret;
 
-out:
-	mutex_unlock(&log->mutex);
+	/*
+	 * A writer reserving the space we just copied from moves log->head
+	 * past it before touching it, and another thread reading from the
+	 * same file may have consumed the entry; try again in either case.
+	 */
+	smp_rmb();
+	spin_lock(&log->lock);
+	if ((long) (log->head - r_off) > 0 || reader->r_off != r_off) {
+		spin_unlock(&log->lock);
+		goto start;
+	}
+	reader->r_off = r_off + ret;
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
- *
- * Caller must hold log->mutex.
+ * log_has_room - can 'len' bytes be reserved without overwriting an entry
+ * that is still being written?
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static inline int log_has_room(struct logger_log *log, size_t len)
 {
-	size_t count = 0;
-
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
-
-	return off;
+	return log->w_next + len - log->w_off <= log->size;
 }
 
 /*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
+ * log_reserve - reserves 'len' bytes for a new entry and returns the offset
+ * it starts at. Readers are pulled forward by moving log->head to the first
+ * entry after (what will be) the new write offset, so that a partially
+ * written entry never encroaches on readable buffer.
+ *
+ * The caller needs to hold log->lock, which is dropped while waiting for
+ * earlier entries to complete if the log is full of them.
  */
-static inline int clock_interval(size_t a, size_t b, size_t c)
+static size_t log_reserve(struct logger_log *log, size_t len)
 {
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
+	size_t off;
+
+	while (unlikely(!log_has_room(log, len))) {
+		spin_unlock(&log->lock);
+		wait_event(log->room_wq, log_has_room(log, len));
+		spin_lock(&log->lock);
 	}
 
-	return 0;
-}
+	while (log->w_next + len - log->head > log->size)
+		log->head += get_entry_len(log, log->head);
 
-/*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
- */
-static void fix_up_readers(struct logger_log *log, size_t len)
-{
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	off = log->w_next;
+	log->w_next += len;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	/* readers must see the new head before we overwrite anything */
+	smp_wmb();
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	return off;
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to have reserved the space.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off, const void *buf,
+			 size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
 }
 
 /*
  * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * the log 'log' at 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to have reserved the space.
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	off = logger_offset(off);
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
+/*
+ * log_commit - marks the entry at 'off' as complete, and makes it readable
+ * along with any complete entries following it once all entries before it
+ * are complete as well. A 'discard'ed entry still takes up its space, but
+ * readers skip it.
+ */
+static void log_commit(struct logger_log *log, size_t off, int discard)
+{
+	__u16 pad = discard ? LOGGER_ENTRY_DISCARDED : 0;
+	size_t old;
+	int advanced;
+
+	/* the payload must be visible before the entry is */
+	smp_wmb();
+
+	spin_lock(&log->lock);
+	do_write_log(log, off + offsetof(struct logger_entry, __pad),
+		     &pad, sizeof(pad));
+	old = log->w_off;
+	while (log->w_off != log->w_next && !entry_is_busy(log, log->w_off))
+		log->w_off += get_entry_len(log, log->w_off);
+	advanced = (log->w_off != old);
+	spin_unlock(&log->lock);
+
+	if (!advanced)
+		return;
+
+	/* wake up any blocked readers, and writers waiting for room */
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
+	if (waitqueue_active(&log->room_wq))
+		wake_up(&log->room_wq);
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -325,9 +424,9 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
 	struct timespec now;
+	size_t off;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
@@ -337,22 +436,16 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	header.sec = now.tv_sec;
 	header.nsec = now.tv_nsec;
 	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	header.__pad = LOGGER_ENTRY_BUSY;
 
 	/* null writes succeed, return zero */
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	spin_lock(&log->lock);
+	off = log_reserve(log, sizeof(struct logger_entry) + header.len);
+	do_write_log(log, off, &header, sizeof(struct logger_entry));
+	spin_unlock(&log->lock);
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -362,21 +455,20 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log,
+				off + sizeof(struct logger_entry) + ret,
+				iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			/* the space is ours now, readers will skip it */
+			ret = nr;
+			break;
 		}
 
 		iov++;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	log_commit(log, off, ret < 0);
 
 	return ret;
 }
@@ -409,12 +501,10 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
-		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
-		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -432,7 +522,6 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
-		list_del(&reader->list);
 		kfree(reader);
 	}
 
@@ -462,10 +551,11 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
+	fix_up_reader(log, reader);
 	if (log->w_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -476,7 +566,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -488,10 +578,8 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
-		else
-			ret = (log->size - reader->r_off) + log->w_off;
+		fix_up_reader(log, reader);
+		ret = log->w_off - reader->r_off;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -499,6 +587,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
+		fix_up_reader(log, reader);
 		if (log->w_off != reader->r_off)
 			ret = get_entry_len(log, reader->r_off);
 		else
@@ -509,14 +598,13 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
+		/* readers catch up with the new head in fix_up_reader() */
 		log->head = log->w_off;
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -548,9 +636,10 @@ static struct logger_log VAR = { \
 		.parent = NULL, \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
-	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.room_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .room_wq), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.w_next = 0, \
 	.head = 0, \
 	.size = SIZE, \
 };
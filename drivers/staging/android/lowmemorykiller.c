@@ -36,8 +36,15 @@
 #include <linux/sched.h>
 #include <linux/notifier.h>
 #include <linux/memory.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/workqueue.h>
 #include <linux/memory_hotplug.h>
 
+#define CREATE_TRACE_POINTS
+#include "lowmemorykiller_trace.h"
+
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
 	0,
@@ -57,6 +64,48 @@ static int lowmem_minfree_size = 4;
 static unsigned int offlining;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
+static unsigned int lowmem_deathpending_timeout_ms = 1000;
+
+/*
+ * lowmem_lock - serializes victim selection and lowmem_deathpending
+ *
+ * Lock Ordering: tasklist_lock -> sighand->siglock -> lowmem_index_lock
+ *                lowmem_lock -> task_lock
+ *
+ * Nothing else is taken under lowmem_index_lock, which lets the fork,
+ * exit and exec paths update the index. They do so with tasklist_lock
+ * write-locked and interrupts off, so lowmem_index_lock is IRQ-safe:
+ * everywhere else it is taken with interrupts disabled. Otherwise an
+ * interrupt that read-locks tasklist_lock (e.g. kill_fasync()) while we
+ * hold it could deadlock against a fork spinning on it.
+ */
+static DEFINE_MUTEX(lowmem_lock);
+static DEFINE_SPINLOCK(lowmem_index_lock);
+
+/*
+ * Thread group leaders, bucketed by oom_adj, with a bit set in
+ * lowmem_index_map for each non-empty bucket. Selection only looks at the
+ * highest buckets, instead of scanning every process.
+ */
+#define LOWMEM_ADJ_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define lowmem_adj_bucket(adj)	((adj) - OOM_DISABLE)
+
+/* candidates per bucket we look at the RSS of */
+#define LOWMEM_SCAN_BATCH	32
+
+static struct list_head lowmem_index[LOWMEM_ADJ_BUCKETS];
+static DECLARE_BITMAP(lowmem_index_map, LOWMEM_ADJ_BUCKETS);
+static int lowmem_index_ready;
+
+/* A process we picked to kill, sizes in pages */
+struct lowmem_victim {
+	struct task_struct *task;
+	int oom_adj;
+	int rss;
+	int swap;		/* swapped out, mostly to zram */
+};
+
+#define lowmem_victim_size(v)	((v)->rss + (v)->swap)
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -64,22 +113,68 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
-static int
-task_notify_func(struct notifier_block *self, unsigned long val, void *data);
+static void lowmem_work_func(struct work_struct *work);
+static DECLARE_WORK(lowmem_work, lowmem_work_func);
 
-static struct notifier_block task_nb = {
-	.notifier_call	= task_notify_func,
-};
+/* Caller must hold lowmem_index_lock. */
+static void __lowmem_index_add(struct task_struct *p)
+{
+	int oom_adj = p->signal->oom_adj;
+	int bucket;
+
+	if (oom_adj < OOM_DISABLE || oom_adj > OOM_ADJUST_MAX)
+		return;
+	bucket = lowmem_adj_bucket(oom_adj);
+	list_add_tail(&p->lowmem_node, &lowmem_index[bucket]);
+	__set_bit(bucket, lowmem_index_map);
+}
+
+/* Caller must hold lowmem_index_lock. */
+static void __lowmem_index_del(struct task_struct *p)
+{
+	struct list_head *next = p->lowmem_node.next;
+
+	list_del_init(&p->lowmem_node);
+	/* if we were the last one, 'next' is now an empty bucket */
+	if (list_empty(next) && next >= lowmem_index &&
+	    next < lowmem_index + LOWMEM_ADJ_BUCKETS)
+		__clear_bit(next - lowmem_index, lowmem_index_map);
+}
 
-static int
-task_notify_func(struct notifier_block *self, unsigned long val, void *data)
+/* Called with tasklist_lock write-locked, hence interrupts off */
+void lowmem_index_add(struct task_struct *p)
 {
-	struct task_struct *task = data;
+	if (p->flags & PF_KTHREAD)
+		return;
 
-	if (task == lowmem_deathpending)
-		lowmem_deathpending = NULL;
+	spin_lock(&lowmem_index_lock);
+	if (lowmem_index_ready)
+		__lowmem_index_add(p);
+	spin_unlock(&lowmem_index_lock);
+}
 
-	return NOTIFY_OK;
+/* Called with tasklist_lock write-locked, hence interrupts off */
+void lowmem_index_del(struct task_struct *p)
+{
+	spin_lock(&lowmem_index_lock);
+	if (!list_empty(&p->lowmem_node))
+		__lowmem_index_del(p);
+	spin_unlock(&lowmem_index_lock);
+}
+
+/* Called after p->signal->oom_adj changed */
+void lowmem_index_update(struct task_struct *p)
+{
+	unsigned long flags;
+
+	p = p->group_leader;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	if (!list_empty(&p->lowmem_node)) {
+		__lowmem_index_del(p);
+		__lowmem_index_add(p);
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
 }
 
 #ifdef CONFIG_MEMORY_HOTPLUG
@@ -108,20 +203,23 @@ static int lmk_hotplug_callback(struct notifier_block *self,
 
 
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+/*
+ * lowmem_min_adj - returns the lowest oom_adj we may kill at the current
+ * amount of free memory, or OOM_ADJUST_MAX + 1 if there is no need to kill.
+ *
+ * Swap cache pages are counted in NR_FILE_PAGES but can't be dropped like
+ * file cache, while reclaimable slab can, so "file" is adjusted for both.
+ */
+static int lowmem_min_adj(int *free, int *file)
 {
-	struct task_struct *p;
-	struct task_struct *selected = NULL;
-	int rem = 0;
-	int tasksize;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
-						global_page_state(NR_SHMEM);
+						global_page_state(NR_SHMEM) -
+						total_swapcache_pages +
+				global_page_state(NR_SLAB_RECLAIMABLE);
 	struct zone *zone;
 
 	if (offlining) {
@@ -136,16 +234,6 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			}
 		}
 	}
-	/*
-	 * If we already have a death outstanding, then
-	 * bail out right away; indicating to vmscan
-	 * that we have nothing further to offer on
-	 * this pass.
-	 *
-	 */
-	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
-		return 0;
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
@@ -158,6 +246,191 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			break;
 		}
 	}
+
+	*free = other_free;
+	*file = other_file;
+	return min_adj;
+}
+
+/*
+ * lowmem_death_pending - is the last victim still releasing its memory?
+ *
+ * It stops counting as pending once it has dropped its mm, rather than only
+ * once it has been reaped.
+ *
+ * Caller must hold lowmem_lock.
+ */
+static int lowmem_death_pending(void)
+{
+	struct task_struct *p = lowmem_deathpending;
+	struct mm_struct *mm;
+
+	if (!p)
+		return 0;
+
+	task_lock(p);
+	mm = p->mm;
+	task_unlock(p);
+	if (mm && time_before_eq(jiffies, lowmem_deathpending_timeout))
+		return 1;
+
+	lowmem_deathpending = NULL;
+	put_task_struct(p);
+	return 0;
+}
+
+/*
+ * lowmem_select - finds the process to kill, if any. Returns 1 and fills
+ * in 'victim', with a reference held on victim->task that is handed over
+ * to lowmem_deathpending.
+ *
+ * Only the highest non-empty oom_adj buckets at or above 'min_adj' are
+ * looked at, and of each at most LOWMEM_SCAN_BATCH processes. Within a
+ * bucket the one that would free the most pages is picked, counting both
+ * its RSS and its swap entries: with zram, swapped out pages still take
+ * up memory.
+ */
+static int lowmem_select(int min_adj, struct lowmem_victim *victim)
+{
+	struct task_struct *candidates[LOWMEM_SCAN_BATCH];
+	struct task_struct *p;
+	int limit = LOWMEM_ADJ_BUCKETS;
+	int bucket, nr, i;
+
+	if (min_adj < OOM_DISABLE)
+		min_adj = OOM_DISABLE;
+
+	victim->task = NULL;
+	while (!victim->task) {
+		nr = 0;
+		spin_lock_irq(&lowmem_index_lock);
+		bucket = find_last_bit(lowmem_index_map, limit);
+		if (bucket >= limit || bucket < lowmem_adj_bucket(min_adj)) {
+			spin_unlock_irq(&lowmem_index_lock);
+			break;
+		}
+		list_for_each_entry(p, &lowmem_index[bucket], lowmem_node) {
+			get_task_struct(p);
+			candidates[nr++] = p;
+			if (nr == LOWMEM_SCAN_BATCH)
+				break;
+		}
+		spin_unlock_irq(&lowmem_index_lock);
+		limit = bucket;
+
+		for (i = 0; i < nr; i++) {
+			struct lowmem_victim v = { .task = candidates[i] };
+			struct mm_struct *mm;
+
+			p = v.task;
+			task_lock(p);
+			mm = p->mm;
+			v.oom_adj = p->signal->oom_adj;
+			if (mm) {
+				v.rss = get_mm_rss(mm);
+				v.swap = get_mm_counter(mm, MM_SWAPENTS);
+			}
+			task_unlock(p);
+
+			if (v.rss <= 0 || v.oom_adj < min_adj ||
+			    (victim->task && lowmem_victim_size(&v) <=
+					     lowmem_victim_size(victim))) {
+				put_task_struct(p);
+				continue;
+			}
+			if (victim->task)
+				put_task_struct(victim->task);
+			*victim = v;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "swap %d, to kill\n", p->pid, p->comm,
+				     v.oom_adj, v.rss, v.swap);
+		}
+	}
+
+	return victim->task != NULL;
+}
+
+/*
+ * lowmem_kill - kills the best victim at or above 'min_adj'. Returns the
+ * number of pages that should free up.
+ *
+ * Caller must hold lowmem_lock, and must have checked that no death is
+ * pending.
+ */
+static int lowmem_kill(int min_adj, int other_free, int other_file)
+{
+	struct lowmem_victim victim;
+	struct task_struct *selected;
+
+	if (!lowmem_select(min_adj, &victim))
+		return 0;
+
+	selected = victim.task;
+	lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d, swap %d\n",
+		     selected->pid, selected->comm,
+		     victim.oom_adj, victim.rss, victim.swap);
+	trace_lowmemory_kill(selected, victim.oom_adj, victim.rss,
+			     victim.swap, min_adj, other_free, other_file);
+	lowmem_deathpending = selected;
+	lowmem_deathpending_timeout = jiffies +
+		msecs_to_jiffies(lowmem_deathpending_timeout_ms);
+	send_sig(SIGKILL, selected, 0);
+	return lowmem_victim_size(&victim);
+}
+
+/*
+ * Kills from process context as soon as an allocation has to wake kswapd,
+ * so that foreground tasks don't have to wait for direct reclaim to get
+ * around to calling lowmem_shrink().
+ */
+static void lowmem_work_func(struct work_struct *work)
+{
+	int other_free, other_file;
+	int min_adj;
+
+	mutex_lock(&lowmem_lock);
+	if (!lowmem_death_pending()) {
+		min_adj = lowmem_min_adj(&other_free, &other_file);
+		if (min_adj != OOM_ADJUST_MAX + 1) {
+			lowmem_print(3, "lowmem_work ofree %d %d, ma %d\n",
+				     other_free, other_file, min_adj);
+			lowmem_kill(min_adj, other_free, other_file);
+		}
+	}
+	mutex_unlock(&lowmem_lock);
+}
+
+/* Called from wakeup_kswapd(), possibly in atomic context */
+void lowmem_notify_pressure(void)
+{
+	int other_free, other_file;
+
+	if (!lowmem_index_ready || lowmem_deathpending)
+		return;
+	if (lowmem_min_adj(&other_free, &other_file) == OOM_ADJUST_MAX + 1)
+		return;
+	schedule_work(&lowmem_work);
+}
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int rem = 0;
+	int min_adj;
+	int other_free, other_file;
+
+	/*
+	 * If we already have a death outstanding, or another CPU is
+	 * picking one, then bail out right away; indicating to vmscan
+	 * that we have nothing further to offer on this pass.
+	 */
+	if (!mutex_trylock(&lowmem_lock))
+		return 0;
+	if (lowmem_death_pending()) {
+		mutex_unlock(&lowmem_lock);
+		return 0;
+	}
+
+	min_adj = lowmem_min_adj(&other_free, &other_file);
 	if (sc->nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %lu, %x, ofree %d %d, ma %d\n",
 			     sc->nr_to_scan, sc->gfp_mask, other_free, other_file,
@@ -169,57 +442,14 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	if (sc->nr_to_scan <= 0 || min_adj == OOM_ADJUST_MAX + 1) {
 		lowmem_print(5, "lowmem_shrink %lu, %x, return %d\n",
 			     sc->nr_to_scan, sc->gfp_mask, rem);
+		mutex_unlock(&lowmem_lock);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
-	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
-	}
+	rem -= lowmem_kill(min_adj, other_free, other_file);
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	read_unlock(&tasklist_lock);
+	mutex_unlock(&lowmem_lock);
 	return rem;
 }
 
@@ -230,7 +460,22 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
-	task_free_register(&task_nb);
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_ADJ_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_index[i]);
+
+	/* fork and exit are excluded while we index what is already there */
+	read_lock(&tasklist_lock);
+	spin_lock_irq(&lowmem_index_lock);
+	lowmem_index_ready = 1;
+	for_each_process(p)
+		if (!(p->flags & PF_KTHREAD))
+			__lowmem_index_add(p);
+	spin_unlock_irq(&lowmem_index_lock);
+	read_unlock(&tasklist_lock);
+
 	register_shrinker(&lowmem_shrinker);
 #ifdef CONFIG_MEMORY_HOTPLUG
 	hotplug_memory_notifier(lmk_hotplug_callback, 0);
@@ -241,7 +486,6 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
-	task_free_unregister(&task_nb);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -250,6 +494,8 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(deathpending_timeout_ms, lowmem_deathpending_timeout_ms,
+		   uint, S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -0,0 +1,66 @@
+/* drivers/staging/android/lowmemorykiller_trace.h
+ *
+ * Copyright (C) 2007-2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#if !defined(_LOWMEMORYKILLER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOWMEMORYKILLER_TRACE_H
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE lowmemorykiller_trace
+
+#include <linux/tracepoint.h>
+
+/* A victim was killed; sizes are in pages */
+TRACE_EVENT(lowmemory_kill,
+	TP_PROTO(struct task_struct *p, int oom_adj, int rss, int swap,
+		 int min_adj, int other_free, int other_file),
+	TP_ARGS(p, oom_adj, rss, swap, min_adj, other_free, other_file),
+
+	TP_STRUCT__entry(
+		__array(char, comm, TASK_COMM_LEN)
+		__field(pid_t, pid)
+		__field(int, oom_adj)
+		__field(int, rss)
+		__field(int, swap)
+		__field(int, min_adj)
+		__field(int, other_free)
+		__field(int, other_file)
+	),
+
+	TP_fast_assign(
+		memcpy(__entry->comm, p->comm, TASK_COMM_LEN);
+		__entry->pid = p->pid;
+		__entry->oom_adj = oom_adj;
+		__entry->rss = rss;
+		__entry->swap = swap;
+		__entry->min_adj = min_adj;
+		__entry->other_free = other_free;
+		__entry->other_file = other_file;
+	),
+
+	TP_printk("%s (%d), adj %d, rss %d, swap %d, min_adj %d, "
+		  "ofree %d, ofile %d",
+		  __entry->comm, __entry->pid, __entry->oom_adj,
+		  __entry->rss, __entry->swap, __entry->min_adj,
+		  __entry->other_free, __entry->other_file)
+);
+
+#endif /* _LOWMEMORYKILLER_TRACE_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -0,0 +1,269 @@
+/*
+ * zram compression streams
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/kernel.h>
+#include <linux/err.h>
+#include <linux/errno.h>
+#include <linux/gfp.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zcomp.h"
+
+/*
+ * Compressors offered in comp_algorithm. Any other crypto API
+ * compressor can still be selected by name.
+ */
+static const char * const backends[] = {
+	"lzo",
+	"lz4",
+	"deflate",
+	NULL
+};
+
+int zcomp_available_algorithm(const char *comp)
+{
+	return crypto_has_comp(comp, 0, 0);
+}
+
+/* Show available compressors, marking the selected one with [] */
+ssize_t zcomp_available_show(const char *comp, char *buf)
+{
+	ssize_t sz = 0;
+	int i, found = 0;
+
+	for (i = 0; backends[i]; i++) {
+		if (!strcmp(comp, backends[i])) {
+			sz += sprintf(buf + sz, "[%s] ", backends[i]);
+			found = 1;
+		} else if (zcomp_available_algorithm(backends[i])) {
+			sz += sprintf(buf + sz, "%s ", backends[i]);
+		}
+	}
+
+	/* The selected compressor need not be one of the usual ones */
+	if (!found)
+		sz += sprintf(buf + sz, "[%s] ", comp);
+
+	sz += sprintf(buf + sz, "\n");
+	return sz;
+}
+
+static void zcomp_strm_free(struct zcomp_strm *zstrm)
+{
+	if (!IS_ERR_OR_NULL(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+/*
+ * Streams are only allocated when the device is set up or its stream
+ * limit is raised, never from the I/O path, so this may sleep and load
+ * the compressor module.
+ */
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	zstrm = kmalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->tfm = crypto_alloc_comp(comp->name, 0, 0);
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (IS_ERR(zstrm->tfm) || !zstrm->buffer) {
+		zcomp_strm_free(zstrm);
+		return NULL;
+	}
+
+	INIT_LIST_HEAD(&zstrm->list);
+	return zstrm;
+}
+
+/*
+ * Get an idle stream, sleeping until another user releases one if all
+ * of them are busy. Never allocates.
+ */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_first_entry(&comp->idle_strm,
+					struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+		spin_unlock(&comp->strm_lock);
+
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	if (comp->avail_strm <= comp->max_strm) {
+		list_add(&zstrm->list, &comp->idle_strm);
+		spin_unlock(&comp->strm_lock);
+		wake_up(&comp->strm_wait);
+		return;
+	}
+
+	/* Limit was lowered while this stream was busy */
+	comp->avail_strm--;
+	spin_unlock(&comp->strm_lock);
+	zcomp_strm_free(zstrm);
+}
+
+/* Free idle streams beyond max_strm */
+static void zcomp_trim_streams(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+	LIST_HEAD(victims);
+
+	spin_lock(&comp->strm_lock);
+	/* Busy streams are trimmed by zcomp_strm_release() */
+	while (comp->avail_strm > comp->max_strm &&
+			!list_empty(&comp->idle_strm)) {
+		zstrm = list_first_entry(&comp->idle_strm,
+				struct zcomp_strm, list);
+		list_move(&zstrm->list, &victims);
+		comp->avail_strm--;
+	}
+	spin_unlock(&comp->strm_lock);
+
+	while (!list_empty(&victims)) {
+		zstrm = list_first_entry(&victims, struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(zstrm);
+	}
+}
+
+/*
+ * Change the number of streams to @num_strm, allocating the missing
+ * ones now. Returns -ENOMEM, with the previous limit back in place, if
+ * they cannot all be allocated.
+ */
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm)
+{
+	struct zcomp_strm *zstrm;
+	int old_strm;
+
+	spin_lock(&comp->strm_lock);
+	old_strm = comp->max_strm;
+	comp->max_strm = num_strm;
+	spin_unlock(&comp->strm_lock);
+
+	zcomp_trim_streams(comp);
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (comp->avail_strm >= comp->max_strm) {
+			spin_unlock(&comp->strm_lock);
+			return 0;
+		}
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+
+		zstrm = zcomp_strm_alloc(comp);
+		if (!zstrm)
+			break;
+
+		/* Puts it on the idle list and wakes up a waiter */
+		zcomp_strm_release(comp, zstrm);
+	}
+
+	spin_lock(&comp->strm_lock);
+	comp->avail_strm--;
+	comp->max_strm = old_strm;
+	spin_unlock(&comp->strm_lock);
+
+	zcomp_trim_streams(comp);
+	return -ENOMEM;
+}
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+			const unsigned char *src, size_t *dst_len)
+{
+	int ret;
+	unsigned int len = 2 * PAGE_SIZE;
+
+	ret = crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE,
+				zstrm->buffer, &len);
+	*dst_len = len;
+	return ret;
+}
+
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+			const unsigned char *src, size_t src_len,
+			unsigned char *dst)
+{
+	int ret;
+	unsigned int len = PAGE_SIZE;
+
+	ret = crypto_comp_decompress(zstrm->tfm, src, src_len, dst, &len);
+	if (!ret && len != PAGE_SIZE)
+		ret = -EINVAL;
+	return ret;
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		zstrm = list_first_entry(&comp->idle_strm,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(zstrm);
+	}
+	kfree(comp);
+}
+
+/*
+ * Create a compression backend using crypto API compressor @compress
+ * and allowing up to @max_strm concurrent compressions. All streams
+ * are allocated up front.
+ */
+struct zcomp *zcomp_create(const char *compress, int max_strm)
+{
+	struct zcomp *comp;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	strlcpy(comp->name, compress, sizeof(comp->name));
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+
+	if (zcomp_set_max_streams(comp, max(max_strm, 1))) {
+		zcomp_destroy(comp);
+		return NULL;
+	}
+
+	return comp;
+}
@@ -0,0 +1,59 @@
+/*
+ * zram compression streams
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/crypto.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+/*
+ * A compression stream: the scratch state needed to compress one page.
+ * Streams are handed out to writers one at a time so that concurrent
+ * bios can compress in parallel without sharing buffers.
+ */
+struct zcomp_strm {
+	/* compressed data lands here, 2 pages for worst-case expansion */
+	void *buffer;
+	/* crypto API transform, holds the compressor working memory */
+	struct crypto_comp *tfm;
+	struct list_head list;
+};
+
+struct zcomp {
+	char name[CRYPTO_MAX_ALG_NAME];	/* crypto API algorithm name */
+	spinlock_t strm_lock;		/* protects all fields below */
+	struct list_head idle_strm;	/* streams not in use */
+	wait_queue_head_t strm_wait;	/* users waiting for a stream */
+	int avail_strm;			/* streams allocated (idle + busy) */
+	int max_strm;			/* upper bound on avail_strm */
+};
+
+ssize_t zcomp_available_show(const char *comp, char *buf);
+int zcomp_available_algorithm(const char *comp);
+
+struct zcomp *zcomp_create(const char *comp, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+			const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+			const unsigned char *src, size_t src_len,
+			unsigned char *dst);
+
+#endif
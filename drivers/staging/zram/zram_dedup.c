@@ -0,0 +1,148 @@
+/*
+ * Compressed RAM block device: deduplication of identical pages
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/kernel.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/*
+ * Compressors are deterministic, so identical pages produce identical
+ * compressed data. Hashing the (much shorter) compressed data rather
+ * than the page keeps the extra cost per write small; candidates with
+ * a matching hash are then compared byte for byte.
+ */
+u32 zram_dedup_checksum(const unsigned char *src, size_t len)
+{
+	return jhash(src, len, 0);
+}
+
+/*
+ * Look for an object holding exactly @src. On success a reference is
+ * taken on the returned entry, which the caller must either install in
+ * the table or drop with zram_entry_put().
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram,
+			const unsigned char *src, size_t len, u32 checksum)
+{
+	int match;
+	unsigned char *cmem;
+	struct hlist_node *pos;
+	struct zram_entry *entry;
+	struct hlist_head *head;
+
+	head = &zram->dedup_hash[checksum & zram->dedup_hash_mask];
+
+	spin_lock(&zram->dedup_lock);
+	hlist_for_each_entry(entry, pos, head, node) {
+		if (entry->checksum != checksum || entry->len != len)
+			continue;
+
+		cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+		match = !memcmp(cmem, src, len);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+
+		if (match) {
+			entry->refcount++;
+			spin_unlock(&zram->dedup_lock);
+			return entry;
+		}
+	}
+	spin_unlock(&zram->dedup_lock);
+
+	return NULL;
+}
+
+/*
+ * Wrap a freshly written zsmalloc object and make it visible to
+ * zram_dedup_find(). The entry starts with one reference.
+ */
+struct zram_entry *zram_entry_alloc(struct zram *zram, unsigned long handle,
+			size_t len, u32 checksum)
+{
+	struct zram_entry *entry;
+	struct hlist_head *head;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->handle = handle;
+	entry->checksum = checksum;
+	entry->len = len;
+	entry->refcount = 1;
+
+	head = &zram->dedup_hash[checksum & zram->dedup_hash_mask];
+
+	spin_lock(&zram->dedup_lock);
+	hlist_add_head(&entry->node, head);
+	spin_unlock(&zram->dedup_lock);
+
+	return entry;
+}
+
+/*
+ * Drop a reference, freeing the object along with the last one.
+ * Returns 1 if the object was freed. Does not sleep, so it can be
+ * called with tb_lock held.
+ */
+int zram_entry_put(struct zram *zram, struct zram_entry *entry)
+{
+	spin_lock(&zram->dedup_lock);
+	if (--entry->refcount) {
+		spin_unlock(&zram->dedup_lock);
+		return 0;
+	}
+	hlist_del(&entry->node);
+	spin_unlock(&zram->dedup_lock);
+
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+	return 1;
+}
+
+/*
+ * One bucket for every four pages of disk keeps the average chain
+ * short even on a full device, at a cost of at most half a pointer
+ * per page.
+ */
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	size_t nr_buckets;
+
+	nr_buckets = roundup_pow_of_two(max_t(size_t, num_pages / 4, 1));
+	zram->dedup_hash = vzalloc(nr_buckets * sizeof(*zram->dedup_hash));
+	if (!zram->dedup_hash)
+		return -ENOMEM;
+
+	zram->dedup_hash_mask = nr_buckets - 1;
+	return 0;
+}
+
+/* All entries must have been put by now */
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->dedup_hash);
+	zram->dedup_hash = NULL;
+	zram->dedup_hash_mask = 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Compressed RAM block device: deduplication of identical pages
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/list.h>
+#include <linux/types.h>
+
+struct zram;
+
+/*
+ * A compressed object in the zsmalloc pool. Table entries of pages
+ * with identical compressed data all point to the same zram_entry,
+ * which is freed once the last of them goes away.
+ */
+struct zram_entry {
+	struct hlist_node node;	/* in zram->dedup_hash bucket */
+	unsigned long handle;	/* zsmalloc handle */
+	u32 checksum;		/* hash of the compressed data */
+	u16 len;		/* compressed size in bytes */
+	unsigned int refcount;	/* table entries using this object */
+};
+
+u32 zram_dedup_checksum(const unsigned char *src, size_t len);
+struct zram_entry *zram_dedup_find(struct zram *zram,
+			const unsigned char *src, size_t len, u32 checksum);
+
+struct zram_entry *zram_entry_alloc(struct zram *zram, unsigned long handle,
+			size_t len, u32 checksum);
+int zram_entry_put(struct zram *zram, struct zram_entry *entry);
+
+int zram_dedup_init(struct zram *zram, size_t num_pages);
+void zram_dedup_fini(struct zram *zram);
+
+#endif
@@ -29,9 +29,9 @@
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -89,21 +89,48 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Check whether the page is one word repeated throughout. Zero pages
+ * are the common case, but pattern filled buffers (cleared bitmaps,
+ * poisoned or memset() memory) turn up often enough in swap too.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	val = page[0];
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	/* Most pages differ somewhere: compare the ends first */
+	if (val != page[PAGE_SIZE / sizeof(*page) - 1])
+		return 0;
+
+	for (pos = 1; pos < PAGE_SIZE / sizeof(*page) - 1; pos++) {
+		if (page[pos] != val)
 			return 0;
 	}
 
+	*element = val;
 	return 1;
 }
 
+static void zram_fill_page(void *ptr, unsigned long element)
+{
+	unsigned int pos;
+	unsigned long *page;
+
+	if (likely(!element)) {
+		memset(ptr, 0, PAGE_SIZE);
+		return;
+	}
+
+	page = (unsigned long *)ptr;
+	for (pos = 0; pos < PAGE_SIZE / sizeof(*page); pos++)
+		page[pos] = element;
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,56 +160,340 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+
+/* Pages written back per batch of bios */
+#define ZRAM_WB_BATCH	32
+
+#define ZRAM_BD_MODE	(FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+/* Completion of a group of bios to the backing device */
+struct zram_bd_ctl {
+	atomic_t pending;
+	int error;
+	struct completion done;
+};
+
+static void zram_bd_ctl_init(struct zram_bd_ctl *ctl)
+{
+	/* Biased by one until zram_bd_wait() */
+	atomic_set(&ctl->pending, 1);
+	ctl->error = 0;
+	init_completion(&ctl->done);
+}
+
+static void zram_bd_end_io(struct bio *bio, int err)
+{
+	struct zram_bd_ctl *ctl = bio->bi_private;
+
+	if (err)
+		ctl->error = err;
+	bio_put(bio);
+
+	if (atomic_dec_and_test(&ctl->pending))
+		complete(&ctl->done);
+}
+
+static struct bio *zram_bd_bio_alloc(struct zram *zram,
+			struct zram_bd_ctl *ctl, unsigned long blk, int nr_pages)
+{
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, nr_pages);
+	if (!bio)
+		return NULL;
+
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	bio->bi_end_io = zram_bd_end_io;
+	bio->bi_private = ctl;
+	return bio;
+}
+
+static void zram_bd_submit(struct zram_bd_ctl *ctl, int rw, struct bio *bio)
+{
+	atomic_inc(&ctl->pending);
+	submit_bio(rw, bio);
+}
+
+static int zram_bd_wait(struct zram_bd_ctl *ctl)
+{
+	if (!atomic_dec_and_test(&ctl->pending))
+		wait_for_completion(&ctl->done);
+	return ctl->error;
+}
+
+static int zram_alloc_block(struct zram *zram, unsigned long hint,
+			unsigned long *blk)
+{
+	unsigned long b = hint;
+
+	while (1) {
+		b = find_next_zero_bit(zram->bitmap, zram->nr_blocks, b);
+		if (b >= zram->nr_blocks) {
+			if (!hint)
+				return -ENOSPC;
+			b = hint = 0;
+			continue;
+		}
+		if (!test_and_set_bit(b, zram->bitmap))
+			break;
+	}
+
+	*blk = b;
+	return 0;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long blk)
+{
+	clear_bit(blk, zram->bitmap);
+}
+
+struct zram_bd_read {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk;
+	int ret;
+};
+
+static void zram_bd_read_work(struct work_struct *work)
+{
+	struct zram_bd_read *rd = container_of(work, struct zram_bd_read, work);
+	struct zram_bd_ctl ctl;
+	struct bio *bio;
+
+	zram_bd_ctl_init(&ctl);
+
+	bio = zram_bd_bio_alloc(rd->zram, &ctl, rd->blk, 1);
+	if (!bio) {
+		rd->ret = -ENOMEM;
+		return;
+	}
+	bio_add_page(bio, rd->page, PAGE_SIZE, 0);
+
+	zram_bd_submit(&ctl, READ, bio);
+	rd->ret = zram_bd_wait(&ctl);
+}
+
+/*
+ * Read the written back page in slot @index. We are called from
+ * zram_make_request() where bios we submit are only queued until we
+ * return, so the read is issued and waited for from the device's
+ * workqueue.
+ *
+ * The slot lock is not held across the read, so the block is pinned
+ * with ZRAM_UNDER_READ instead: zram_free_page() leaves such a block
+ * allocated, and we free it here once the read is done. There is at
+ * most one read of a slot in flight, others wait for it to finish.
+ *
+ * Returns -EAGAIN if the slot was freed, or no longer is on the
+ * backing device, in which case the caller should look at it again.
+ */
+static int zram_bd_read(struct zram *zram, struct page *page, u32 index)
+{
+	struct zram_bd_read rd = {
+		.zram = zram,
+		.page = page,
+	};
+	int ret;
+
+	write_lock(&zram->tb_lock);
+	while (zram_test_flag(zram, index, ZRAM_UNDER_READ)) {
+		write_unlock(&zram->tb_lock);
+		wait_event(zram->bd_read_wait,
+			!zram_test_flag(zram, index, ZRAM_UNDER_READ));
+		write_lock(&zram->tb_lock);
+	}
+	if (!zram_test_flag(zram, index, ZRAM_WB)) {
+		write_unlock(&zram->tb_lock);
+		return -EAGAIN;
+	}
+	rd.blk = zram->table[index].handle;
+	zram_set_flag(zram, index, ZRAM_UNDER_READ);
+	write_unlock(&zram->tb_lock);
+
+	INIT_WORK_ONSTACK(&rd.work, zram_bd_read_work);
+	queue_work(zram->bd_wq, &rd.work);
+	flush_work(&rd.work);
+	destroy_work_on_stack(&rd.work);
+	ret = rd.ret;
+
+	write_lock(&zram->tb_lock);
+	/*
+	 * Our block is still allocated, so if the slot was freed and
+	 * written back again meanwhile its handle differs from rd.blk.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_UNDER_READ) &&
+			zram->table[index].handle == rd.blk) {
+		zram_clear_flag(zram, index, ZRAM_UNDER_READ);
+	} else {
+		zram_free_block(zram, rd.blk);
+		ret = -EAGAIN;
+	}
+	write_unlock(&zram->tb_lock);
+	wake_up_all(&zram->bd_read_wait);
+
+	return ret;
+}
+
+void zram_reset_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	destroy_workqueue(zram->bd_wq);
+	blkdev_put(zram->bdev, ZRAM_BD_MODE);
+	vfree(zram->bitmap);
+	kfree(zram->backing_dev);
+
+	zram->bd_wq = NULL;
+	zram->bdev = NULL;
+	zram->bitmap = NULL;
+	zram->nr_blocks = 0;
+	zram->backing_dev = NULL;
+}
+
+/*
+ * Use the block device at @path (typically a loop device over a file)
+ * as backing store for zram_writeback(), replacing any previous one.
+ * Must be called with init_lock held on an uninitialized device.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	char *name;
+	unsigned long *bitmap;
+	unsigned long nr_blocks;
+	struct block_device *bdev;
+	struct workqueue_struct *wq;
+
+	bdev = blkdev_get_by_path(path, ZRAM_BD_MODE, zram);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+
+	ret = -EINVAL;
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (!nr_blocks)
+		goto out_put;
+
+	ret = -ENOMEM;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	if (!bitmap)
+		goto out_put;
+
+	name = kstrdup(path, GFP_KERNEL);
+	if (!name)
+		goto out_bitmap;
+
+	/* Backing device reads are issued from here during swap-in */
+	wq = alloc_workqueue("zram_wb", WQ_MEM_RECLAIM | WQ_UNBOUND, 0);
+	if (!wq)
+		goto out_name;
+
+	zram_reset_backing_dev(zram);
+
+	zram->bdev = bdev;
+	zram->bitmap = bitmap;
+	zram->nr_blocks = nr_blocks;
+	zram->backing_dev = name;
+	zram->bd_wq = wq;
+
+	pr_info("setup backing device %s\n", name);
+	return 0;
+
+out_name:
+	kfree(name);
+out_bitmap:
+	vfree(bitmap);
+out_put:
+	blkdev_put(bdev, ZRAM_BD_MODE);
+	return ret;
+}
+
+#else
+
+static void zram_free_block(struct zram *zram, unsigned long blk)
+{
+}
+
+static int zram_bd_read(struct zram *zram, struct page *page, u32 index)
+{
+	return -EIO;
+}
+
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
+/* Must be called with tb_lock held for writing */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	/* Any pending writeback of the old data is now void */
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		/* A reader still uses the block, it frees it when done */
+		if (zram_test_flag(zram, index, ZRAM_UNDER_READ))
+			zram_clear_flag(zram, index, ZRAM_UNDER_READ);
+		else
+			zram_free_block(zram, handle);
+		zram_stat_dec(&zram->stats.bd_count);
+		zram->table[index].handle = 0;
+		return;
+	}
+
+	/*
+	 * No memory is allocated for same element filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (!handle)
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].handle = 0;
 		return;
 	}
 
+	if (unlikely(!handle))
+		return;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page((struct page *)handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
+		zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram->table[index].size;
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
+	/* Shared objects are only accounted once in compr_size */
+	if (zram_entry_put(zram, (struct zram_entry *)handle))
+		zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+	else
+		zram_stat_dec(&zram->stats.pages_dedup);
+
 out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
-static void handle_zero_page(struct page *page)
+static void handle_same_page(struct page *page, unsigned long element)
 {
 	void *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
+	zram_fill_page(user_mem, element);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -194,8 +505,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic((struct page *)zram->table[index].handle, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -216,24 +526,65 @@ static void zram_read(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
 		struct page *page;
-		struct zobj_header *zheader;
+		struct zram_entry *entry;
+		struct zcomp_strm *zstrm;
 		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
+		zstrm = NULL;
+again:
+		read_lock(&zram->tb_lock);
+
+		/*
+		 * Readers only ever clear this flag and writers hold
+		 * tb_lock exclusively, so a shared lock is enough.
+		 */
+		zram_clear_flag(zram, index, ZRAM_IDLE);
+
+		if (zram_test_flag(zram, index, ZRAM_WB)) {
+			read_unlock(&zram->tb_lock);
+			if (zstrm) {
+				zcomp_strm_release(zram->comp, zstrm);
+				zstrm = NULL;
+			}
+
+			ret = zram_bd_read(zram, page, index);
+			if (ret == -EAGAIN)
+				goto again;
+			if (unlikely(ret)) {
+				pr_err("Backing device read failed! err=%d, "
+					"page=%u\n", ret, index);
+				zram_stat64_inc(zram,
+					&zram->stats.failed_reads);
+				goto out;
+			}
+			zram_stat64_inc(zram, &zram->stats.bd_reads);
+
+			flush_dcache_page(page);
+			index++;
+			continue;
+		}
+
+		if (zram_test_flag(zram, index, ZRAM_SAME)) {
+			unsigned long element = zram->table[index].handle;
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
+			read_unlock(&zram->tb_lock);
+			if (zstrm)
+				zcomp_strm_release(zram->comp, zstrm);
+			handle_same_page(page, element);
 			index++;
 			continue;
 		}
 
 		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
+		if (unlikely(!zram->table[index].handle)) {
+			read_unlock(&zram->tb_lock);
+			if (zstrm)
+				zcomp_strm_release(zram->comp, zstrm);
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
-			handle_zero_page(page);
+			handle_same_page(page, 0);
 			index++;
 			continue;
 		}
@@ -241,26 +592,40 @@ static void zram_read(struct zram *zram, struct bio *bio)
 		/* Page is stored uncompressed since it's incompressible */
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 			handle_uncompressed_page(zram, page, index);
+			read_unlock(&zram->tb_lock);
+			if (zstrm)
+				zcomp_strm_release(zram->comp, zstrm);
 			index++;
 			continue;
 		}
 
+		/*
+		 * Only compressed pages need a stream. Getting one may
+		 * sleep, which we cannot do under tb_lock, so drop it and
+		 * look at the slot again: it may have changed meanwhile.
+		 */
+		if (!zstrm) {
+			read_unlock(&zram->tb_lock);
+			zstrm = zcomp_strm_find(zram->comp);
+			goto again;
+		}
+
+		entry = (struct zram_entry *)zram->table[index].handle;
 		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+		ret = zcomp_decompress(zram->comp, zstrm, cmem,
+			zram->table[index].size, user_mem);
 
+		zs_unmap_object(zram->mem_pool, entry->handle);
 		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+
+		read_unlock(&zram->tb_lock);
+		zcomp_strm_release(zram->comp, zstrm);
 
 		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
+		if (unlikely(ret)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
@@ -279,6 +644,29 @@ out:
 	bio_io_error(bio);
 }
 
+/* Copy compressed data into a new zsmalloc object */
+static struct zram_entry *zram_store_object(struct zram *zram,
+			const unsigned char *src, size_t clen, u32 checksum)
+{
+	unsigned long handle;
+	struct zram_entry *entry;
+	unsigned char *cmem;
+
+	handle = zs_malloc(zram->mem_pool, clen);
+	if (unlikely(!handle))
+		return NULL;
+
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+	memcpy(cmem, src, clen);
+	zs_unmap_object(zram->mem_pool, handle);
+
+	entry = zram_entry_alloc(zram, handle, clen, checksum);
+	if (unlikely(!entry))
+		zs_free(zram->mem_pool, handle);
+
+	return entry;
+}
+
 static void zram_write(struct zram *zram, struct bio *bio)
 {
 	int i;
@@ -290,47 +678,62 @@ static void zram_write(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		u32 offset;
+		u32 checksum;
 		size_t clen;
-		struct zobj_header *zheader;
+		int uncompressed = 0, dedup = 0;
+		unsigned long handle, element;
+		struct zram_entry *entry;
+		struct zcomp_strm *zstrm;
 		struct page *page, *page_store;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
-
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
 
 		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
+		if (page_same_filled(user_mem, &element)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
+
+			write_lock(&zram->tb_lock);
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
+			zram_free_page(zram, index);
+			zram->table[index].handle = element;
+			if (!element)
+				zram_stat_inc(&zram->stats.pages_zero);
+			zram_stat_inc(&zram->stats.pages_same);
+			zram_set_flag(zram, index, ZRAM_SAME);
+			write_unlock(&zram->tb_lock);
 			index++;
 			continue;
 		}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		kunmap_atomic(user_mem, KM_USER0);
+
+		/*
+		 * Compression and allocation are done without holding
+		 * tb_lock, each writer using its own stream, so that
+		 * concurrent bios compress in parallel. The table entry
+		 * is only updated (and any old data freed) at the end.
+		 * The stream may sleep to get, so the page is mapped
+		 * again once we have it.
+		 */
+		zstrm = zcomp_strm_find(zram->comp);
 
+		user_mem = kmap_atomic(page, KM_USER0);
+		ret = zcomp_compress(zram->comp, zstrm, user_mem, &clen);
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zcomp_strm_release(zram->comp, zstrm);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
+		src = zstrm->buffer;
+
 		/*
 		 * Page is incompressible. Store it as-is (uncompressed)
 		 * since we do not want to return too many disk write
@@ -340,7 +743,7 @@ static void zram_write(struct zram *zram, struct bio *bio)
 			clen = PAGE_SIZE;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
+				zcomp_strm_release(zram->comp, zstrm);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
@@ -348,52 +751,61 @@ static void zram_write(struct zram *zram, struct bio *bio)
 				goto out;
 			}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
-			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
-		}
+			handle = (unsigned long)page_store;
+			uncompressed = 1;
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
-			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
-			zram_stat64_inc(zram, &zram->stats.failed_writes);
-			goto out;
+			src = kmap_atomic(page, KM_USER0);
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, src, clen);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(src, KM_USER0);
+		} else {
+			/* Share the object of an identical page if any */
+			checksum = zram_dedup_checksum(src, clen);
+			entry = zram_dedup_find(zram, src, clen, checksum);
+			if (entry)
+				dedup = 1;
+			else
+				entry = zram_store_object(zram, src, clen,
+							checksum);
+			if (unlikely(!entry)) {
+				zcomp_strm_release(zram->comp, zstrm);
+				pr_info("Error allocating memory for "
+					"compressed page: %u, size=%zu\n",
+					index, clen);
+				zram_stat64_inc(zram,
+					&zram->stats.failed_writes);
+				goto out;
+			}
+			handle = (unsigned long)entry;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
+		zcomp_strm_release(zram->comp, zstrm);
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		write_lock(&zram->tb_lock);
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_free_page(zram, index);
 
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
+		zram->table[index].handle = handle;
+		zram->table[index].size = clen;
+		if (unlikely(uncompressed)) {
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram_stat_inc(&zram->stats.pages_expand);
 		}
-#endif
-
-		memcpy(cmem, src, clen);
-
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
 
 		/* Update stats */
-		zram_stat64_add(zram, &zram->stats.compr_size, clen);
+		if (dedup)
+			zram_stat_inc(&zram->stats.pages_dedup);
+		else
+			zram_stat64_add(zram, &zram->stats.compr_size, clen);
 		zram_stat_inc(&zram->stats.pages_stored);
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
+		write_unlock(&zram->tb_lock);
 
-		mutex_unlock(&zram->lock);
 		index++;
 	}
 
@@ -405,6 +817,222 @@ out:
 	bio_io_error(bio);
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+
+/* Mark all pages in memory idle; any access clears the mark again */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		write_lock(&zram->tb_lock);
+		if (zram->table[index].handle &&
+				!zram_test_flag(zram, index, ZRAM_SAME) &&
+				!zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		write_unlock(&zram->tb_lock);
+	}
+}
+
+/* Must be called with tb_lock held */
+static int zram_wb_candidate(struct zram *zram, u32 index, int mode)
+{
+	if (!zram->table[index].handle ||
+			zram_test_flag(zram, index, ZRAM_SAME) ||
+			zram_test_flag(zram, index, ZRAM_WB) ||
+			zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return 0;
+
+	if ((mode & ZRAM_WB_IDLE) && !zram_test_flag(zram, index, ZRAM_IDLE))
+		return 0;
+
+	if ((mode & ZRAM_WB_HUGE) &&
+			!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		return 0;
+
+	return 1;
+}
+
+/* Uncompress page @index into @page. Must be called with tb_lock held */
+static int zram_wb_copy(struct zram *zram, struct zcomp_strm *zstrm,
+			u32 index, struct page *page)
+{
+	int ret = 0;
+	struct zram_entry *entry;
+	unsigned char *user_mem, *cmem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+		cmem = kmap_atomic((struct page *)zram->table[index].handle,
+				KM_USER1);
+		memcpy(user_mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+	} else {
+		entry = (struct zram_entry *)zram->table[index].handle;
+		cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+		ret = zcomp_decompress(zram->comp, zstrm, cmem,
+				zram->table[index].size, user_mem);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+	}
+
+	kunmap_atomic(user_mem, KM_USER0);
+	return ret;
+}
+
+struct zram_wb_batch {
+	struct page *pages[ZRAM_WB_BATCH];
+	u32 index[ZRAM_WB_BATCH];
+	unsigned long blk[ZRAM_WB_BATCH];
+};
+
+/*
+ * Write out the first @nr pages of @batch, merging runs of consecutive
+ * blocks into as few bios as the backing device takes, and wait for
+ * all of them.
+ */
+static int zram_wb_submit(struct zram *zram, struct zram_wb_batch *batch,
+			int nr)
+{
+	int i;
+	struct bio *bio = NULL;
+	struct zram_bd_ctl ctl;
+
+	zram_bd_ctl_init(&ctl);
+
+	for (i = 0; i < nr; i++) {
+		if (bio && batch->blk[i] == batch->blk[i - 1] + 1 &&
+				bio_add_page(bio, batch->pages[i],
+					PAGE_SIZE, 0) == PAGE_SIZE)
+			continue;
+
+		if (bio)
+			zram_bd_submit(&ctl, WRITE, bio);
+
+		bio = zram_bd_bio_alloc(zram, &ctl, batch->blk[i], nr - i);
+		if (!bio) {
+			ctl.error = -ENOMEM;
+			break;
+		}
+		bio_add_page(bio, batch->pages[i], PAGE_SIZE, 0);
+	}
+
+	if (bio)
+		zram_bd_submit(&ctl, WRITE, bio);
+
+	return zram_bd_wait(&ctl);
+}
+
+/*
+ * Free the in-memory copies of pages that made it to the backing
+ * device. Pages rewritten or freed meanwhile lost ZRAM_UNDER_WB, their
+ * block is simply released.
+ */
+static void zram_wb_commit(struct zram *zram, struct zram_wb_batch *batch,
+			int nr, int err)
+{
+	int i;
+	u32 index;
+
+	for (i = 0; i < nr; i++) {
+		index = batch->index[i];
+
+		write_lock(&zram->tb_lock);
+		if (err || !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			write_unlock(&zram->tb_lock);
+			zram_free_block(zram, batch->blk[i]);
+			continue;
+		}
+
+		zram_free_page(zram, index);
+		zram->table[index].handle = batch->blk[i];
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_stat_inc(&zram->stats.bd_count);
+		write_unlock(&zram->tb_lock);
+
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+	}
+}
+
+/*
+ * Move pages selected by @mode (ZRAM_WB_*) to the backing device, in
+ * batches of ZRAM_WB_BATCH. Pages stay readable from memory until
+ * their write completes. Must be called with init_lock held on an
+ * initialized device.
+ */
+int zram_writeback(struct zram *zram, int mode)
+{
+	int i, nr, ret = 0;
+	u32 index, nr_pages;
+	unsigned long blk = 0;
+	struct zcomp_strm *zstrm;
+	struct zram_wb_batch *batch;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		batch->pages[i] = alloc_page(GFP_KERNEL);
+		if (!batch->pages[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages && !ret; ) {
+		nr = 0;
+		zstrm = zcomp_strm_find(zram->comp);
+
+		for (; index < nr_pages && nr < ZRAM_WB_BATCH; index++) {
+			write_lock(&zram->tb_lock);
+			if (!zram_wb_candidate(zram, index, mode) ||
+					zram_wb_copy(zram, zstrm, index,
+						batch->pages[nr])) {
+				write_unlock(&zram->tb_lock);
+				continue;
+			}
+			zram_set_flag(zram, index, ZRAM_UNDER_WB);
+			write_unlock(&zram->tb_lock);
+
+			ret = zram_alloc_block(zram, blk, &blk);
+			if (ret) {
+				write_lock(&zram->tb_lock);
+				zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+				write_unlock(&zram->tb_lock);
+				break;
+			}
+
+			batch->index[nr] = index;
+			batch->blk[nr] = blk++;
+			nr++;
+		}
+
+		zcomp_strm_release(zram->comp, zstrm);
+
+		if (nr)
+			zram_wb_commit(zram, batch, nr,
+				zram_wb_submit(zram, batch, nr));
+		cond_resched();
+	}
+
+out:
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		if (batch->pages[i])
+			__free_page(batch->pages[i]);
+	}
+	kfree(batch);
+
+	return ret;
+}
+
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
 /*
  * Check if request is within bounds and page aligned.
  */
@@ -461,33 +1089,25 @@ void zram_reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
-
-	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
-		if (!page)
-			continue;
-
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
-	}
+	/*
+	 * Free all pages that are still in this zram device. Objects
+	 * may be shared, so go through zram_free_page() to drop them.
+	 */
+	for (index = 0; zram->table &&
+			index < zram->disksize >> PAGE_SHIFT; index++)
+		zram_free_page(zram, index);
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	zram_dedup_fini(zram);
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -511,16 +1131,9 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	if (!zram->comp) {
+		pr_err("Error initializing %s compressor\n", zram->compressor);
 		ret = -ENOMEM;
 		goto fail;
 	}
@@ -537,10 +1150,16 @@ int zram_init_device(struct zram *zram)
 
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
+	ret = zram_dedup_init(zram, num_pages);
+	if (ret) {
+		pr_err("Error allocating dedup hash table\n");
+		goto fail;
+	}
+
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -566,7 +1185,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	write_lock(&zram->tb_lock);
 	zram_free_page(zram, index);
+	write_unlock(&zram->tb_lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -579,9 +1200,16 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	rwlock_init(&zram->tb_lock);
+	spin_lock_init(&zram->dedup_lock);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	init_waitqueue_head(&zram->bd_read_wait);
+#endif
+	zram->max_comp_streams = num_online_cpus();
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -713,6 +1341,9 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+		zram_reset_backing_dev(zram);
+#endif
 	}
 
 	unregister_blkdev(zram_major, "zram");
@@ -18,7 +18,9 @@
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
+#include "zcomp.h"
+#include "zram_dedup.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,33 +28,26 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default compressor, any crypto API compressor can be selected */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
- * uncompressed in memory.
+ * uncompressed in memory. zsmalloc packs objects of any size
+ * without padding them to a page, so this only needs to keep
+ * barely compressible pages from costing decompression time.
  */
-static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
+static const unsigned max_zpage_size = PAGE_SIZE / 8 * 7;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -68,8 +63,20 @@ enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is filled with one repeated word, kept in handle */
+	ZRAM_SAME,
+
+	/* Page was not accessed since it was last marked idle */
+	ZRAM_IDLE,
+
+	/* Page is being written back; cleared if it is freed meanwhile */
+	ZRAM_UNDER_WB,
+
+	/* Page is stored on the backing device, handle is its block */
+	ZRAM_WB,
+
+	/* Backing device block is being read; cleared if it is freed */
+	ZRAM_UNDER_READ,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
@@ -78,8 +85,13 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	/*
+	 * struct zram_entry * of the compressed object, struct page *
+	 * if ZRAM_UNCOMPRESSED, the fill value if ZRAM_SAME or the block
+	 * number on the backing device if ZRAM_WB.
+	 */
+	unsigned long handle;
+	u16 size;	/* compressed object size in bytes */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
 } __attribute__((aligned(4)));
@@ -92,20 +104,28 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written to the backing device */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of same element filled pages */
+	u32 pages_dedup;	/* no. of pages sharing another's object */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 bd_count;		/* no. of pages on the backing device */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zcomp *comp;
 	struct table *table;
+	struct hlist_head *dedup_hash;	/* zram_entry by checksum */
+	unsigned long dedup_hash_mask;
+	spinlock_t dedup_lock;	/* protect dedup_hash and entry refcounts */
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	rwlock_t tb_lock;	/* protect table entries and 32-bit stats
+				 * against concurrent reads, writes and
+				 * slot free notifications */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -116,10 +136,32 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/*
+	 * Upper bound on the number of pages compressed concurrently.
+	 * Defaults to the number of online CPUs.
+	 */
+	int max_comp_streams;
+	char compressor[CRYPTO_MAX_ALG_NAME];
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/*
+	 * Backing device for writeback, and its blocks in use. Set up
+	 * under init_lock while the device is not initialized.
+	 */
+	struct block_device *bdev;
+	char *backing_dev;
+	unsigned long *bitmap;
+	unsigned long nr_blocks;
+	struct workqueue_struct *bd_wq;
+	wait_queue_head_t bd_read_wait;	/* for ZRAM_UNDER_READ slots */
+#endif
 
 	struct zram_stats stats;
 };
 
+/* Pages picked by zram_writeback() */
+#define ZRAM_WB_IDLE	(1 << 0)	/* only idle pages */
+#define ZRAM_WB_HUGE	(1 << 1)	/* only incompressible pages */
+
 extern struct zram *devices;
 extern unsigned int num_devices;
 #ifdef CONFIG_SYSFS
@@ -129,4 +171,11 @@ extern struct attribute_group zram_disk_attr_group;
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_reset_backing_dev(struct zram *zram);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, int mode);
+#endif
+
 #endif
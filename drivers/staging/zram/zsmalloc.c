@@ -0,0 +1,615 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are grouped by size into classes ZS_SIZE_CLASS_DELTA bytes
+ * apart. Each class carves its objects out of zspages: groups of 0-order
+ * pages sized so that the class packs them with the least waste. Objects
+ * are laid out back to back and may straddle a page boundary, in which
+ * case zs_map_object() hands out a per-cpu copy.
+ *
+ * Users only ever see handles, never object addresses, so zs_compact()
+ * can migrate objects out of sparsely used zspages and give whole pages
+ * back to the buddy allocator.
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bit_spinlock.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static int get_size_class_index(int size)
+{
+	int idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return idx;
+}
+
+/*
+ * Pick the number of pages per zspage that wastes the smallest
+ * fraction of memory for objects of the given size.
+ */
+static int get_pages_per_zspage(int class_size)
+{
+	int i, max_usedpc = 0;
+	int max_usedpc_order = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size = i * PAGE_SIZE;
+		int waste = zspage_size % class_size;
+		int usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_order = i;
+		}
+	}
+
+	return max_usedpc_order;
+}
+
+/*
+ * Given an object index, provide a dereferencable pointer to its
+ * header. Headers never straddle pages (see ZS_SIZE_CLASS_DELTA).
+ */
+static unsigned long *obj_header_map(struct zspage *zspage,
+			unsigned int idx, enum km_type type)
+{
+	unsigned long off = (unsigned long)idx * zspage->class->size;
+	unsigned char *base;
+
+	base = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], type);
+	return (unsigned long *)(base + (off & ~PAGE_MASK));
+}
+
+static void obj_header_unmap(unsigned long *header, enum km_type type)
+{
+	kunmap_atomic(header, type);
+}
+
+static unsigned long obj_header_read(struct zspage *zspage, unsigned int idx)
+{
+	unsigned long *header, val;
+
+	header = obj_header_map(zspage, idx, KM_USER0);
+	val = *header;
+	obj_header_unmap(header, KM_USER0);
+
+	return val;
+}
+
+static void obj_header_write(struct zspage *zspage, unsigned int idx,
+			unsigned long val)
+{
+	unsigned long *header;
+
+	header = obj_header_map(zspage, idx, KM_USER0);
+	*header = val;
+	obj_header_unmap(header, KM_USER0);
+}
+
+/* Must be called with class->lock held and a free object available */
+static unsigned int obj_alloc(struct zspage *zspage, struct zs_handle *handle)
+{
+	struct size_class *class = zspage->class;
+	unsigned int idx = zspage->freelist;
+
+	zspage->freelist = obj_header_read(zspage, idx) >> 1;
+	obj_header_write(zspage, idx, (unsigned long)handle |
+				OBJ_ALLOCATED_TAG);
+	zspage->inuse++;
+	class->obj_used++;
+
+	if (zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->full);
+
+	return idx;
+}
+
+/*
+ * Must be called with class->lock held. The zspage is left on its
+ * list even if it became empty; that is for the caller to handle.
+ */
+static void obj_free(struct zspage *zspage, unsigned int idx)
+{
+	struct size_class *class = zspage->class;
+
+	if (zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->partial);
+
+	obj_header_write(zspage, idx, (unsigned long)zspage->freelist << 1);
+	zspage->freelist = idx;
+	zspage->inuse--;
+	class->obj_used--;
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	struct size_class *class = zspage->class;
+	int i;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+
+	class->zspages--;
+	atomic64_sub(class->pages_per_zspage, &pool->pages_allocated);
+}
+
+/*
+ * Allocate a zspage for the given class and thread all of its objects
+ * onto the free list. Called without class->lock held.
+ */
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+			struct size_class *class)
+{
+	struct zspage *zspage;
+	unsigned int idx;
+	int i;
+
+	zspage = kzalloc(sizeof(*zspage), pool->flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class = class;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(pool->flags);
+		if (!zspage->pages[i])
+			goto fail;
+	}
+
+	/* Free list links each object to the next, last one to the end */
+	for (idx = 0; idx < class->objs_per_zspage; idx++)
+		obj_header_write(zspage, idx, (unsigned long)(idx + 1) << 1);
+	zspage->freelist = 0;
+
+	return zspage;
+
+fail:
+	while (i--)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+	return NULL;
+}
+
+/*
+ * Copy len bytes between the linear zspage area at offset off and buf.
+ * Used for objects straddling a page boundary.
+ */
+static void zs_copy_obj(struct zspage *zspage, unsigned long off,
+			void *buf, size_t len, int to_zspage)
+{
+	while (len) {
+		size_t poff = off & ~PAGE_MASK;
+		size_t n = min_t(size_t, len, PAGE_SIZE - poff);
+		unsigned char *base;
+
+		base = kmap_atomic(zspage->pages[off >> PAGE_SHIFT], KM_USER1);
+		if (to_zspage)
+			memcpy(base + poff, buf, n);
+		else
+			memcpy(buf, base + poff, n);
+		kunmap_atomic(base, KM_USER1);
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+/* Copy an object's payload (not its header) between two zspages */
+static void zs_move_obj(struct zspage *dst, unsigned int didx,
+			struct zspage *src, unsigned int sidx)
+{
+	int size = src->class->size;
+	unsigned long soff = (unsigned long)sidx * size + ZS_HANDLE_SIZE;
+	unsigned long doff = (unsigned long)didx * size + ZS_HANDLE_SIZE;
+	size_t len = size - ZS_HANDLE_SIZE;
+
+	while (len) {
+		size_t spoff = soff & ~PAGE_MASK;
+		size_t dpoff = doff & ~PAGE_MASK;
+		size_t n = min_t(size_t, len,
+				PAGE_SIZE - max(spoff, dpoff));
+		unsigned char *sbase, *dbase;
+
+		sbase = kmap_atomic(src->pages[soff >> PAGE_SHIFT], KM_USER0);
+		dbase = kmap_atomic(dst->pages[doff >> PAGE_SHIFT], KM_USER1);
+		memcpy(dbase + dpoff, sbase + spoff, n);
+		kunmap_atomic(dbase, KM_USER1);
+		kunmap_atomic(sbase, KM_USER0);
+
+		soff += n;
+		doff += n;
+		len -= n;
+	}
+}
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ * @flags: allocation flags used to allocate pool pages
+ *
+ * This function must be called before anything when using
+ * the zsmalloc allocator.
+ *
+ * On success, a pointer to the newly created pool is returned,
+ * otherwise NULL.
+ */
+struct zs_pool *zs_create_pool(gfp_t flags)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock_init(&class->lock);
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+					PAGE_SIZE / class->size;
+	}
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	pool->flags = flags;
+	atomic64_set(&pool->pages_allocated, 0);
+	atomic64_set(&pool->pages_compacted, 0);
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, cpu;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		if (class->zspages)
+			pr_info("Freeing non-empty class with size %d\n",
+				class->size);
+	}
+
+	if (pool->map_area) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+		free_percpu(pool->map_area);
+	}
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ *
+ * On success, handle to the allocated object is returned,
+ * otherwise 0. The handle has to be mapped with zs_map_object()
+ * to access the object.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	struct zs_handle *handle;
+	struct size_class *class;
+	struct zspage *zspage;
+	unsigned int idx;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return 0;
+
+	handle = kmalloc(sizeof(*handle), pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+	/* Visible to zs_compact() as soon as the object is allocated */
+	handle->flags = 0;
+
+	class = &pool->size_class[get_size_class_index(size +
+						ZS_HANDLE_SIZE)];
+
+	spin_lock(&class->lock);
+	if (list_empty(&class->partial)) {
+		spin_unlock(&class->lock);
+
+		zspage = alloc_zspage(pool, class);
+		if (unlikely(!zspage)) {
+			kfree(handle);
+			return 0;
+		}
+		atomic64_add(class->pages_per_zspage,
+				&pool->pages_allocated);
+
+		spin_lock(&class->lock);
+		list_add(&zspage->list, &class->partial);
+		class->zspages++;
+	}
+
+	zspage = list_first_entry(&class->partial, struct zspage, list);
+	idx = obj_alloc(zspage, handle);
+	handle->zspage = zspage;
+	handle->idx = idx;
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!obj))
+		return;
+
+	/* Wait for zs_compact() to finish moving this object, if it is */
+	bit_spin_lock(ZS_HANDLE_PIN, &handle->flags);
+	zspage = handle->zspage;
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	obj_free(zspage, handle->idx);
+	if (!zspage->inuse) {
+		list_del(&zspage->list);
+		free_zspage(pool, zspage);
+	}
+	spin_unlock(&class->lock);
+
+	bit_spin_unlock(ZS_HANDLE_PIN, &handle->flags);
+	kfree(handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: how the mapping will be used
+ *
+ * The object is pinned in place and preemption is disabled until
+ * zs_unmap_object() is called, so only one object can be mapped per
+ * cpu at a time and the caller must not sleep in between. Uses the
+ * KM_USER1 atomic kmap slot.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct zs_map_area *area;
+	struct zspage *zspage;
+	unsigned long off;
+	int size;
+
+	BUG_ON(!handle);
+
+	bit_spin_lock(ZS_HANDLE_PIN, &h->flags);
+
+	zspage = h->zspage;
+	size = zspage->class->size;
+	off = (unsigned long)h->idx * size;
+
+	area = this_cpu_ptr(pool->map_area);
+	area->mm = mm;
+
+	if ((off & ~PAGE_MASK) + size <= PAGE_SIZE) {
+		/* this object is contained entirely within a page */
+		area->spanning = 0;
+		area->vaddr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT],
+					KM_USER1);
+		return area->vaddr + (off & ~PAGE_MASK) + ZS_HANDLE_SIZE;
+	}
+
+	/* this object spans two pages */
+	area->spanning = 1;
+	if (mm != ZS_MM_WO)
+		zs_copy_obj(zspage, off + ZS_HANDLE_SIZE, area->buf,
+				size - ZS_HANDLE_SIZE, 0);
+	return area->buf;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_handle *h = (struct zs_handle *)handle;
+	struct zs_map_area *area;
+	struct zspage *zspage;
+	unsigned long off;
+	int size;
+
+	area = this_cpu_ptr(pool->map_area);
+
+	if (!area->spanning) {
+		kunmap_atomic(area->vaddr, KM_USER1);
+	} else if (area->mm != ZS_MM_RO) {
+		zspage = h->zspage;
+		size = zspage->class->size;
+		off = (unsigned long)h->idx * size;
+		zs_copy_obj(zspage, off + ZS_HANDLE_SIZE, area->buf,
+				size - ZS_HANDLE_SIZE, 1);
+	}
+
+	bit_spin_unlock(ZS_HANDLE_PIN, &h->flags);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/*
+ * Move objects from the emptiest to the fullest partial zspages of
+ * a class until no further zspage can be emptied. Objects that are
+ * mapped or being freed at the moment are left where they are.
+ * Returns the number of pages freed.
+ */
+static unsigned long zs_compact_class(struct zs_pool *pool,
+			struct size_class *class)
+{
+	struct zspage *zspage, *src, *dst;
+	unsigned long freed = 0;
+	unsigned long free_objs;
+	unsigned int idx;
+	LIST_HEAD(skipped);
+
+	spin_lock(&class->lock);
+	while (1) {
+		src = dst = NULL;
+		free_objs = 0;
+		list_for_each_entry(zspage, &class->partial, list) {
+			free_objs += class->objs_per_zspage - zspage->inuse;
+			if (!src || zspage->inuse < src->inuse)
+				src = zspage;
+		}
+		list_for_each_entry(zspage, &class->partial, list) {
+			if (zspage != src &&
+					(!dst || zspage->inuse > dst->inuse))
+				dst = zspage;
+		}
+
+		/* Stop unless the other zspages can take all of src */
+		if (!dst || free_objs < class->objs_per_zspage)
+			break;
+
+		for (idx = 0; idx < class->objs_per_zspage &&
+				src->inuse && dst->inuse <
+				class->objs_per_zspage; idx++) {
+			unsigned long header = obj_header_read(src, idx);
+			struct zs_handle *handle;
+			unsigned int didx;
+
+			if (!(header & OBJ_ALLOCATED_TAG))
+				continue;
+
+			handle = (struct zs_handle *)(header &
+						~OBJ_ALLOCATED_TAG);
+			if (!bit_spin_trylock(ZS_HANDLE_PIN, &handle->flags))
+				continue;
+
+			didx = obj_alloc(dst, handle);
+			zs_move_obj(dst, didx, src, idx);
+			obj_free(src, idx);
+			handle->zspage = dst;
+			handle->idx = didx;
+
+			bit_spin_unlock(ZS_HANDLE_PIN, &handle->flags);
+		}
+
+		if (!src->inuse) {
+			list_del(&src->list);
+			free_zspage(pool, src);
+			freed += class->pages_per_zspage;
+		} else if (dst->inuse < class->objs_per_zspage) {
+			/* Some objects of src are pinned, try it later */
+			list_move(&src->list, &skipped);
+		}
+
+		if (need_resched()) {
+			spin_unlock(&class->lock);
+			cond_resched();
+			spin_lock(&class->lock);
+		}
+	}
+	list_splice(&skipped, &class->partial);
+	spin_unlock(&class->lock);
+
+	return freed;
+}
+
+/**
+ * zs_compact - Compact all size classes of a pool.
+ * @pool: pool to compact
+ *
+ * Must be called from process context. Returns the number of
+ * pages released back to the system.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed = 0;
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		freed += zs_compact_class(pool, &pool->size_class[i]);
+		cond_resched();
+	}
+
+	atomic64_add(freed, &pool->pages_compacted);
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+/*
+ * Returns total memory used by allocator (userdata + metadata)
+ */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic64_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+void zs_get_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		stats->obj_allocated += class->zspages *
+					class->objs_per_zspage;
+		stats->obj_used += class->obj_used;
+		stats->bytes_used += class->obj_used * class->size;
+		spin_unlock(&class->lock);
+	}
+
+	stats->pages_allocated = atomic64_read(&pool->pages_allocated);
+	stats->pages_compacted = atomic64_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_get_pool_stats);
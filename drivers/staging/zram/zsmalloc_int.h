@@ -0,0 +1,107 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/*
+ * A zspage is a group of up to this many 0-order (possibly highmem)
+ * pages treated as one contiguous area, so that objects of a size
+ * class can be packed back to back and straddle page boundaries.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * Size classes are separated by ZS_SIZE_CLASS_DELTA bytes. Keeping
+ * this a multiple of sizeof(unsigned long) guarantees that an object
+ * header never straddles a page boundary.
+ */
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+					/ ZS_SIZE_CLASS_DELTA + 1)
+
+/* End of user params */
+
+/*
+ * Every object starts with a header word. For allocated objects it
+ * holds the address of the object's handle with OBJ_ALLOCATED_TAG
+ * set, which lets compaction find and update the handle when moving
+ * the object. For free objects it holds the index of the next free
+ * object, shifted left by one.
+ */
+#define ZS_HANDLE_SIZE		sizeof(unsigned long)
+#define OBJ_ALLOCATED_TAG	1UL
+
+/* Bit in zs_handle->flags held while an object is mapped or moved */
+#define ZS_HANDLE_PIN		0
+
+struct size_class;
+
+struct zspage {
+	struct list_head list;		/* in class partial or full list */
+	struct size_class *class;
+	unsigned int inuse;		/* objects allocated */
+	unsigned int freelist;		/* index of first free object */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+};
+
+/*
+ * What zs_malloc() hands out: an indirection to the object location,
+ * so that objects can be moved without their users noticing.
+ */
+struct zs_handle {
+	unsigned long flags;
+	struct zspage *zspage;
+	unsigned int idx;
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head partial;	/* zspages with free objects */
+	struct list_head full;		/* zspages without free objects */
+	int size;			/* object size including header */
+	int pages_per_zspage;
+	int objs_per_zspage;
+
+	/* stats, protected by lock */
+	u64 zspages;
+	u64 obj_used;
+};
+
+/* Per-cpu state for the object currently mapped on this cpu */
+struct zs_map_area {
+	char *buf;		/* copy of an object spanning pages */
+	void *vaddr;		/* kmap address when not spanning */
+	int spanning;
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+	struct zs_map_area __percpu *map_area;
+	gfp_t flags;	/* allocation flags used for backing pages */
+
+	atomic64_t pages_allocated;
+	atomic64_t pages_compacted;
+};
+
+#endif
@@ -961,6 +961,8 @@ static int de_thread(struct task_struct *tsk)
 
 		tsk->group_leader = tsk;
 		leader->group_leader = tsk;
+		lowmem_index_del(leader);
+		lowmem_index_add(tsk);
 
 		tsk->exit_signal = SIGCHLD;
 
@@ -1094,7 +1096,18 @@ int flush_old_exec(struct linux_binprm * bprm)
 	bprm->mm = NULL;		/* We're using it now */
 
 	set_fs(USER_DS);
-	current->flags &= ~(PF_RANDOMIZE | PF_KTHREAD);
+	if (unlikely(current->flags & PF_KTHREAD)) {
+		current->flags &= ~PF_KTHREAD;
+		/*
+		 * A kernel thread turning into a user process (usermode
+		 * helpers, init) was not indexed at fork. de_thread() made
+		 * us the group leader.
+		 */
+		write_lock_irq(&tasklist_lock);
+		lowmem_index_add(current);
+		write_unlock_irq(&tasklist_lock);
+	}
+	current->flags &= ~PF_RANDOMIZE;
 	flush_thread();
 	current->personality &= ~bprm->per_clear;
 
@@ -686,6 +686,221 @@ static u16 yaffs_calc_name_sum(const YCHAR * name)
 	return sum;
 }
 
+/*---------------- Directory index ------------------
+ * A directory that takes more than YAFFS_DIR_INDEX_THRESHOLD checks to
+ * search gets a hash table of its children, keyed by a hash of the whole
+ * name rather than by the name sum, which is too weak to tell apart names
+ * that only differ in a few digits. Children whose name is not known
+ * without reading NAND (lazy loaded, lost-n-found or header-less objects)
+ * are kept on a separate list that every lookup searches, and move into
+ * the table when their name gets set.
+ */
+
+#ifdef CONFIG_YAFFS_DIR_INDEX
+
+#define YAFFS_DIR_INDEX_THRESHOLD	64
+#define YAFFS_DIR_INDEX_MIN_BITS	4
+#define YAFFS_DIR_INDEX_MAX_BITS	10
+#define YAFFS_DIR_INDEX_LOAD		4	/* entries per bucket before growing */
+
+static u32 yaffs_calc_name_hash(const YCHAR * name)
+{
+	u32 hash = 0;
+	int i;
+
+	for (i = 0; name && name[i] && i < YAFFS_MAX_NAME_LENGTH; i++)
+		hash = (hash + ((YUCHAR)name[i] << 4) +
+			((YUCHAR)name[i] >> 4)) * 11;
+	return hash;
+}
+
+static struct list_head *yaffs_dir_index_bucket(struct yaffs_dir_index *index,
+						u32 hash)
+{
+	/* multiplicative hashing, the top bits are the well mixed ones */
+	return &index->buckets[(u32)(hash * 0x9e370001U) >>
+			       (32 - index->bits)];
+}
+
+static int yaffs_dir_index_name_known(struct yaffs_obj *obj)
+{
+	if (obj->obj_id == YAFFS_OBJECTID_LOSTNFOUND || obj->lazy_loaded)
+		return 0;
+#ifndef CONFIG_YAFFS_NO_SHORT_NAMES
+	if (obj->short_name[0])
+		return 1;
+#endif
+	return obj->hdr_chunk > 0;
+}
+
+static struct list_head *yaffs_dir_index_alloc_buckets(int bits)
+{
+	struct list_head *buckets;
+	int i;
+
+	buckets = kmalloc(sizeof(struct list_head) << bits, GFP_NOFS);
+	if (buckets)
+		for (i = 0; i < (1 << bits); i++)
+			INIT_LIST_HEAD(&buckets[i]);
+	return buckets;
+}
+
+/* Doubles the table. Failing to is harmless, the buckets just get longer */
+static void yaffs_dir_index_grow(struct yaffs_dir_index *index)
+{
+	struct list_head *old_buckets = index->buckets;
+	struct list_head *buckets;
+	struct yaffs_obj *obj;
+	int old_bits = index->bits;
+	int i;
+
+	buckets = yaffs_dir_index_alloc_buckets(old_bits + 1);
+	if (!buckets)
+		return;
+
+	index->buckets = buckets;
+	index->bits = old_bits + 1;
+	for (i = 0; i < (1 << old_bits); i++) {
+		while (!list_empty(&old_buckets[i])) {
+			obj = list_entry(old_buckets[i].next,
+					 struct yaffs_obj, dir_hash_link);
+			list_move(&obj->dir_hash_link,
+				  yaffs_dir_index_bucket(index,
+							 obj->name_hash));
+		}
+	}
+	kfree(old_buckets);
+}
+
+static void yaffs_dir_index_insert(struct yaffs_dir_index *index,
+				   struct yaffs_obj *obj)
+{
+	if (yaffs_dir_index_name_known(obj))
+		list_add(&obj->dir_hash_link,
+			 yaffs_dir_index_bucket(index, obj->name_hash));
+	else
+		list_add(&obj->dir_hash_link, &index->unhashed);
+
+	index->n_entries++;
+	if (index->n_entries > (YAFFS_DIR_INDEX_LOAD << index->bits) &&
+	    index->bits < YAFFS_DIR_INDEX_MAX_BITS)
+		yaffs_dir_index_grow(index);
+}
+
+static void yaffs_dir_index_add(struct yaffs_obj *dir, struct yaffs_obj *obj)
+{
+	if (dir->variant.dir_variant.index)
+		yaffs_dir_index_insert(dir->variant.dir_variant.index, obj);
+}
+
+static void yaffs_dir_index_del(struct yaffs_obj *dir, struct yaffs_obj *obj)
+{
+	if (!list_empty(&obj->dir_hash_link)) {
+		list_del_init(&obj->dir_hash_link);
+		dir->variant.dir_variant.index->n_entries--;
+	}
+}
+
+/* Called when the name of obj, or whether it is known, may have changed */
+static void yaffs_dir_index_rehash(struct yaffs_obj *obj)
+{
+	struct yaffs_obj *dir = obj->parent;
+
+	if (!dir || dir->variant_type != YAFFS_OBJECT_TYPE_DIRECTORY ||
+	    !dir->variant.dir_variant.index)
+		return;
+
+	yaffs_dir_index_del(dir, obj);
+	yaffs_dir_index_add(dir, obj);
+}
+
+static void yaffs_dir_index_build(struct yaffs_obj *dir)
+{
+	struct yaffs_dir_index *index;
+	struct list_head *i;
+	int n = 0;
+	int bits = YAFFS_DIR_INDEX_MIN_BITS;
+
+	list_for_each(i, &dir->variant.dir_variant.children)
+		n++;
+	while (n > (YAFFS_DIR_INDEX_LOAD << bits) &&
+	       bits < YAFFS_DIR_INDEX_MAX_BITS)
+		bits++;
+
+	index = kmalloc(sizeof(struct yaffs_dir_index), GFP_NOFS);
+	if (!index)
+		return;
+	index->buckets = yaffs_dir_index_alloc_buckets(bits);
+	if (!index->buckets) {
+		kfree(index);
+		return;
+	}
+	index->bits = bits;
+	index->n_entries = 0;
+	INIT_LIST_HEAD(&index->unhashed);
+
+	list_for_each(i, &dir->variant.dir_variant.children)
+		yaffs_dir_index_insert(index,
+			list_entry(i, struct yaffs_obj, siblings));
+
+	dir->variant.dir_variant.index = index;
+	yaffs_trace(YAFFS_TRACE_OS,
+		"Built name index for directory %d, %d entries in %d buckets",
+		dir->obj_id, n, 1 << index->bits);
+}
+
+static void yaffs_dir_index_free(struct yaffs_obj *dir)
+{
+	struct yaffs_dir_index *index = dir->variant.dir_variant.index;
+
+	if (index) {
+		kfree(index->buckets);
+		kfree(index);
+		dir->variant.dir_variant.index = NULL;
+	}
+}
+
+static void yaffs_dir_index_free_all(struct yaffs_dev *dev)
+{
+	struct yaffs_obj *obj;
+	struct list_head *i;
+	int bucket;
+
+	for (bucket = 0; bucket < YAFFS_NOBJECT_BUCKETS; bucket++) {
+		list_for_each(i, &dev->obj_bucket[bucket].list) {
+			obj = list_entry(i, struct yaffs_obj, hash_link);
+			if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY)
+				yaffs_dir_index_free(obj);
+		}
+	}
+}
+
+#else
+
+static inline void yaffs_dir_index_add(struct yaffs_obj *dir,
+				       struct yaffs_obj *obj)
+{
+}
+
+static inline void yaffs_dir_index_del(struct yaffs_obj *dir,
+				       struct yaffs_obj *obj)
+{
+}
+
+static inline void yaffs_dir_index_rehash(struct yaffs_obj *obj)
+{
+}
+
+static inline void yaffs_dir_index_free(struct yaffs_obj *dir)
+{
+}
+
+static inline void yaffs_dir_index_free_all(struct yaffs_dev *dev)
+{
+}
+
+#endif
+
 void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 {
 #ifndef CONFIG_YAFFS_NO_SHORT_NAMES
@@ -698,6 +913,10 @@ void yaffs_set_obj_name(struct yaffs_obj *obj, const YCHAR * name)
 		obj->short_name[0] = _Y('\0');
 #endif
 	obj->sum = yaffs_calc_name_sum(name);
+#ifdef CONFIG_YAFFS_DIR_INDEX
+	obj->name_hash = yaffs_calc_name_hash(name);
+#endif
+	yaffs_dir_index_rehash(obj);
 }
 
 void yaffs_set_obj_name_from_oh(struct yaffs_obj *obj,
@@ -744,6 +963,7 @@ static void yaffs_free_tnode(struct yaffs_dev *dev, struct yaffs_tnode *tn)
 
 static void yaffs_deinit_tnodes_and_objs(struct yaffs_dev *dev)
 {
+	yaffs_dir_index_free_all(dev);
 	yaffs_deinit_raw_tnodes_and_objs(dev);
 	dev->n_obj = 0;
 	dev->n_tnodes = 0;
@@ -1281,6 +1501,8 @@ static void yaffs_remove_obj_from_dir(struct yaffs_obj *obj)
 	if (dev && dev->param.remove_obj_fn)
 		dev->param.remove_obj_fn(obj);
 
+	if (parent)
+		yaffs_dir_index_del(parent, obj);
 	list_del_init(&obj->siblings);
 	obj->parent = NULL;
 
@@ -1315,6 +1537,7 @@ void yaffs_add_obj_to_dir(struct yaffs_obj *directory, struct yaffs_obj *obj)
 	/* Now add it */
 	list_add(&obj->siblings, &directory->variant.dir_variant.children);
 	obj->parent = directory;
+	yaffs_dir_index_add(directory, obj);
 
 	if (directory == obj->my_dev->unlinked_dir
 	    || directory == obj->my_dev->del_dir) {
@@ -1394,19 +1617,63 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache 
  *   provides write buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Entries in use are hashed on (object, chunk_id) and kept on an LRU list,
+ *   so looking one up or replacing one does not depend on how many there are.
  */
 
+static struct list_head *yaffs_cache_bucket(struct yaffs_dev *dev,
+					    const struct yaffs_obj *obj,
+					    int chunk_id)
+{
+	u32 key = (u32)obj->obj_id * 31 + chunk_id;
+
+	/* multiplicative hashing, the top bits are the well mixed ones */
+	return &dev->cache_hash[(u32)(key * 0x9e370001U) >>
+				(32 - dev->cache_hash_bits)];
+}
+
+static void yaffs_cache_set_dirty(struct yaffs_dev *dev,
+				  struct yaffs_cache *cache, int dirty)
+{
+	if (cache->dirty != dirty)
+		dev->n_dirty_caches += dirty ? 1 : -1;
+	cache->dirty = dirty;
+}
+
+/* Hands a free entry to a chunk, as the most recently used entry */
+static void yaffs_cache_attach(struct yaffs_cache *cache,
+			       struct yaffs_obj *obj, int chunk_id)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->n_bytes = 0;
+	list_add(&cache->hash_link, yaffs_cache_bucket(dev, obj, chunk_id));
+	list_move_tail(&cache->lru, &dev->cache_lru);
+}
+
+/* Puts an entry back on the free list, dropping any dirty data */
+static void yaffs_cache_detach(struct yaffs_dev *dev,
+			       struct yaffs_cache *cache)
+{
+	yaffs_cache_set_dirty(dev, cache, 0);
+	cache->object = NULL;
+	list_del_init(&cache->hash_link);
+	list_move(&cache->lru, &dev->cache_free);
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
 	struct yaffs_cache *cache;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	for (i = 0; i < n_caches; i++) {
-		cache = &dev->cache[i];
+	if (!dev->n_dirty_caches)
+		return 0;
+
+	list_for_each_entry(cache, &dev->cache_lru, lru) {
 		if (cache->object == obj && cache->dirty)
 			return 1;
 	}
@@ -1414,53 +1681,55 @@ static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 	return 0;
 }
 
+static int yaffs_cache_cmp(void *priv, struct list_head *a,
+			   struct list_head *b)
+{
+	return list_entry(a, struct yaffs_cache, lru)->chunk_id -
+	    list_entry(b, struct yaffs_cache, lru)->chunk_id;
+}
+
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
 	struct yaffs_cache *cache;
-	int chunk_written = 0;
-	int n_caches = obj->my_dev->param.n_caches;
-
-	if (n_caches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < n_caches; i++) {
-				if (dev->cache[i].object == obj &&
-				    dev->cache[i].dirty) {
-					if (!cache
-					    || dev->cache[i].chunk_id <
-					    lowest) {
-						cache = &dev->cache[i];
-						lowest = cache->chunk_id;
-					}
-				}
-			}
+	struct yaffs_cache *next;
+	int chunk_written;
+	LIST_HEAD(flush);
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+	if (!dev->n_dirty_caches)
+		return;
 
-				chunk_written =
-				    yaffs_wr_data_obj(cache->object,
-						      cache->chunk_id,
-						      cache->data,
-						      cache->n_bytes, 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+	/* Take this object's dirty chunks off the LRU and write them out
+	 * lowest chunk id first.
+	 */
+	list_for_each_entry_safe(cache, next, &dev->cache_lru, lru) {
+		if (cache->object == obj && cache->dirty && !cache->locked)
+			list_move_tail(&cache->lru, &flush);
+	}
+	list_sort(NULL, &flush, yaffs_cache_cmp);
 
-		} while (cache && chunk_written > 0);
+	while (!list_empty(&flush)) {
+		cache = list_first_entry(&flush, struct yaffs_cache, lru);
 
-		if (cache)
-			/* Hoosterman, disk full while writing cache out. */
-			yaffs_trace(YAFFS_TRACE_ERROR,
-				"yaffs tragedy: no space during cache write");
+		/* Write it out and free it up */
+		chunk_written = yaffs_wr_data_obj(cache->object,
+						  cache->chunk_id,
+						  cache->data,
+						  cache->n_bytes, 1);
+		yaffs_cache_detach(dev, cache);
+		dev->cache_flushes++;
 
+		if (chunk_written <= 0)
+			break;
 	}
 
+	if (!list_empty(&flush)) {
+		/* Hoosterman, disk full while writing cache out. */
+		yaffs_trace(YAFFS_TRACE_ERROR,
+			"yaffs tragedy: no space during cache write");
+		/* The rest stay dirty, as the least recently used */
+		list_splice(&flush, &dev->cache_lru);
+	}
 }
 
 /*yaffs_flush_whole_cache(dev)
@@ -1470,19 +1739,19 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
+	struct yaffs_cache *cache;
 	struct yaffs_obj *obj;
-	int n_caches = dev->param.n_caches;
-	int i;
 
 	/* Find a dirty object in the cache and flush it...
 	 * until there are no further dirty objects.
 	 */
 	do {
 		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
-				obj = dev->cache[i].object;
-
+		list_for_each_entry(cache, &dev->cache_lru, lru) {
+			if (cache->dirty && !cache->locked) {
+				obj = cache->object;
+				break;
+			}
 		}
 		if (obj)
 			yaffs_flush_file_cache(obj);
@@ -1493,92 +1762,71 @@ void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 
 /* Grab us a cache chunk for use.
  * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+ * Else take the least recently used unlocked one, flushing its object first
+ * if it is dirty.
+ * The entry is left on the free list for yaffs_cache_attach().
  */
-static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
+static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
-	int i;
+	struct yaffs_cache *cache;
+	struct yaffs_cache *victim = NULL;
 
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
+	if (dev->param.n_caches <= 0)
+		return NULL;
+
+	if (list_empty(&dev->cache_free)) {
+		list_for_each_entry(cache, &dev->cache_lru, lru) {
+			if (!cache->locked) {
+				victim = cache;
+				break;
+			}
 		}
+
+		if (victim && victim->dirty)
+			yaffs_flush_file_cache(victim->object);
+		else if (victim)
+			yaffs_cache_detach(dev, victim);
 	}
 
-	return NULL;
+	if (list_empty(&dev->cache_free))
+		return NULL;
+
+	return list_first_entry(&dev->cache_free, struct yaffs_cache, lru);
 }
 
-static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
+static struct yaffs_cache *yaffs_lookup_chunk_cache(const struct yaffs_obj
+						    *obj, int chunk_id)
 {
+	struct yaffs_dev *dev = obj->my_dev;
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
 
 	if (dev->param.n_caches > 0) {
-		/* Try find a non-dirty one... */
-
-		cache = yaffs_grab_chunk_worker(dev);
-
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
-
-			/* With locking we can't assume we can use entry zero */
-
-			the_obj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->param.n_caches; i++) {
-				if (dev->cache[i].object &&
-				    !dev->cache[i].locked &&
-				    (dev->cache[i].last_use < usage
-				     || !cache)) {
-					usage = dev->cache[i].last_use;
-					the_obj = dev->cache[i].object;
-					cache = &dev->cache[i];
-					pushout = i;
-				}
-			}
-
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_flush_file_cache(the_obj);
-				cache = yaffs_grab_chunk_worker(dev);
-			}
-
+		list_for_each_entry(cache,
+				    yaffs_cache_bucket(dev, obj, chunk_id),
+				    hash_link) {
+			if (cache->object == obj && cache->chunk_id == chunk_id)
+				return cache;
 		}
-		return cache;
-	} else {
-		return NULL;
-        }
+	}
+	return NULL;
 }
 
-/* Find a cached chunk */
+/* Find a cached chunk, for a read or write */
 static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].chunk_id == chunk_id) {
-				dev->cache_hits++;
+	struct yaffs_cache *cache;
 
-				return &dev->cache[i];
-			}
-		}
-	}
-	return NULL;
+	if (dev->param.n_caches <= 0)
+		return NULL;
+
+	cache = yaffs_lookup_chunk_cache(obj, chunk_id);
+	if (cache)
+		dev->cache_hits++;
+	else
+		dev->cache_misses++;
+	return cache;
 }
 
 /* Mark the chunk for the least recently used algorithym */
@@ -1587,21 +1835,10 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 {
 
 	if (dev->param.n_caches > 0) {
-		if (dev->cache_last_use < 0 || dev->cache_last_use > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.n_caches; i++)
-				dev->cache[i].last_use = 0;
-
-			dev->cache_last_use = 0;
-		}
-
-		dev->cache_last_use++;
-
-		cache->last_use = dev->cache_last_use;
+		list_move_tail(&cache->lru, &dev->cache_lru);
 
 		if (is_write)
-			cache->dirty = 1;
+			yaffs_cache_set_dirty(dev, cache, 1);
 	}
 }
 
@@ -1613,10 +1850,10 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 {
 	if (object->my_dev->param.n_caches > 0) {
 		struct yaffs_cache *cache =
-		    yaffs_find_chunk_cache(object, chunk_id);
+		    yaffs_lookup_chunk_cache(object, chunk_id);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_cache_detach(object->my_dev, cache);
 	}
 }
 
@@ -1625,14 +1862,15 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
  */
 static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 {
-	int i;
 	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache *cache;
+	struct yaffs_cache *next;
 
 	if (dev->param.n_caches > 0) {
 		/* Invalidate it. */
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
+		list_for_each_entry_safe(cache, next, &dev->cache_lru, lru) {
+			if (cache->object == in)
+				yaffs_cache_detach(dev, cache);
 		}
 	}
 }
@@ -1665,6 +1903,9 @@ static void yaffs_free_obj(struct yaffs_obj *obj)
 	if (!list_empty(&obj->siblings))
 		YBUG();
 
+	if (obj->variant_type == YAFFS_OBJECT_TYPE_DIRECTORY)
+		yaffs_dir_index_free(obj);
+
 	if (obj->my_inode) {
 		/* We're still hooked up to a cached inode.
 		 * Don't delete now, but mark for later deletion
@@ -1857,12 +2098,16 @@ static struct yaffs_obj *yaffs_alloc_empty_obj(struct yaffs_dev *dev)
 		INIT_LIST_HEAD(&(obj->hard_links));
 		INIT_LIST_HEAD(&(obj->hash_link));
 		INIT_LIST_HEAD(&obj->siblings);
+#ifdef CONFIG_YAFFS_DIR_INDEX
+		INIT_LIST_HEAD(&obj->dir_hash_link);
+#endif
 
 		/* Now make the directory sane */
 		if (dev->root_dir) {
 			obj->parent = dev->root_dir;
 			list_add(&(obj->siblings),
 				 &dev->root_dir->variant.dir_variant.children);
+			yaffs_dir_index_add(dev->root_dir, obj);
 		}
 
 		/* Add it to the lost and found directory.
@@ -2715,6 +2960,32 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 	return ret_val;
 }
 
+static int yaffs_gc_cost_benefit(struct yaffs_dev *dev)
+{
+	return dev->param.is_yaffs2 && dev->param.gc_control &&
+	    (dev->param.gc_control(dev) & YAFFS_GC_CONTROL_COST_BENEFIT);
+}
+
+/*
+ * Cost-benefit score, as in log-structured file systems: the space a block
+ * gives back, weighted by how long its data has gone unchanged, over the
+ * cost of reading it and rewriting its live chunks. Age is counted in
+ * blocks allocated since it was written. Old, mostly stale blocks are
+ * collected before recent ones whose live chunks are likely to be
+ * overwritten soon anyway.
+ */
+static u32 yaffs_gc_score(struct yaffs_dev *dev, struct yaffs_block_info *bi,
+			  int pages_used)
+{
+	u64 score;
+	u32 age = dev->seq_number - bi->seq_number + 1;
+
+	score = (u64)(dev->param.chunks_per_block - pages_used) * age;
+	do_div(score, dev->param.chunks_per_block + pages_used);
+
+	return (u32)score;
+}
+
 /*
  * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
  * for garbage collection.
@@ -2771,6 +3042,12 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 	if (!selected) {
 		int pages_used;
+		/*
+		 * Aggressive gc is short of space now, so it wants the block
+		 * giving back the most chunks, however young.
+		 */
+		int cost_benefit = !aggressive && yaffs_gc_cost_benefit(dev);
+		u32 score;
 		int n_blocks =
 		    dev->internal_end_block - dev->internal_start_block + 1;
 		if (aggressive) {
@@ -2812,11 +3089,25 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 
 			pages_used = bi->pages_in_use - bi->soft_del_pages;
 
-			if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
-			    pages_used < dev->param.chunks_per_block &&
-			    (dev->gc_dirtiest < 1
-			     || pages_used < dev->gc_pages_in_use)
-			    && yaffs_block_ok_for_gc(dev, bi)) {
+			if (bi->block_state != YAFFS_BLOCK_STATE_FULL ||
+			    pages_used >= dev->param.chunks_per_block)
+				continue;
+
+			if (cost_benefit) {
+				/* Best score among blocks dirty enough */
+				if (pages_used > threshold)
+					continue;
+				score = yaffs_gc_score(dev, bi, pages_used);
+				if ((dev->gc_dirtiest < 1 ||
+				     score > dev->gc_dirtiest_score) &&
+				    yaffs_block_ok_for_gc(dev, bi)) {
+					dev->gc_dirtiest = dev->gc_block_finder;
+					dev->gc_pages_in_use = pages_used;
+					dev->gc_dirtiest_score = score;
+				}
+			} else if ((dev->gc_dirtiest < 1
+				    || pages_used < dev->gc_pages_in_use)
+				   && yaffs_block_ok_for_gc(dev, bi)) {
 				dev->gc_dirtiest = dev->gc_block_finder;
 				dev->gc_pages_in_use = pages_used;
 			}
@@ -2874,6 +3165,18 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 	return selected;
 }
 
+static void yaffs_gc_account(struct yaffs_dev *dev, ktime_t start,
+			     int background)
+{
+	u32 us = (u32)ktime_us_delta(ktime_get(), start);
+
+	dev->gc_pass_us_total += us;
+	if (us > dev->gc_pass_us_max)
+		dev->gc_pass_us_max = us;
+	if (!background && us > dev->fg_gc_pass_us_max)
+		dev->fg_gc_pass_us_max = us;
+}
+
 /* New garbage collector
  * If we're very low on erased blocks then we do aggressive garbage collection
  * otherwise we do "leasurely" garbage collection.
@@ -2891,8 +3194,10 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	int min_erased;
 	int erased_chunks;
 	int checkpt_block_adjust;
+	ktime_t start;
 
-	if (dev->param.gc_control && (dev->param.gc_control(dev) & 1) == 0)
+	if (dev->param.gc_control &&
+	    (dev->param.gc_control(dev) & YAFFS_GC_CONTROL_ENABLE) == 0)
 		return YAFFS_OK;
 
 	if (dev->gc_disable) {
@@ -2958,7 +3263,9 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 				"yaffs: GC n_erased_blocks %d aggressive %d",
 				dev->n_erased_blocks, aggressive);
 
+			start = ktime_get();
 			gc_ok = yaffs_gc_block(dev, dev->gc_block, aggressive);
+			yaffs_gc_account(dev, start, background);
 		}
 
 		if (dev->n_erased_blocks < (dev->param.n_reserved_blocks)
@@ -3499,6 +3806,10 @@ int yaffs_update_oh(struct yaffs_obj *in, const YCHAR * name, int force,
 
 			in->hdr_chunk = new_chunk_id;
 
+			/* Objects without a header are not in the index yet */
+			if (prev_chunk_id <= 0)
+				yaffs_dir_index_rehash(in);
+
 			if (prev_chunk_id > 0) {
 				yaffs_chunk_del(dev, prev_chunk_id, 1,
 						__LINE__);
@@ -3581,13 +3892,9 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 				if (!cache) {
 					cache =
 					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_cache_attach(cache, in, chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
-					cache->n_bytes = 0;
 				}
 
 				yaffs_use_cache(dev, cache, 0);
@@ -3707,10 +4014,7 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 				if (!cache
 				    && yaffs_check_alloc_available(dev, 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_cache_attach(cache, in, chunk);
 					yaffs_rd_data_obj(in, chunk,
 							  cache->data);
 				} else if (cache &&
@@ -3740,7 +4044,8 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 						     cache->chunk_id,
 						     cache->data,
 						     cache->n_bytes, 1);
-						cache->dirty = 0;
+						yaffs_cache_set_dirty(dev,
+								      cache, 0);
 					}
 
 				} else {
@@ -4466,15 +4771,58 @@ static void yaffs_empty_l_n_f(struct yaffs_dev *dev)
 }
 
 
+static int yaffs_obj_name_matches(struct yaffs_obj *obj, const YCHAR * name)
+{
+	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
+
+	/* Special case for lost-n-found */
+	if (obj->obj_id == YAFFS_OBJECTID_LOSTNFOUND)
+		return !strcmp(name, YAFFS_LOSTNFOUND_NAME);
+
+	yaffs_get_obj_name(obj, buffer, YAFFS_MAX_NAME_LENGTH + 1);
+	return strncmp(name, buffer, YAFFS_MAX_NAME_LENGTH) == 0;
+}
+
+#ifdef CONFIG_YAFFS_DIR_INDEX
+static struct yaffs_obj *yaffs_dir_index_find(struct yaffs_obj *directory,
+					      const YCHAR * name)
+{
+	struct yaffs_dir_index *index = directory->variant.dir_variant.index;
+	struct yaffs_dev *dev = directory->my_dev;
+	struct list_head *i;
+	struct list_head *n;
+	struct yaffs_obj *l;
+	u32 hash = yaffs_calc_name_hash(name);
+
+	/* Loading a name moves the entry off this list, hence _safe */
+	list_for_each_safe(i, n, &index->unhashed) {
+		l = list_entry(i, struct yaffs_obj, dir_hash_link);
+		dev->n_name_lookup_checks++;
+		if (yaffs_obj_name_matches(l, name))
+			return l;
+	}
+
+	list_for_each(i, yaffs_dir_index_bucket(index, hash)) {
+		l = list_entry(i, struct yaffs_obj, dir_hash_link);
+		dev->n_name_lookup_checks++;
+		if (l->name_hash == hash && yaffs_obj_name_matches(l, name))
+			return l;
+	}
+
+	return NULL;
+}
+#endif
+
 struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 				     const YCHAR * name)
 {
 	int sum;
+	int n_checked = 0;
 
 	struct list_head *i;
-	YCHAR buffer[YAFFS_MAX_NAME_LENGTH + 1];
 
 	struct yaffs_obj *l;
+	struct yaffs_obj *found = NULL;
 
 	if (!name)
 		return NULL;
@@ -4493,6 +4841,13 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 		YBUG();
 	}
 
+	directory->my_dev->n_name_lookups++;
+
+#ifdef CONFIG_YAFFS_DIR_INDEX
+	if (directory->variant.dir_variant.index)
+		return yaffs_dir_index_find(directory, name);
+#endif
+
 	sum = yaffs_calc_name_sum(name);
 
 	list_for_each(i, &directory->variant.dir_variant.children) {
@@ -4502,27 +4857,134 @@ struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *directory,
 			if (l->parent != directory)
 				YBUG();
 
+			n_checked++;
 			yaffs_check_obj_details_loaded(l);
 
-			/* Special case for lost-n-found */
-			if (l->obj_id == YAFFS_OBJECTID_LOSTNFOUND) {
-				if (!strcmp(name, YAFFS_LOSTNFOUND_NAME))
-					return l;
-			} else if (l->sum == sum
-				   || l->hdr_chunk <= 0) {
-				/* LostnFound chunk called Objxxx
-				 * Do a real check
-				 */
-				yaffs_get_obj_name(l, buffer,
-						   YAFFS_MAX_NAME_LENGTH + 1);
-				if (strncmp
-				    (name, buffer, YAFFS_MAX_NAME_LENGTH) == 0)
-					return l;
+			/* LostnFound chunk called Objxxx
+			 * Do a real check
+			 */
+			if ((l->obj_id == YAFFS_OBJECTID_LOSTNFOUND ||
+			     l->sum == sum || l->hdr_chunk <= 0) &&
+			    yaffs_obj_name_matches(l, name)) {
+				found = l;
+				break;
 			}
 		}
 	}
 
-	return NULL;
+	directory->my_dev->n_name_lookup_checks += n_checked;
+
+#ifdef CONFIG_YAFFS_DIR_INDEX
+	if (n_checked >= YAFFS_DIR_INDEX_THRESHOLD)
+		yaffs_dir_index_build(directory);
+#endif
+
+	return found;
+}
+
+/* True if yaffs_get_obj_name() can get the name without touching NAND */
+static int yaffs_obj_name_in_ram(struct yaffs_obj *obj)
+{
+	if (obj->lazy_loaded && obj->hdr_chunk > 0)
+		return 0;
+	if (obj->obj_id == YAFFS_OBJECTID_LOSTNFOUND)
+		return 1;
+#ifndef CONFIG_YAFFS_NO_SHORT_NAMES
+	if (obj->short_name[0])
+		return 1;
+#endif
+	return obj->hdr_chunk <= 0;
+}
+
+/*
+ * yaffs_find_by_name_cached() answers a lookup from RAM alone, without
+ * reading NAND or changing any state, so that it can run with the gross
+ * lock held shared. It returns YAFFS_FAIL when it cannot, in which case
+ * the caller must fall back to yaffs_find_by_name() under the exclusive
+ * lock: when a candidate's name is longer than a short name or not loaded
+ * yet, or when a directory is big enough to want an index built.
+ */
+int yaffs_find_by_name_cached(struct yaffs_obj *directory, const YCHAR * name,
+			      struct yaffs_obj **found)
+{
+	struct list_head *i;
+	struct yaffs_obj *l;
+	struct yaffs_obj *equiv;
+	int sum;
+#ifdef CONFIG_YAFFS_DIR_INDEX
+	int n_checked = 0;
+#endif
+
+	*found = NULL;
+
+	if (!name || !directory ||
+	    directory->variant_type != YAFFS_OBJECT_TYPE_DIRECTORY)
+		return YAFFS_FAIL;
+
+#ifdef CONFIG_YAFFS_DIR_INDEX
+	if (directory->variant.dir_variant.index) {
+		struct yaffs_dir_index *index =
+		    directory->variant.dir_variant.index;
+		u32 hash = yaffs_calc_name_hash(name);
+
+		list_for_each(i, &index->unhashed) {
+			l = list_entry(i, struct yaffs_obj, dir_hash_link);
+			if (!yaffs_obj_name_in_ram(l))
+				return YAFFS_FAIL;
+			if (yaffs_obj_name_matches(l, name)) {
+				*found = l;
+				goto out;
+			}
+		}
+
+		list_for_each(i, yaffs_dir_index_bucket(index, hash)) {
+			l = list_entry(i, struct yaffs_obj, dir_hash_link);
+			if (l->name_hash != hash)
+				continue;
+			if (!yaffs_obj_name_in_ram(l))
+				return YAFFS_FAIL;
+			if (yaffs_obj_name_matches(l, name)) {
+				*found = l;
+				goto out;
+			}
+		}
+		goto out;
+	}
+#endif
+
+	sum = yaffs_calc_name_sum(name);
+
+	list_for_each(i, &directory->variant.dir_variant.children) {
+		l = list_entry(i, struct yaffs_obj, siblings);
+
+#ifdef CONFIG_YAFFS_DIR_INDEX
+		/* Let the exclusive path build the index */
+		if (++n_checked >= YAFFS_DIR_INDEX_THRESHOLD)
+			return YAFFS_FAIL;
+#endif
+		/* The sum of a lazy loaded object is not known yet */
+		if (l->lazy_loaded && l->hdr_chunk > 0)
+			return YAFFS_FAIL;
+
+		if (l->obj_id == YAFFS_OBJECTID_LOSTNFOUND ||
+		    l->sum == sum || l->hdr_chunk <= 0) {
+			if (!yaffs_obj_name_in_ram(l))
+				return YAFFS_FAIL;
+			if (yaffs_obj_name_matches(l, name)) {
+				*found = l;
+				goto out;
+			}
+		}
+	}
+
+out:
+	/* yaffs_get_equivalent_obj() loads the target if it has to */
+	if (*found && (*found)->variant_type == YAFFS_OBJECT_TYPE_HARDLINK) {
+		equiv = (*found)->variant.hardlink_variant.equiv_obj;
+		if (equiv && equiv->lazy_loaded && equiv->hdr_chunk > 0)
+			return YAFFS_FAIL;
+	}
+	return YAFFS_OK;
 }
 
 /* GetEquivalentObject dereferences any hard links to get to the
@@ -4939,18 +5401,29 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		init_failed = 1;
 
 	dev->cache = NULL;
+	dev->cache_hash = NULL;
+	INIT_LIST_HEAD(&dev->cache_lru);
+	INIT_LIST_HEAD(&dev->cache_free);
+	dev->n_dirty_caches = 0;
 	dev->gc_cleanup_list = NULL;
 
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
 		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
+		int cache_bytes;
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		cache_bytes = dev->param.n_caches * sizeof(struct yaffs_cache);
+
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
+		if (!dev->cache) {
+			dev->cache = vmalloc(cache_bytes);
+			dev->cache_alt = 1;
+		} else {
+			dev->cache_alt = 0;
+		}
 
 		buf = (u8 *) dev->cache;
 
@@ -4959,18 +5432,33 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			list_add_tail(&dev->cache[i].lru, &dev->cache_free);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
-		if (!buf)
-			init_failed = 1;
 
-		dev->cache_last_use = 0;
+		/* Around one bucket per entry */
+		dev->cache_hash_bits = 1;
+		while ((1 << dev->cache_hash_bits) < dev->param.n_caches)
+			dev->cache_hash_bits++;
+
+		if (buf)
+			dev->cache_hash =
+			    kmalloc(sizeof(struct list_head) <<
+				    dev->cache_hash_bits, GFP_NOFS);
+		if (dev->cache_hash)
+			for (i = 0; i < (1 << dev->cache_hash_bits); i++)
+				INIT_LIST_HEAD(&dev->cache_hash[i]);
+
+		if (!buf || !dev->cache_hash)
+			init_failed = 1;
 	}
 
 	dev->cache_hits = 0;
+	dev->cache_misses = 0;
+	dev->cache_flushes = 0;
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
@@ -5084,8 +5572,13 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 				dev->cache[i].data = NULL;
 			}
 
-			kfree(dev->cache);
+			if (dev->cache_alt)
+				vfree(dev->cache);
+			else
+				kfree(dev->cache);
 			dev->cache = NULL;
+			kfree(dev->cache_hash);
+			dev->cache_hash = NULL;
 		}
 
 		kfree(dev->gc_cleanup_list);
@@ -5132,21 +5625,14 @@ int yaffs_get_n_free_chunks(struct yaffs_dev *dev)
 	/* This is what we report to the outside world */
 
 	int n_free;
-	int n_dirty_caches;
 	int blocks_for_checkpt;
-	int i;
 
 	n_free = dev->n_free_chunks;
 	n_free += dev->n_deleted_files;
 
-	/* Now count the number of dirty chunks in the cache and subtract those */
-
-	for (n_dirty_caches = 0, i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].dirty)
-			n_dirty_caches++;
-	}
+	/* Now subtract the dirty chunks in the cache */
 
-	n_free -= n_dirty_caches;
+	n_free -= dev->n_dirty_caches;
 
 	n_free -=
 	    ((dev->param.n_reserved_blocks + 1) * dev->param.chunks_per_block);
@@ -83,7 +83,11 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	1024
+
+/* Bits returned by the gc_control callback */
+#define YAFFS_GC_CONTROL_ENABLE		1
+#define YAFFS_GC_CONTROL_COST_BENEFIT	2	/* yaffs2: weigh age against live chunks */
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -106,11 +110,15 @@
 /* Special sequence number for bad block that failed to be marked bad */
 #define YAFFS_SEQUENCE_BAD_BLOCK	0xFFFF0000
 
-/* ChunkCache is used for short read/write operations.*/
+/* ChunkCache is used for short read/write operations.
+ * An entry in use is on the device LRU list (most recently used last) and
+ * hashed on (object, chunk_id); a free one is only on the free list.
+ */
 struct yaffs_cache {
+	struct list_head lru;
+	struct list_head hash_link;
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -354,9 +362,22 @@ struct yaffs_file_var {
 	struct yaffs_tnode *top;
 };
 
+#ifdef CONFIG_YAFFS_DIR_INDEX
+/* Hash of a directory's children by name, built on the first slow lookup */
+struct yaffs_dir_index {
+	int bits;		/* log2 of the number of buckets */
+	int n_entries;
+	struct list_head unhashed;	/* children whose name is not known yet */
+	struct list_head *buckets;
+};
+#endif
+
 struct yaffs_dir_var {
 	struct list_head children;	/* list of child links */
 	struct list_head dirty;	/* Entry for list of dirty directories */
+#ifdef CONFIG_YAFFS_DIR_INDEX
+	struct yaffs_dir_index *index;	/* NULL until the directory gets big */
+#endif
 };
 
 struct yaffs_symlink_var {
@@ -406,6 +427,11 @@ struct yaffs_obj {
 
 	struct list_head hash_link;	/* list of objects in this hash bucket */
 
+#ifdef CONFIG_YAFFS_DIR_INDEX
+	u32 name_hash;		/* hash of the name for the parent's index */
+	struct list_head dir_hash_link;	/* entry in the parent's index */
+#endif
+
 	struct list_head hard_links;	/* all the equivalent hard linked objects */
 
 	/* directory structure stuff */
@@ -506,8 +532,8 @@ struct yaffs_param {
 	/* reserved blocks on NOR and RAM. */
 
 	int n_caches;		/* If <= 0, then short op caching is disabled, else
-				 * the number of short op caches (don't use too many).
-				 * 10 to 20 is a good bet.
+				 * the number of short op caches. 10 to 20 is a good
+				 * bet, hundreds help workloads of many small writes.
 				 */
 	int use_nand_ecc;	/* Flag to decide whether or not to use NANDECC on data (yaffs1) */
 	int no_tags_ecc;	/* Flag to decide whether or not to do ECC on packed tags (yaffs2) */
@@ -543,6 +569,12 @@ struct yaffs_param {
 	int (*read_chunk_tags_fn) (struct yaffs_dev * dev,
 				   int nand_chunk, u8 * data,
 				   struct yaffs_ext_tags * tags);
+	/* Optional: reads the tags of a run of chunks in one operation.
+	 * Used by the scan, which falls back to read_chunk_tags_fn.
+	 */
+	int (*read_block_tags_fn) (struct yaffs_dev * dev,
+				   int nand_chunk, int n_chunks,
+				   struct yaffs_ext_tags * tags);
 	int (*bad_block_fn) (struct yaffs_dev * dev, int block_no);
 	int (*query_block_fn) (struct yaffs_dev * dev, int block_no,
 			       enum yaffs_block_state * state,
@@ -559,7 +591,7 @@ struct yaffs_param {
 	/* Callback to mark the superblock dirty */
 	void (*sb_dirty_fn) (struct yaffs_dev * dev);
 
-	/*  Callback to control garbage collection. */
+	/*  Callback to control garbage collection, returns YAFFS_GC_CONTROL_xxx bits */
 	unsigned (*gc_control) (struct yaffs_dev * dev);
 
 	/* Debug control flags. Don't use unless you know what you're doing */
@@ -667,6 +699,7 @@ struct yaffs_dev {
 	unsigned gc_block_finder;
 	unsigned gc_dirtiest;
 	unsigned gc_pages_in_use;
+	u32 gc_dirtiest_score;	/* cost-benefit score of gc_dirtiest */
 	unsigned gc_not_done;
 	unsigned gc_block;
 	unsigned gc_chunk;
@@ -685,7 +718,12 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	unsigned cache_alt:1;	/* was allocated using alternative strategy */
+	struct list_head cache_lru;	/* entries in use, least recent first */
+	struct list_head cache_free;
+	struct list_head *cache_hash;
+	int cache_hash_bits;
+	int n_dirty_caches;
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted files live. */
@@ -734,6 +772,17 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 cache_misses;
+	u32 cache_flushes;	/* dirty entries written back */
+	u32 n_name_lookups;
+	u32 n_name_lookup_checks;	/* entries looked at by name lookups */
+	u32 n_scanned_blocks;	/* blocks whose chunks the mount scan read */
+	u32 mount_ms;
+	u32 mount_from_checkpt;
+	u32 n_bg_checkpts;	/* checkpoints written while idle */
+	u32 gc_pass_us_max;	/* longest call to yaffs_gc_block() */
+	u32 fg_gc_pass_us_max;	/* ... of those made on behalf of a writer */
+	u64 gc_pass_us_total;
 
 };
 
@@ -822,6 +871,8 @@ struct yaffs_obj *yaffs_create_dir(struct yaffs_obj *parent, const YCHAR * name,
 				   u32 mode, u32 uid, u32 gid);
 struct yaffs_obj *yaffs_find_by_name(struct yaffs_obj *the_dir,
 				     const YCHAR * name);
+int yaffs_find_by_name_cached(struct yaffs_obj *the_dir, const YCHAR * name,
+			      struct yaffs_obj **found);
 struct yaffs_obj *yaffs_find_by_number(struct yaffs_dev *dev, u32 number);
 
 /* Link operations */
@@ -24,10 +24,12 @@ struct yaffs_linux_context {
 	struct super_block *super;
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
-	struct mutex gross_lock;	/* Gross locking mutex*/
+	unsigned long last_dirtied;	/* jiffies of the last flash change */
+	struct rw_semaphore gross_lock;	/* Gross lock, shared by RAM-only readers */
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
+	u8 *block_oob_buffer;	/* OOB of a whole block, for the scan */
 	struct list_head search_contexts;
 	void (*put_super_fn) (struct super_block * sb);
 
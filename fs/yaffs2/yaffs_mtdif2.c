@@ -165,6 +165,64 @@ int nandmtd2_read_chunk_tags(struct yaffs_dev *dev, int nand_chunk,
 		return YAFFS_FAIL;
 }
 
+/* Reads the tags of a run of chunks with a single OOB read, so drivers that
+ * auto-increment the page do not issue a read command per chunk. Only the
+ * OOB is transferred, so there is no data ECC to report; the tags carry
+ * their own. The OOB lands in the block_oob_buffer allocated at mount.
+ * Fails, leaving the caller to read chunk by chunk, for inband tags, if
+ * that buffer could not be allocated or if the driver cannot read OOB
+ * across pages.
+ */
+int nandmtd2_read_block_tags(struct yaffs_dev *dev, int nand_chunk,
+			     int n_chunks, struct yaffs_ext_tags *tags)
+{
+	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
+	struct mtd_oob_ops ops;
+	int retval;
+	int i;
+	u8 *oob = yaffs_dev_to_lc(dev)->block_oob_buffer;
+
+	loff_t addr = ((loff_t) nand_chunk) * dev->param.total_bytes_per_chunk;
+
+	struct yaffs_packed_tags2 pt;
+
+	int packed_tags_size =
+	    dev->param.no_tags_ecc ? sizeof(pt.t) : sizeof(pt);
+	void *packed_tags_ptr =
+	    dev->param.no_tags_ecc ? (void *)&pt.t : (void *)&pt;
+
+	yaffs_trace(YAFFS_TRACE_MTD,
+		"nandmtd2_read_block_tags chunk %d n_chunks %d",
+		nand_chunk, n_chunks);
+
+	if (dev->param.inband_tags || mtd->oobavail < packed_tags_size ||
+	    !oob || n_chunks > dev->param.chunks_per_block)
+		return YAFFS_FAIL;
+
+	memset(&ops, 0, sizeof(ops));
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooblen = n_chunks * mtd->oobavail;
+	ops.len = ops.ooblen;
+	ops.ooboffs = 0;
+	ops.datbuf = NULL;
+	ops.oobbuf = oob;
+	retval = mtd->read_oob(mtd, addr, &ops);
+
+	if (retval == 0 && ops.oobretlen == ops.ooblen) {
+		for (i = 0; i < n_chunks; i++) {
+			memcpy(packed_tags_ptr, &oob[i * mtd->oobavail],
+			       packed_tags_size);
+			yaffs_unpack_tags2(&tags[i], &pt,
+					   !dev->param.no_tags_ecc);
+		}
+	}
+
+	if (retval == 0 && ops.oobretlen == ops.ooblen)
+		return YAFFS_OK;
+	else
+		return YAFFS_FAIL;
+}
+
 int nandmtd2_mark_block_bad(struct yaffs_dev *dev, int block_no)
 {
 	struct mtd_info *mtd = yaffs_dev_to_mtd(dev);
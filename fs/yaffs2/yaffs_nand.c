@@ -50,6 +50,41 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 	return result;
 }
 
+/* Reads the tags of n_chunks consecutive chunks, one at a time unless the
+ * driver can do them all in one go.
+ */
+int yaffs_rd_block_tags_nand(struct yaffs_dev *dev, int nand_chunk,
+			     int n_chunks, struct yaffs_ext_tags *tags)
+{
+	struct yaffs_block_info *bi;
+	int result = YAFFS_FAIL;
+	int i;
+
+	if (dev->param.read_block_tags_fn)
+		result = dev->param.read_block_tags_fn(dev,
+						nand_chunk - dev->chunk_offset,
+						n_chunks, tags);
+
+	if (result != YAFFS_OK) {
+		for (i = 0; i < n_chunks; i++)
+			result = yaffs_rd_chunk_tags_nand(dev, nand_chunk + i,
+							  NULL, &tags[i]);
+		return result;
+	}
+
+	dev->n_page_reads += n_chunks;
+
+	for (i = 0; i < n_chunks; i++) {
+		if (tags[i].ecc_result > YAFFS_ECC_RESULT_NO_ERROR) {
+			bi = yaffs_get_block_info(dev, (nand_chunk + i) /
+						  dev->param.chunks_per_block);
+			yaffs_handle_chunk_error(dev, bi);
+		}
+	}
+
+	return YAFFS_OK;
+}
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 			     int nand_chunk,
 			     const u8 * buffer, struct yaffs_ext_tags *tags)
@@ -53,6 +53,7 @@
 #include <linux/kthread.h>
 #include <linux/delay.h>
 #include <linux/freezer.h>
+#include <linux/rwsem.h>
 
 #include <asm/div64.h>
 
@@ -94,8 +95,9 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 unsigned int yaffs_trace_mask = YAFFS_TRACE_BAD_BLOCKS | YAFFS_TRACE_ALWAYS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
-unsigned int yaffs_gc_control = 1;
+unsigned int yaffs_gc_control = YAFFS_GC_CONTROL_ENABLE;	/* +2: cost-benefit gc */
 unsigned int yaffs_bg_enable = 1;
+unsigned int yaffs_bg_checkpoint;	/* idle seconds before checkpointing */
 
 /* Module Parameters */
 module_param(yaffs_trace_mask, uint, 0644);
@@ -103,6 +105,7 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_bg_checkpoint, uint, 0644);
 
 
 #define yaffs_inode_to_obj_lv(iptr) ((iptr)->i_private)
@@ -123,14 +126,32 @@ static unsigned yaffs_gc_control_callback(struct yaffs_dev *dev)
 static void yaffs_gross_lock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	down_write(&(yaffs_dev_to_lc(dev)->gross_lock));
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
 }
 
 static void yaffs_gross_unlock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	up_write(&(yaffs_dev_to_lc(dev)->gross_lock));
+}
+
+/*
+ * The shared lock is only for paths that read yaffs state held in RAM.
+ * Anything that may touch NAND, the short op cache or the temp buffers,
+ * or change any object or device field, needs the exclusive lock.
+ */
+static void yaffs_gross_lock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking shared %p", current);
+	down_read(&(yaffs_dev_to_lc(dev)->gross_lock));
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked shared %p", current);
+}
+
+static void yaffs_gross_unlock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking shared %p", current);
+	up_read(&(yaffs_dev_to_lc(dev)->gross_lock));
 }
 
 static void yaffs_fill_inode_from_obj(struct inode *inode,
@@ -153,6 +174,8 @@ static struct inode *yaffs_iget(struct super_block *sb, unsigned long ino)
 	/* NB This is called as a side effect of other functions, but
 	 * we had to release the lock to prevent deadlocks, so
 	 * need to lock again.
+	 * Filling in the inode links the object to it and may repair the
+	 * object's mode, so this needs the exclusive lock.
 	 */
 
 	yaffs_gross_lock(dev);
@@ -371,21 +394,37 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry,
 	struct inode *inode = NULL;
 
 	struct yaffs_dev *dev = yaffs_inode_to_obj(dir)->my_dev;
-
-	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_lock(dev);
+	int lock = (current != yaffs_dev_to_lc(dev)->readdir_process);
+	int cached = YAFFS_FAIL;
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_lookup for %d:%s",
 		yaffs_inode_to_obj(dir)->obj_id, dentry->d_name.name);
 
-	obj = yaffs_find_by_name(yaffs_inode_to_obj(dir), dentry->d_name.name);
+	/* Most lookups can be answered from RAM without excluding others */
+	if (lock) {
+		yaffs_gross_lock_shared(dev);
+		cached = yaffs_find_by_name_cached(yaffs_inode_to_obj(dir),
+						   dentry->d_name.name, &obj);
+		if (cached == YAFFS_OK)
+			obj = yaffs_get_equivalent_obj(obj);
+		yaffs_gross_unlock_shared(dev);
+	}
 
-	obj = yaffs_get_equivalent_obj(obj);	/* in case it was a hardlink */
+	if (cached != YAFFS_OK) {
+		if (lock)
+			yaffs_gross_lock(dev);
 
-	/* Can't hold gross lock when calling yaffs_get_inode() */
-	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_unlock(dev);
+		obj = yaffs_find_by_name(yaffs_inode_to_obj(dir),
+					 dentry->d_name.name);
+
+		/* in case it was a hardlink */
+		obj = yaffs_get_equivalent_obj(obj);
+
+		/* Can't hold gross lock when calling yaffs_get_inode() */
+		if (lock)
+			yaffs_gross_unlock(dev);
+	}
 
 	if (obj) {
 		yaffs_trace(YAFFS_TRACE_OS,
@@ -1020,11 +1059,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user * buffer,
 
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -1040,10 +1079,10 @@ static void *yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	void *ret;
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	if (!alias) {
 		ret = ERR_PTR(-ENOMEM);
@@ -1122,6 +1161,7 @@ static void yaffs_touch_super(struct yaffs_dev *dev)
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_touch_super() sb = %p", sb);
 	if (sb)
 		sb->s_dirt = 1;
+	yaffs_dev_to_lc(dev)->last_dirtied = jiffies;
 }
 
 static int yaffs_readpage_nolock(struct file *f, struct page *pg)
@@ -1461,7 +1501,10 @@ static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf)
 
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_statfs");
 
-	yaffs_gross_lock(dev);
+	/* Only reads counters; the checkpoint size it may cache is the
+	 * same whoever computes it.
+	 */
+	yaffs_gross_lock_shared(dev);
 
 	buf->f_type = YAFFS_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
@@ -1513,7 +1556,7 @@ static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	buf->f_ffree = 0;
 	buf->f_bavail = buf->f_bfree;
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 	return 0;
 }
 
@@ -1667,6 +1710,22 @@ static int yaffs_bg_thread_fn(void *data)
 				next_gc = next_dir_update;
                         }
 		}
+
+		/*
+		 * Checkpoint once the flash has been left alone for a while,
+		 * so that losing power then does not mean a full scan on the
+		 * next mount. The next write invalidates it again.
+		 */
+		if (yaffs_bg_checkpoint && yaffs_bg_enable &&
+		    !dev->is_checkpointed && !yaffs_bg_gc_urgency(dev) &&
+		    time_after(now, context->last_dirtied +
+			       yaffs_bg_checkpoint * HZ)) {
+			yaffs_flush_super(context->super, 1);
+			if (dev->is_checkpointed) {
+				context->super->s_dirt = 0;
+				dev->n_bg_checkpts++;
+			}
+		}
 		yaffs_gross_unlock(dev);
 		expires = next_dir_update;
 		if (time_before(next_gc, expires))
@@ -1757,6 +1816,7 @@ struct yaffs_options {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int n_caches;
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
@@ -1812,6 +1872,8 @@ static int yaffs_parse_options(struct yaffs_options *options,
 			options->empty_lost_and_found_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
+		} else if (!strncmp(cur_opt, "n-caches=", 9)) {
+			options->n_caches = simple_strtol(cur_opt + 9, NULL, 0);
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
 			options->skip_checkpoint_read = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-write")) {
@@ -1984,6 +2046,9 @@ static void yaffs_put_super(struct super_block *sb)
 		yaffs_dev_to_lc(dev)->spare_buffer = NULL;
 	}
 
+	kfree(yaffs_dev_to_lc(dev)->block_oob_buffer);
+	yaffs_dev_to_lc(dev)->block_oob_buffer = NULL;
+
 	kfree(dev);
 }
 
@@ -2025,6 +2090,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	struct yaffs_options options;
 
 	unsigned mount_id;
+	unsigned long mount_start;
 	int found;
 	struct yaffs_linux_context *context_iterator;
 	struct list_head *l;
@@ -2214,7 +2280,12 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->chunks_per_block = YAFFS_CHUNKS_PER_BLOCK;
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
+	if (options.no_cache)
+		param->n_caches = 0;
+	else if (options.n_caches > 0)
+		param->n_caches = options.n_caches;
+	else
+		param->n_caches = 10;
 	param->inband_tags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
@@ -2259,6 +2330,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	if (yaffs_version == 2) {
 		param->write_chunk_tags_fn = nandmtd2_write_chunk_tags;
 		param->read_chunk_tags_fn = nandmtd2_read_chunk_tags;
+		param->read_block_tags_fn = nandmtd2_read_block_tags;
 		param->bad_block_fn = nandmtd2_mark_block_bad;
 		param->query_block_fn = nandmtd2_query_block;
 		yaffs_dev_to_lc(dev)->spare_buffer = 
@@ -2267,6 +2339,11 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 		param->total_bytes_per_chunk = mtd->writesize;
 		param->chunks_per_block = mtd->erasesize / mtd->writesize;
 		n_blocks = YCALCBLOCKS(mtd->size, mtd->erasesize);
+		/* Without it the scan just reads tags chunk by chunk */
+		if (!param->inband_tags)
+			yaffs_dev_to_lc(dev)->block_oob_buffer =
+			    kmalloc(param->chunks_per_block * mtd->oobavail,
+				    GFP_NOFS);
 
 		param->start_block = 0;
 		param->end_block = n_blocks - 1;
@@ -2319,11 +2396,15 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	INIT_LIST_HEAD(&(yaffs_dev_to_lc(dev)->search_contexts));
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
-	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	init_rwsem(&(yaffs_dev_to_lc(dev)->gross_lock));
 
 	yaffs_gross_lock(dev);
 
+	mount_start = jiffies;
 	err = yaffs_guts_initialise(dev);
+	dev->mount_ms = jiffies_to_msecs(jiffies - mount_start);
+	dev->mount_from_checkpt = dev->is_checkpointed;
+	context->last_dirtied = jiffies;
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_read_super: guts initialised %s",
@@ -2444,6 +2525,17 @@ static char *yaffs_dump_dev_part0(char *buf, struct yaffs_dev *dev)
 
 static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 {
+	u64 gc_pass_us_avg = dev->gc_pass_us_total;
+	u32 own_writes = dev->n_page_writes - dev->n_gc_copies;
+	u32 write_amp = 0;
+
+	if (dev->all_gcs)
+		do_div(gc_pass_us_avg, dev->all_gcs);
+	/* flash writes per write not made by gc, x100 */
+	if (own_writes)
+		write_amp = (u32)div_u64((u64)dev->n_page_writes * 100,
+					 own_writes);
+
 	buf +=
 	    sprintf(buf, "data_bytes_per_chunk.. %d\n",
 		    dev->data_bytes_per_chunk);
@@ -2462,6 +2554,14 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	buf += sprintf(buf, "n_page_reads.......... %u\n", dev->n_page_reads);
 	buf += sprintf(buf, "n_erasures............ %u\n", dev->n_erasures);
 	buf += sprintf(buf, "n_gc_copies........... %u\n", dev->n_gc_copies);
+	buf += sprintf(buf, "write_amp_x100........ %u\n", write_amp);
+	buf +=
+	    sprintf(buf, "gc_pass_us_avg........ %llu\n",
+		    (unsigned long long)gc_pass_us_avg);
+	buf += sprintf(buf, "gc_pass_us_max........ %u\n", dev->gc_pass_us_max);
+	buf +=
+	    sprintf(buf, "fg_gc_pass_us_max..... %u\n",
+		    dev->fg_gc_pass_us_max);
 	buf += sprintf(buf, "all_gcs............... %u\n", dev->all_gcs);
 	buf +=
 	    sprintf(buf, "passive_gc_count...... %u\n", dev->passive_gc_count);
@@ -2482,6 +2582,21 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	    sprintf(buf, "n_tags_ecc_unfixed.... %u\n",
 		    dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits............ %u\n", dev->cache_hits);
+	buf += sprintf(buf, "cache_misses.......... %u\n", dev->cache_misses);
+	buf +=
+	    sprintf(buf, "cache_flushes......... %u\n", dev->cache_flushes);
+	buf +=
+	    sprintf(buf, "n_name_lookups........ %u\n", dev->n_name_lookups);
+	buf +=
+	    sprintf(buf, "n_name_lookup_checks.. %u\n",
+		    dev->n_name_lookup_checks);
+	buf += sprintf(buf, "mount_ms.............. %u\n", dev->mount_ms);
+	buf +=
+	    sprintf(buf, "mount_from_checkpt.... %u\n",
+		    dev->mount_from_checkpt);
+	buf +=
+	    sprintf(buf, "n_scanned_blocks...... %u\n", dev->n_scanned_blocks);
+	buf += sprintf(buf, "n_bg_checkpts......... %u\n", dev->n_bg_checkpts);
 	buf +=
 	    sprintf(buf, "n_deleted_files....... %u\n", dev->n_deleted_files);
 	buf +=
@@ -986,6 +986,7 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	struct yaffs_block_index *block_index = NULL;
 	int alt_block_index = 0;
+	struct yaffs_ext_tags *block_tags;
 
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
@@ -1010,9 +1011,16 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	}
 
 	dev->blocks_in_checkpt = 0;
+	dev->n_scanned_blocks = 0;
 
 	chunk_data = yaffs_get_temp_buffer(dev, __LINE__);
 
+	/* Tags of the block being scanned, all read up front. Without it
+	 * they are read a chunk at a time.
+	 */
+	block_tags = kmalloc(dev->param.chunks_per_block *
+			     sizeof(struct yaffs_ext_tags), GFP_NOFS);
+
 	/* Scan all the blocks to determine their state */
 	bi = dev->block_info;
 	for (blk = dev->internal_start_block; blk <= dev->internal_end_block;
@@ -1102,6 +1110,15 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 		deleted = 0;
 
+		if (block_tags &&
+		    (state == YAFFS_BLOCK_STATE_NEEDS_SCANNING ||
+		     state == YAFFS_BLOCK_STATE_ALLOCATING))
+			yaffs_rd_block_tags_nand(dev,
+					blk * dev->param.chunks_per_block,
+					dev->param.chunks_per_block,
+					block_tags);
+		dev->n_scanned_blocks++;
+
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
 		for (c = dev->param.chunks_per_block - 1;
@@ -1114,8 +1131,11 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 			chunk = blk * dev->param.chunks_per_block + c;
 
-			result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL,
-							  &tags);
+			if (block_tags)
+				tags = block_tags[c];
+			else
+				result = yaffs_rd_chunk_tags_nand(dev, chunk,
+								  NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -1575,6 +1595,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	yaffs_skip_rest_of_block(dev);
 
+	kfree(block_tags);
+
 	if (alt_block_index)
 		vfree(block_index);
 	else
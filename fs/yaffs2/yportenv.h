@@ -29,6 +29,8 @@
 #include <linux/fs.h>
 #include <linux/stat.h>
 #include <linux/sort.h>
+#include <linux/list_sort.h>
+#include <linux/hrtimer.h>
 #include <linux/bitops.h>
 
 #define YCHAR char
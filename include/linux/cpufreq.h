@@ -31,10 +31,38 @@
 
 #define CPUFREQ_TRANSITION_NOTIFIER	(0)
 #define CPUFREQ_POLICY_NOTIFIER		(1)
+#define CPUFREQ_BOOST_NOTIFIER		(2)
+#define CPUFREQ_TARGET_NOTIFIER		(3)
+
+/*
+ * Events after which a governor may want to run fast for a while, ahead
+ * of the load it would otherwise see. Passed as the event of the
+ * CPUFREQ_BOOST_NOTIFIER list.
+ */
+enum cpufreq_boost_source {
+	CPUFREQ_BOOST_INPUT,
+	CPUFREQ_BOOST_BINDER,
+};
 
 #ifdef CONFIG_CPU_FREQ
 int cpufreq_register_notifier(struct notifier_block *nb, unsigned int list);
 int cpufreq_unregister_notifier(struct notifier_block *nb, unsigned int list);
+void cpufreq_notify_target(unsigned int cpu);
+void cpufreq_want_boost(enum cpufreq_boost_source source, bool want);
+void __cpufreq_notify_boost(enum cpufreq_boost_source source);
+
+/* Sources some governor asked for with cpufreq_want_boost() */
+extern unsigned long cpufreq_boost_sources;
+
+/*
+ * Cheap enough for hot paths: nothing is called unless a governor wants
+ * boosts from @source.
+ */
+static inline void cpufreq_notify_boost(enum cpufreq_boost_source source)
+{
+	if (test_bit(source, &cpufreq_boost_sources))
+		__cpufreq_notify_boost(source);
+}
 #else		/* CONFIG_CPU_FREQ */
 static inline int cpufreq_register_notifier(struct notifier_block *nb,
 						unsigned int list)
@@ -46,6 +74,16 @@ static inline int cpufreq_unregister_notifier(struct notifier_block *nb,
 {
 	return 0;
 }
+static inline void cpufreq_notify_boost(enum cpufreq_boost_source source)
+{
+}
+static inline void cpufreq_notify_target(unsigned int cpu)
+{
+}
+static inline void cpufreq_want_boost(enum cpufreq_boost_source source,
+				      bool want)
+{
+}
 #endif		/* CONFIG_CPU_FREQ */
 
 /* if (cpufreq_driver->target) exists, the ->governor decides what frequency
@@ -0,0 +1,34 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 Public Kernel Interface
+ *
+ *  Compressor and decompressor for the LZ4 block format, a byte
+ *  oriented LZ77 variant designed for very fast compression and
+ *  decompression at a moderate compression ratio.
+ *
+ *  LZ4 format by Yann Collet, http://code.google.com/p/lz4/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#define LZ4_HASH_LOG		12
+#define LZ4_MEM_COMPRESS	((1 << LZ4_HASH_LOG) * sizeof(u32))
+
+#define lz4_compressbound(x)	((x) + ((x) / 255) + 16)
+
+/* This requires 'wrkmem' of size LZ4_MEM_COMPRESS */
+int lz4_compress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/*
+ * Safe decompression with overrun testing. On entry *dst_len is the
+ * size of the output buffer, on return the size of the decompressed
+ * data.
+ */
+int lz4_decompress_unknownoutputsize(const unsigned char *src,
+			size_t src_len, unsigned char *dst, size_t *dst_len);
+
+#endif
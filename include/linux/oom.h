@@ -70,6 +70,27 @@ extern unsigned long badness(struct task_struct *p, struct mem_cgroup *mem,
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+/*
+ * The Android lowmemorykiller keeps thread group leaders indexed by
+ * oom_adj. Add and del are called with tasklist_lock write-locked.
+ */
+static inline void lowmem_index_init(struct task_struct *p)
+{
+	INIT_LIST_HEAD(&p->lowmem_node);
+}
+extern void lowmem_index_add(struct task_struct *p);
+extern void lowmem_index_del(struct task_struct *p);
+extern void lowmem_index_update(struct task_struct *p);
+extern void lowmem_notify_pressure(void);
+#else
+static inline void lowmem_index_init(struct task_struct *p) { }
+static inline void lowmem_index_add(struct task_struct *p) { }
+static inline void lowmem_index_del(struct task_struct *p) { }
+static inline void lowmem_index_update(struct task_struct *p) { }
+static inline void lowmem_notify_pressure(void) { }
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
@@ -1277,6 +1277,9 @@ struct task_struct {
 #endif
 
 	struct list_head tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	struct list_head lowmem_node;	/* in the lowmemorykiller's index */
+#endif
 #ifdef CONFIG_SMP
 	struct plist_node pushable_tasks;
 #endif
@@ -299,6 +299,44 @@ static inline bool pm_wakeup_pending(void) { return false; }
 
 extern struct mutex pm_mutex;
 
+/* Phases of suspend and resume whose latency is tracked */
+enum pm_latency_phase {
+	PM_LATENCY_EARLY_SUSPEND,	/* early suspend handlers */
+	PM_LATENCY_SYS_SYNC,
+	PM_LATENCY_FREEZE,		/* freezing tasks */
+	PM_LATENCY_DEVICE_SUSPEND,
+	PM_LATENCY_DEVICE_SUSPEND_NOIRQ, /* late suspend */
+	PM_LATENCY_DEVICE_RESUME_NOIRQ,	/* early resume */
+	PM_LATENCY_DEVICE_RESUME,
+	PM_LATENCY_THAW,		/* thawing tasks */
+	PM_LATENCY_LATE_RESUME,		/* late resume handlers */
+	PM_LATENCY_PHASE_COUNT
+};
+
+#ifdef CONFIG_SUSPEND_LATENCY
+static inline ktime_t pm_latency_start(void)
+{
+	return ktime_get();
+}
+
+/* A whole phase, started at @start, has completed */
+extern void pm_latency_phase(enum pm_latency_phase phase, ktime_t start);
+/* One handler of @phase, a device @name or a function @fn, has completed */
+extern void pm_latency_handler(enum pm_latency_phase phase, const char *name,
+			       void *fn, ktime_t start);
+#else
+static inline ktime_t pm_latency_start(void)
+{
+	return ktime_set(0, 0);
+}
+
+static inline void pm_latency_phase(enum pm_latency_phase phase,
+				    ktime_t start) {}
+static inline void pm_latency_handler(enum pm_latency_phase phase,
+				      const char *name, void *fn,
+				      ktime_t start) {}
+#endif
+
 #ifndef CONFIG_HIBERNATE_CALLBACKS
 static inline void lock_system_sleep(void) {}
 static inline void unlock_system_sleep(void) {}
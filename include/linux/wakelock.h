@@ -18,6 +18,7 @@
 
 #include <linux/list.h>
 #include <linux/ktime.h>
+#include <linux/rbtree.h>
 
 /* A wake_lock prevents the system from entering suspend or other low power
  * states when active. If the type is set to WAKE_LOCK_SUSPEND, the wake_lock
@@ -34,6 +35,7 @@ enum {
 
 struct wake_lock {
 	struct list_head    link;
+	struct rb_node      expire_node; /* if active with a timeout */
 	int                 flags;
 	const char         *name;
 	unsigned long       expires;
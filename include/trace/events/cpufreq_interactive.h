@@ -0,0 +1,67 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cpufreq_interactive
+
+#if !defined(_TRACE_CPUFREQ_INTERACTIVE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_CPUFREQ_INTERACTIVE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * One evaluation of the timer: the load seen in the last window and the
+ * frequency it was seen at, which are what the predictor is fed, the
+ * demand predicted for the next window (0 unless predict_load is set),
+ * and the frequency chosen. A recorded sequence of these is enough to
+ * replay the governor's decisions offline with different tunables.
+ */
+TRACE_EVENT(cpufreq_interactive_target,
+
+	TP_PROTO(u32 cpu_id, u32 load, u32 curfreq, u32 predicted,
+		 u32 targfreq),
+
+	TP_ARGS(cpu_id, load, curfreq, predicted, targfreq),
+
+	TP_STRUCT__entry(
+		__field(	u32,		cpu_id		)
+		__field(	u32,		load		)
+		__field(	u32,		curfreq		)
+		__field(	u32,		predicted	)
+		__field(	u32,		targfreq	)
+	),
+
+	TP_fast_assign(
+		__entry->cpu_id = cpu_id;
+		__entry->load = load;
+		__entry->curfreq = curfreq;
+		__entry->predicted = predicted;
+		__entry->targfreq = targfreq;
+	),
+
+	TP_printk("cpu=%u load=%u cur=%u predicted=%u targ=%u",
+		  __entry->cpu_id, __entry->load, __entry->curfreq,
+		  __entry->predicted, __entry->targfreq)
+);
+
+/* A boost request, and the number of CPUs it raised to hispeed_freq */
+TRACE_EVENT(cpufreq_interactive_boost,
+
+	TP_PROTO(const char *source, int raised),
+
+	TP_ARGS(source, raised),
+
+	TP_STRUCT__entry(
+		__string(	source,		source		)
+		__field(	int,		raised		)
+	),
+
+	TP_fast_assign(
+		__assign_str(source, source);
+		__entry->raised = raised;
+	),
+
+	TP_printk("source=%s raised=%d", __get_str(source), __entry->raised)
+);
+
+#endif /* _TRACE_CPUFREQ_INTERACTIVE_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
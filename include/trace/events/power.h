@@ -234,6 +234,35 @@ DEFINE_EVENT(power_domain, power_domain_target,
 
 	TP_ARGS(name, state, cpu_id)
 );
+
+/*
+ * A suspend or resume phase, or one handler run during it, has completed.
+ * Handlers are identified by device name or, for early suspend handlers,
+ * by function.
+ */
+TRACE_EVENT(suspend_latency,
+
+	TP_PROTO(const char *phase, const char *name, void *fn, u64 ns),
+
+	TP_ARGS(phase, name, fn, ns),
+
+	TP_STRUCT__entry(
+		__string(	phase,		phase		)
+		__string(	name,		name ? name : "" )
+		__field(	void *,		fn		)
+		__field(	u64,		ns		)
+	),
+
+	TP_fast_assign(
+		__assign_str(phase, phase);
+		__assign_str(name, name ? name : "");
+		__entry->fn = fn;
+		__entry->ns = ns;
+	),
+
+	TP_printk("phase=%s name=%s fn=%pf nsecs=%llu", __get_str(phase),
+		__get_str(name), __entry->fn, (unsigned long long)__entry->ns)
+);
 #endif /* _TRACE_POWER_H */
 
 /* This part must be outside protection */
@@ -75,6 +75,7 @@ static void early_suspend(struct work_struct *work)
 	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
+	ktime_t start, handler_start;
 
 	mutex_lock(&early_suspend_lock);
 	spin_lock_irqsave(&state_lock, irqflags);
@@ -93,13 +94,18 @@ static void early_suspend(struct work_struct *work)
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
+	start = pm_latency_start();
 	list_for_each_entry(pos, &early_suspend_handlers, link) {
 		if (pos->suspend != NULL) {
 			if (debug_mask & DEBUG_VERBOSE)
 				pr_info("early_suspend: calling %pf\n", pos->suspend);
+			handler_start = pm_latency_start();
 			pos->suspend(pos);
+			pm_latency_handler(PM_LATENCY_EARLY_SUSPEND, NULL,
+					   pos->suspend, handler_start);
 		}
 	}
+	pm_latency_phase(PM_LATENCY_EARLY_SUSPEND, start);
 	mutex_unlock(&early_suspend_lock);
 
 	suspend_sys_sync_queue();
@@ -115,6 +121,7 @@ static void late_resume(struct work_struct *work)
 	struct early_suspend *pos;
 	unsigned long irqflags;
 	int abort = 0;
+	ktime_t start, handler_start;
 
 	mutex_lock(&early_suspend_lock);
 	spin_lock_irqsave(&state_lock, irqflags);
@@ -131,14 +138,19 @@ static void late_resume(struct work_struct *work)
 	}
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
+	start = pm_latency_start();
 	list_for_each_entry_reverse(pos, &early_suspend_handlers, link) {
 		if (pos->resume != NULL) {
 			if (debug_mask & DEBUG_VERBOSE)
 				pr_info("late_resume: calling %pf\n", pos->resume);
 
+			handler_start = pm_latency_start();
 			pos->resume(pos);
+			pm_latency_handler(PM_LATENCY_LATE_RESUME, NULL,
+					   pos->resume, handler_start);
 		}
 	}
+	pm_latency_phase(PM_LATENCY_LATE_RESUME, start);
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: done\n");
 abort:
@@ -89,6 +89,7 @@ static int suspend_test(int level)
  */
 static int suspend_prepare(void)
 {
+	ktime_t start;
 	int error;
 
 	if (!suspend_ops || !suspend_ops->enter)
@@ -104,7 +105,9 @@ static int suspend_prepare(void)
 	if (error)
 		goto Finish;
 
+	start = pm_latency_start();
 	error = suspend_freeze_processes();
+	pm_latency_phase(PM_LATENCY_FREEZE, start);
 	if (!error)
 		return 0;
 
@@ -136,6 +139,7 @@ void __attribute__ ((weak)) arch_suspend_enable_irqs(void)
  */
 static int suspend_enter(suspend_state_t state)
 {
+	ktime_t start;
 	int error;
 
 	if (suspend_ops->prepare) {
@@ -144,7 +148,9 @@ static int suspend_enter(suspend_state_t state)
 			goto Platform_finish;
 	}
 
+	start = pm_latency_start();
 	error = dpm_suspend_noirq(PMSG_SUSPEND);
+	pm_latency_phase(PM_LATENCY_DEVICE_SUSPEND_NOIRQ, start);
 	if (error) {
 		printk(KERN_ERR "PM: Some devices failed to power down\n");
 		goto Platform_finish;
@@ -185,7 +191,9 @@ static int suspend_enter(suspend_state_t state)
 	if (suspend_ops->wake)
 		suspend_ops->wake();
 
+	start = pm_latency_start();
 	dpm_resume_noirq(PMSG_RESUME);
+	pm_latency_phase(PM_LATENCY_DEVICE_RESUME_NOIRQ, start);
 
  Platform_finish:
 	if (suspend_ops->finish)
@@ -201,6 +209,7 @@ static int suspend_enter(suspend_state_t state)
  */
 int suspend_devices_and_enter(suspend_state_t state)
 {
+	ktime_t start;
 	int error;
 
 	if (!suspend_ops)
@@ -214,7 +223,9 @@ int suspend_devices_and_enter(suspend_state_t state)
 	}
 	suspend_console();
 	suspend_test_start();
+	start = pm_latency_start();
 	error = dpm_suspend_start(PMSG_SUSPEND);
+	pm_latency_phase(PM_LATENCY_DEVICE_SUSPEND, start);
 	if (error) {
 		printk(KERN_ERR "PM: Some devices failed to suspend\n");
 		goto Recover_platform;
@@ -227,7 +238,9 @@ int suspend_devices_and_enter(suspend_state_t state)
 
  Resume_devices:
 	suspend_test_start();
+	start = pm_latency_start();
 	dpm_resume_end(PMSG_RESUME);
+	pm_latency_phase(PM_LATENCY_DEVICE_RESUME, start);
 	suspend_test_finish("resume devices");
 	resume_console();
  Close:
@@ -250,7 +263,10 @@ int suspend_devices_and_enter(suspend_state_t state)
  */
 static void suspend_finish(void)
 {
+	ktime_t start = pm_latency_start();
+
 	suspend_thaw_processes();
+	pm_latency_phase(PM_LATENCY_THAW, start);
 	usermodehelper_enable();
 	pm_notifier_call_chain(PM_POST_SUSPEND);
 	pm_restore_console();
@@ -0,0 +1,249 @@
+/*
+ * debugfs file to track the latency of suspend and resume phases
+ *
+ * Copyright (c) 2011, Google, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ */
+
+#include <linux/debugfs.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/suspend.h>
+#include <linux/uaccess.h>
+#include <trace/events/power.h>
+
+/* number of slowest handlers kept */
+#define SUSPEND_LATENCY_TOP		16
+#define SUSPEND_LATENCY_NAME_LEN	32
+
+static const char *phase_names[PM_LATENCY_PHASE_COUNT] = {
+	[PM_LATENCY_EARLY_SUSPEND]	= "early_suspend",
+	[PM_LATENCY_SYS_SYNC]		= "sys_sync",
+	[PM_LATENCY_FREEZE]		= "freeze",
+	[PM_LATENCY_DEVICE_SUSPEND]	= "device_suspend",
+	[PM_LATENCY_DEVICE_SUSPEND_NOIRQ] = "device_suspend_noirq",
+	[PM_LATENCY_DEVICE_RESUME_NOIRQ] = "device_resume_noirq",
+	[PM_LATENCY_DEVICE_RESUME]	= "device_resume",
+	[PM_LATENCY_THAW]		= "thaw",
+	[PM_LATENCY_LATE_RESUME]	= "late_resume",
+};
+
+struct phase_stat {
+	unsigned int count;
+	u64 total_ns;
+	u64 max_ns;
+	u64 last_ns;
+};
+
+/*
+ * A handler is identified by its phase and either a device name, copied
+ * since the device may go away, or the function it runs.
+ */
+struct handler_stat {
+	enum pm_latency_phase phase;
+	char name[SUSPEND_LATENCY_NAME_LEN];
+	void *fn;
+	unsigned int count;
+	u64 max_ns;
+	u64 last_ns;
+};
+
+/* device callbacks may run from the async suspend threads concurrently */
+static DEFINE_SPINLOCK(suspend_latency_lock);
+static struct phase_stat phase_stats[PM_LATENCY_PHASE_COUNT];
+static struct handler_stat top_handlers[SUSPEND_LATENCY_TOP];
+static int nr_top_handlers;
+
+static u64 latency_since(ktime_t start)
+{
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+static unsigned long long ns_to_us(u64 ns)
+{
+	do_div(ns, NSEC_PER_USEC);
+	return ns;
+}
+
+void pm_latency_phase(enum pm_latency_phase phase, ktime_t start)
+{
+	struct phase_stat *stat = &phase_stats[phase];
+	u64 ns = latency_since(start);
+	unsigned long flags;
+
+	trace_suspend_latency(phase_names[phase], NULL, NULL, ns);
+
+	spin_lock_irqsave(&suspend_latency_lock, flags);
+	stat->count++;
+	stat->total_ns += ns;
+	stat->last_ns = ns;
+	if (ns > stat->max_ns)
+		stat->max_ns = ns;
+	spin_unlock_irqrestore(&suspend_latency_lock, flags);
+}
+
+static bool handler_matches(struct handler_stat *h,
+			    enum pm_latency_phase phase, const char *name,
+			    void *fn)
+{
+	if (h->phase != phase || h->fn != fn)
+		return false;
+	return !name || !strncmp(h->name, name, SUSPEND_LATENCY_NAME_LEN - 1);
+}
+
+/*
+ * Keeps the SUSPEND_LATENCY_TOP handlers with the largest worst case. A
+ * handler already in the table is updated in place; otherwise it replaces
+ * the entry with the smallest worst case if it was slower than that.
+ */
+void pm_latency_handler(enum pm_latency_phase phase, const char *name,
+			void *fn, ktime_t start)
+{
+	struct handler_stat *h, *min = NULL;
+	u64 ns = latency_since(start);
+	unsigned long flags;
+	int i;
+
+	trace_suspend_latency(phase_names[phase], name, fn, ns);
+
+	spin_lock_irqsave(&suspend_latency_lock, flags);
+	for (i = 0; i < nr_top_handlers; i++) {
+		h = &top_handlers[i];
+		if (handler_matches(h, phase, name, fn)) {
+			h->count++;
+			h->last_ns = ns;
+			if (ns > h->max_ns)
+				h->max_ns = ns;
+			goto out;
+		}
+		if (!min || h->max_ns < min->max_ns)
+			min = h;
+	}
+
+	if (nr_top_handlers < SUSPEND_LATENCY_TOP)
+		h = &top_handlers[nr_top_handlers++];
+	else if (ns > min->max_ns)
+		h = min;
+	else
+		goto out;
+
+	h->phase = phase;
+	h->fn = fn;
+	if (name)
+		strlcpy(h->name, name, sizeof(h->name));
+	else
+		h->name[0] = '\0';
+	h->count = 1;
+	h->max_ns = ns;
+	h->last_ns = ns;
+out:
+	spin_unlock_irqrestore(&suspend_latency_lock, flags);
+}
+
+static int handler_cmp(const void *a, const void *b)
+{
+	const struct handler_stat *ha = a, *hb = b;
+
+	if (ha->max_ns == hb->max_ns)
+		return 0;
+	return ha->max_ns > hb->max_ns ? -1 : 1;
+}
+
+static int suspend_latency_debug_show(struct seq_file *s, void *data)
+{
+	struct phase_stat phases[PM_LATENCY_PHASE_COUNT];
+	struct handler_stat top[SUSPEND_LATENCY_TOP];
+	unsigned long flags;
+	int i, n;
+	u64 avg;
+
+	spin_lock_irqsave(&suspend_latency_lock, flags);
+	memcpy(phases, phase_stats, sizeof(phases));
+	n = nr_top_handlers;
+	memcpy(top, top_handlers, n * sizeof(top[0]));
+	spin_unlock_irqrestore(&suspend_latency_lock, flags);
+
+	seq_printf(s, "%-24s %8s %10s %10s %10s\n", "phase", "count",
+		   "avg_us", "max_us", "last_us");
+	for (i = 0; i < PM_LATENCY_PHASE_COUNT; i++) {
+		avg = phases[i].total_ns;
+		if (phases[i].count)
+			do_div(avg, phases[i].count);
+		seq_printf(s, "%-24s %8u %10llu %10llu %10llu\n",
+			   phase_names[i], phases[i].count,
+			   ns_to_us(avg), ns_to_us(phases[i].max_ns),
+			   ns_to_us(phases[i].last_ns));
+	}
+
+	sort(top, n, sizeof(top[0]), handler_cmp, NULL);
+	seq_printf(s, "\nslowest handlers:\n%-24s %8s %10s %10s  %s\n",
+		   "phase", "count", "max_us", "last_us", "handler");
+	for (i = 0; i < n; i++) {
+		seq_printf(s, "%-24s %8u %10llu %10llu  ",
+			   phase_names[top[i].phase], top[i].count,
+			   ns_to_us(top[i].max_ns),
+			   ns_to_us(top[i].last_ns));
+		if (top[i].name[0])
+			seq_printf(s, "%s\n", top[i].name);
+		else
+			seq_printf(s, "%pf\n", top[i].fn);
+	}
+	return 0;
+}
+
+static int suspend_latency_debug_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, suspend_latency_debug_show, NULL);
+}
+
+/* any write clears the statistics */
+static ssize_t suspend_latency_debug_write(struct file *file,
+					   const char __user *buf,
+					   size_t count, loff_t *ppos)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&suspend_latency_lock, flags);
+	memset(phase_stats, 0, sizeof(phase_stats));
+	nr_top_handlers = 0;
+	spin_unlock_irqrestore(&suspend_latency_lock, flags);
+	return count;
+}
+
+static const struct file_operations suspend_latency_debug_fops = {
+	.open		= suspend_latency_debug_open,
+	.read		= seq_read,
+	.write		= suspend_latency_debug_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int __init suspend_latency_debug_init(void)
+{
+	struct dentry *d;
+
+	d = debugfs_create_file("suspend_latency", 0644, NULL, NULL,
+		&suspend_latency_debug_fops);
+	if (!d) {
+		pr_err("Failed to create suspend_latency debug file\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+late_initcall(suspend_latency_debug_init);
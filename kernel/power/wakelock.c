@@ -14,12 +14,15 @@
  */
 
 #include <linux/module.h>
+#include <linux/percpu.h>
 #include <linux/platform_device.h>
+#include <linux/rbtree.h>
 #include <linux/rtc.h>
 #include <linux/suspend.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #ifdef CONFIG_WAKELOCK_STAT
+#include <linux/debugfs.h>
 #include <linux/proc_fs.h>
 #endif
 #include "power.h"
@@ -43,6 +46,22 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+
+/*
+ * Active wake locks of each type, as needed by has_wake_lock(): a count
+ * of the ones without a timeout and the others in a tree ordered by
+ * expiry, with both ends cached. Finding out how long the system must
+ * stay awake is then O(1) rather than a walk of every active lock, and
+ * only locks that have actually expired are visited to retire them.
+ * Protected by list_lock.
+ */
+struct wake_lock_expire_queue {
+	struct rb_root root;
+	struct rb_node *first;	/* expires first */
+	struct rb_node *last;	/* expires last */
+	int no_timeout;
+};
+static struct wake_lock_expire_queue expire_queues[WAKE_LOCK_TYPE_COUNT];
 static int current_event_num;
 static int suspend_sys_sync_count;
 static DEFINE_SPINLOCK(suspend_sys_sync_lock);
@@ -64,6 +83,19 @@ static struct wake_lock deleted_wake_locks;
 static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
 
+/*
+ * Calls into the wake lock API, counted per cpu and outside list_lock so
+ * that counting them costs no contention. Reported in debugfs as
+ * wakelock_ops; sampling it twice gives wake_lock/wake_unlock rates.
+ */
+struct wakelock_cpu_stats {
+	unsigned long lock;
+	unsigned long unlock;
+	unsigned long expire;
+};
+static DEFINE_PER_CPU(struct wakelock_cpu_stats, wakelock_cpu_stats);
+#define wakelock_stat_inc(field) this_cpu_inc(wakelock_cpu_stats.field)
+
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 {
 	struct timespec ts;
@@ -145,16 +177,37 @@ static int wakelock_stats_show(struct seq_file *m, void *unused)
 	return 0;
 }
 
-static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
+static int wakelock_ops_show(struct seq_file *m, void *unused)
+{
+	struct wakelock_cpu_stats *stats, total = {};
+	int cpu;
+
+	seq_puts(m, "cpu\tlock\tunlock\texpire\n");
+	for_each_possible_cpu(cpu) {
+		stats = &per_cpu(wakelock_cpu_stats, cpu);
+		seq_printf(m, "%d\t%lu\t%lu\t%lu\n", cpu, stats->lock,
+			   stats->unlock, stats->expire);
+		total.lock += stats->lock;
+		total.unlock += stats->unlock;
+		total.expire += stats->expire;
+	}
+	seq_printf(m, "total\t%lu\t%lu\t%lu\n", total.lock, total.unlock,
+		   total.expire);
+	return 0;
+}
+
+/*
+ * @now is read by the caller once list_lock is held, so that it is never
+ * older than a last_time another cpu stored under the lock.
+ */
+static void wake_unlock_stat_locked(struct wake_lock *lock, int expired,
+				    ktime_t now)
 {
 	ktime_t duration;
-	ktime_t now;
 	if (!(lock->flags & WAKE_LOCK_ACTIVE))
 		return;
 	if (get_expired_time(lock, &now))
 		expired = 1;
-	else
-		now = ktime_get();
 	lock->stat.count++;
 	if (expired)
 		lock->stat.expire_count++;
@@ -162,7 +215,7 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 	lock->stat.total_time = ktime_add(lock->stat.total_time, duration);
 	if (ktime_to_ns(duration) > ktime_to_ns(lock->stat.max_time))
 		lock->stat.max_time = duration;
-	lock->stat.last_time = ktime_get();
+	lock->stat.last_time = now;
 	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
 		duration = ktime_sub(now, last_sleep_time_update);
 		lock->stat.prevent_suspend_time = ktime_add(
@@ -171,13 +224,12 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 	}
 }
 
-static void update_sleep_wait_stats_locked(int done)
+static void update_sleep_wait_stats_locked(int done, ktime_t now)
 {
 	struct wake_lock *lock;
-	ktime_t now, etime, elapsed, add;
+	ktime_t etime, elapsed, add;
 	int expired;
 
-	now = ktime_get();
 	elapsed = ktime_sub(now, last_sleep_time_update);
 	list_for_each_entry(lock, &active_wake_locks[WAKE_LOCK_SUSPEND], link) {
 		expired = get_expired_time(lock, &etime);
@@ -196,14 +248,71 @@ static void update_sleep_wait_stats_locked(int done)
 	}
 	last_sleep_time_update = now;
 }
+#else
+#define wakelock_stat_inc(field) do { } while (0)
 #endif
 
+/* Caller must acquire the list_lock spinlock, and set the lock's flags */
+static void wake_lock_enqueue_locked(struct wake_lock *lock, int type)
+{
+	struct wake_lock_expire_queue *q = &expire_queues[type];
+	struct rb_node **p = &q->root.rb_node;
+	struct rb_node *parent = NULL;
+	struct wake_lock *entry;
+	bool leftmost = true, rightmost = true;
+
+	if (!(lock->flags & WAKE_LOCK_AUTO_EXPIRE)) {
+		q->no_timeout++;
+		return;
+	}
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct wake_lock, expire_node);
+		if (time_before(lock->expires, entry->expires)) {
+			p = &parent->rb_left;
+			rightmost = false;
+		} else {
+			p = &parent->rb_right;
+			leftmost = false;
+		}
+	}
+	rb_link_node(&lock->expire_node, parent, p);
+	rb_insert_color(&lock->expire_node, &q->root);
+	if (leftmost)
+		q->first = &lock->expire_node;
+	if (rightmost)
+		q->last = &lock->expire_node;
+}
+
+/* Caller must acquire the list_lock spinlock, before changing the flags */
+static void wake_lock_dequeue_locked(struct wake_lock *lock, int type)
+{
+	struct wake_lock_expire_queue *q = &expire_queues[type];
+	struct rb_node *node = &lock->expire_node;
+
+	if (!(lock->flags & WAKE_LOCK_ACTIVE))
+		return;
+
+	if (!(lock->flags & WAKE_LOCK_AUTO_EXPIRE)) {
+		q->no_timeout--;
+		return;
+	}
+
+	if (q->first == node)
+		q->first = rb_next(node);
+	if (q->last == node)
+		q->last = rb_prev(node);
+	rb_erase(node, &q->root);
+}
 
 static void expire_wake_lock(struct wake_lock *lock)
 {
+	wake_lock_dequeue_locked(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
 #ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 1);
+	wake_unlock_stat_locked(lock, 1, ktime_get());
 #endif
+	wakelock_stat_inc(expire);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -236,21 +345,24 @@ static void print_active_locks(int type)
 
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct wake_lock_expire_queue *q;
+	struct wake_lock *lock;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	q = &expire_queues[type];
+	while (q->first) {
+		lock = rb_entry(q->first, struct wake_lock, expire_node);
+		if ((long)(lock->expires - jiffies) > 0)
+			break;
+		expire_wake_lock(lock);
 	}
-	return max_timeout;
+
+	if (q->no_timeout)
+		return -1;
+	if (!q->last)
+		return 0;
+	lock = rb_entry(q->last, struct wake_lock, expire_node);
+	return lock->expires - jiffies;
 }
 
 long has_wake_lock(int type)
@@ -267,10 +379,14 @@ long has_wake_lock(int type)
 
 static void suspend_sys_sync(struct work_struct *work)
 {
+	ktime_t start;
+
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("PM: Syncing filesystems...\n");
 
+	start = pm_latency_start();
 	sys_sync();
+	pm_latency_phase(PM_LATENCY_SYS_SYNC, start);
 
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("sync done.\n");
@@ -459,7 +575,9 @@ void wake_lock_destroy(struct wake_lock *lock)
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_lock_destroy name=%s\n", lock->name);
 	spin_lock_irqsave(&list_lock, irqflags);
-	lock->flags &= ~WAKE_LOCK_INITIALIZED;
+	wake_lock_dequeue_locked(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
+	lock->flags &= ~(WAKE_LOCK_INITIALIZED | WAKE_LOCK_ACTIVE |
+			 WAKE_LOCK_AUTO_EXPIRE);
 #ifdef CONFIG_WAKELOCK_STAT
 	if (lock->stat.count) {
 		deleted_wake_locks.stat.count += lock->stat.count;
@@ -486,8 +604,15 @@ static void wake_lock_internal(
 	int type;
 	unsigned long irqflags;
 	long expire_in;
+#ifdef CONFIG_WAKELOCK_STAT
+	ktime_t now;
+#endif
 
+	wakelock_stat_inc(lock);
 	spin_lock_irqsave(&list_lock, irqflags);
+#ifdef CONFIG_WAKELOCK_STAT
+	now = ktime_get();
+#endif
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
 	BUG_ON(!(lock->flags & WAKE_LOCK_INITIALIZED));
@@ -500,14 +625,15 @@ static void wake_lock_internal(
 	}
 	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
 	    (long)(lock->expires - jiffies) <= 0) {
-		wake_unlock_stat_locked(lock, 0);
-		lock->stat.last_time = ktime_get();
+		wake_unlock_stat_locked(lock, 0, now);
+		lock->stat.last_time = now;
 	}
 #endif
+	wake_lock_dequeue_locked(lock, type);
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
 #ifdef CONFIG_WAKELOCK_STAT
-		lock->stat.last_time = ktime_get();
+		lock->stat.last_time = now;
 #endif
 	}
 	list_del(&lock->link);
@@ -526,13 +652,14 @@ static void wake_lock_internal(
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
 		list_add(&lock->link, &active_wake_locks[type]);
 	}
+	wake_lock_enqueue_locked(lock, type);
 	if (type == WAKE_LOCK_SUSPEND) {
 		current_event_num++;
 #ifdef CONFIG_WAKELOCK_STAT
 		if (lock == &main_wake_lock)
-			update_sleep_wait_stats_locked(1);
+			update_sleep_wait_stats_locked(1, now);
 		else if (!wake_lock_active(&main_wake_lock))
-			update_sleep_wait_stats_locked(0);
+			update_sleep_wait_stats_locked(0, now);
 #endif
 		if (has_timeout)
 			expire_in = has_wake_lock_locked(type);
@@ -571,13 +698,22 @@ void wake_unlock(struct wake_lock *lock)
 {
 	int type;
 	unsigned long irqflags;
+#ifdef CONFIG_WAKELOCK_STAT
+	ktime_t now;
+#endif
+
+	wakelock_stat_inc(unlock);
 	spin_lock_irqsave(&list_lock, irqflags);
+#ifdef CONFIG_WAKELOCK_STAT
+	now = ktime_get();
+#endif
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
 #ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 0);
+	wake_unlock_stat_locked(lock, 0, now);
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
+	wake_lock_dequeue_locked(lock, type);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
 	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
@@ -600,7 +736,7 @@ void wake_unlock(struct wake_lock *lock)
 			if (debug_mask & DEBUG_SUSPEND)
 				print_active_locks(WAKE_LOCK_SUSPEND);
 #ifdef CONFIG_WAKELOCK_STAT
-			update_sleep_wait_stats_locked(0);
+			update_sleep_wait_stats_locked(0, now);
 #endif
 		}
 	}
@@ -627,13 +763,32 @@ static const struct file_operations wakelock_stats_fops = {
 	.release = single_release,
 };
 
+#ifdef CONFIG_WAKELOCK_STAT
+static struct dentry *wakelock_ops_dentry;
+
+static int wakelock_ops_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, wakelock_ops_show, NULL);
+}
+
+static const struct file_operations wakelock_ops_fops = {
+	.owner = THIS_MODULE,
+	.open = wakelock_ops_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+#endif
+
 static int __init wakelocks_init(void)
 {
 	int ret;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
+	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++) {
 		INIT_LIST_HEAD(&active_wake_locks[i]);
+		expire_queues[i].root = RB_ROOT;
+	}
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
@@ -672,6 +827,9 @@ static int __init wakelocks_init(void)
 
 #ifdef CONFIG_WAKELOCK_STAT
 	proc_create("wakelocks", S_IRUGO, NULL, &wakelock_stats_fops);
+	wakelock_ops_dentry = debugfs_create_file("wakelock_ops", S_IRUGO,
+						  NULL, NULL,
+						  &wakelock_ops_fops);
 #endif
 
 	return 0;
@@ -694,6 +852,7 @@ err_platform_device_register:
 static void  __exit wakelocks_exit(void)
 {
 #ifdef CONFIG_WAKELOCK_STAT
+	debugfs_remove(wakelock_ops_dentry);
 	remove_proc_entry("wakelocks", NULL);
 #endif
 	destroy_workqueue(suspend_work_queue);
@@ -0,0 +1,152 @@
+/*
+ *  LZ4 Compressor
+ *
+ *  Greedy single-pass compressor for the LZ4 block format. Candidate
+ *  matches are found through a small hash table of input positions,
+ *  so the working memory is LZ4_MEM_COMPRESS bytes regardless of the
+ *  input size.
+ *
+ *  LZ4 format by Yann Collet, http://code.google.com/p/lz4/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static inline u32 lz4_hash(u32 seq)
+{
+	return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline u32 lz4_read32(const unsigned char *p)
+{
+	return get_unaligned((const u32 *)p);
+}
+
+/* Emit a length continuation: a run of 255s and a final remainder byte */
+static inline unsigned char *lz4_put_length(unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	u32 *hash_table = wrkmem;
+	const unsigned char *ip = src;
+	const unsigned char *anchor = src;
+	const unsigned char * const iend = src + src_len;
+	const unsigned char * const mflimit = iend - MFLIMIT;
+	const unsigned char * const matchlimit = iend - LASTLITERALS;
+	unsigned char *op = dst;
+	unsigned char * const oend = dst + *dst_len;
+	unsigned char *token;
+	size_t lit_len, match_len;
+
+	/* Offsets in the hash table are 32 bit */
+	if (src_len > 0x7e000000)
+		return -EINVAL;
+
+	if (src_len < MFLIMIT + 1)
+		goto last_literals;
+
+	/* All entries start out pointing at the first input byte */
+	memset(hash_table, 0, LZ4_MEM_COMPRESS);
+	ip++;
+
+	while (ip < mflimit) {
+		const unsigned char *ref;
+		u32 seq = lz4_read32(ip);
+		u32 h = lz4_hash(seq);
+
+		ref = src + hash_table[h];
+		hash_table[h] = ip - src;
+
+		if (ip - ref > MAX_DISTANCE || lz4_read32(ref) != seq) {
+			ip += 1 + ((ip - anchor) >> SKIP_TRIGGER);
+			continue;
+		}
+
+		/* Extend the match backwards into pending literals */
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		match_len = MINMATCH;
+		while (ip + match_len < matchlimit &&
+				ip[match_len] == ref[match_len])
+			match_len++;
+
+		lit_len = ip - anchor;
+
+		/*
+		 * Worst case for this sequence: token, literal length
+		 * bytes, literals, offset and match length bytes.
+		 */
+		if (unlikely(op + 1 + lit_len / 255 + 1 + lit_len + 2 +
+				match_len / 255 + 1 > oend))
+			return -E2BIG;
+
+		token = op++;
+		if (lit_len >= RUN_MASK) {
+			*token = RUN_MASK << ML_BITS;
+			op = lz4_put_length(op, lit_len - RUN_MASK);
+		} else {
+			*token = lit_len << ML_BITS;
+		}
+
+		memcpy(op, anchor, lit_len);
+		op += lit_len;
+
+		put_unaligned_le16(ip - ref, op);
+		op += 2;
+
+		if (match_len - MINMATCH >= ML_MASK) {
+			*token |= ML_MASK;
+			op = lz4_put_length(op, match_len - MINMATCH - ML_MASK);
+		} else {
+			*token |= match_len - MINMATCH;
+		}
+
+		ip += match_len;
+		anchor = ip;
+
+		/* Index a position inside the match to find the next one */
+		if (ip < mflimit)
+			hash_table[lz4_hash(lz4_read32(ip - 2))] = ip - 2 - src;
+	}
+
+last_literals:
+	lit_len = iend - anchor;
+	if (unlikely(op + 1 + lit_len / 255 + 1 + lit_len > oend))
+		return -E2BIG;
+
+	if (lit_len >= RUN_MASK) {
+		*op++ = RUN_MASK << ML_BITS;
+		op = lz4_put_length(op, lit_len - RUN_MASK);
+	} else {
+		*op++ = lit_len << ML_BITS;
+	}
+	memcpy(op, anchor, lit_len);
+	op += lit_len;
+
+	*dst_len = op - dst;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Compressor");
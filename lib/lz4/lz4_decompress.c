@@ -0,0 +1,103 @@
+/*
+ *  LZ4 Decompressor
+ *
+ *  Every length and offset read from the compressed stream is checked
+ *  against the input and output bounds, so corrupted data can never
+ *  cause reads or writes outside the supplied buffers.
+ *
+ *  LZ4 format by Yann Collet, http://code.google.com/p/lz4/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+/* Read a length continuation, returns -1 on input overrun */
+static inline int lz4_get_length(const unsigned char **ipp,
+			const unsigned char *iend, size_t *len)
+{
+	const unsigned char *ip = *ipp;
+	unsigned char s;
+
+	do {
+		if (unlikely(ip >= iend))
+			return -1;
+		s = *ip++;
+		*len += s;
+	} while (s == 255);
+
+	*ipp = ip;
+	return 0;
+}
+
+int lz4_decompress_unknownoutputsize(const unsigned char *src,
+			size_t src_len, unsigned char *dst, size_t *dst_len)
+{
+	const unsigned char *ip = src;
+	const unsigned char * const iend = src + src_len;
+	unsigned char *op = dst;
+	unsigned char * const oend = dst + *dst_len;
+
+	while (ip < iend) {
+		const unsigned char *ref;
+		unsigned int token = *ip++;
+		size_t offset, len;
+
+		len = token >> ML_BITS;
+		if (len == RUN_MASK && lz4_get_length(&ip, iend, &len))
+			return -EINVAL;
+
+		if (unlikely(len > iend - ip || len > oend - op))
+			return -EINVAL;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		/* The last sequence carries literals only */
+		if (ip == iend)
+			break;
+
+		if (unlikely(iend - ip < 2))
+			return -EINVAL;
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		if (unlikely(!offset || offset > op - dst))
+			return -EINVAL;
+		ref = op - offset;
+
+		len = token & ML_MASK;
+		if (len == ML_MASK && lz4_get_length(&ip, iend, &len))
+			return -EINVAL;
+		len += MINMATCH;
+
+		if (unlikely(len > oend - op))
+			return -EINVAL;
+
+		/* Source and destination overlap when offset < len */
+		if (offset >= sizeof(u64)) {
+			while (len >= sizeof(u64)) {
+				put_unaligned(get_unaligned((const u64 *)ref),
+						(u64 *)op);
+				op += sizeof(u64);
+				ref += sizeof(u64);
+				len -= sizeof(u64);
+			}
+		}
+		while (len--)
+			*op++ = *ref++;
+	}
+
+	*dst_len = op - dst;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(lz4_decompress_unknownoutputsize);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 Decompressor");
@@ -0,0 +1,26 @@
+/*
+ *  lz4defs.h -- constants of the LZ4 block format
+ *
+ *  LZ4 format by Yann Collet, http://code.google.com/p/lz4/
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#define MINMATCH	4
+
+/* The last match must start at least MFLIMIT bytes before end of input */
+#define MFLIMIT		12
+/* The last LASTLITERALS bytes of input are always stored as literals */
+#define LASTLITERALS	5
+
+#define MAX_DISTANCE	0xffff
+
+#define ML_BITS		4
+#define ML_MASK		((1U << ML_BITS) - 1)
+#define RUN_BITS	(8 - ML_BITS)
+#define RUN_MASK	((1U << RUN_BITS) - 1)
+
+/* Skip ahead faster on incompressible data */
+#define SKIP_TRIGGER	6